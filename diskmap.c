@@ -18,6 +18,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 // have a look at README.md for more information
 
+#define _GNU_SOURCE // for mremap
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -29,6 +30,14 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <unistd.h>
 #include <math.h>
 #include <stdbool.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "diskmap.h"
 
 #define min(X,Y) (((X) < (Y)) ? (X) : (Y))
 #define max(X,Y) (((X) > (Y)) ? (X) : (Y))
@@ -46,77 +55,672 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 int debug_multimap = 0;
 
 
-
 //********************************************************************************
 // memory management
 //********************************************************************************
 
-/** Store "pointers" to memory, as indices, starting from the header */
-typedef uint64_t MEMPTR;
+/** Positions of blocks, like MEMPTR */
 typedef uint64_t BLOCK_POS;
 
 /** Macro for convenience, assumes memory handle called 'mem' */
 #define MEMPTR(POS) ((void*)(mem->header) + (POS))
 #define BLOCK(POS) ((struct mem_block*)((void*)(mem->header) + (POS)))
+#define FREE_BLOCK(POS) ((struct mem_free_block*)((void*)(mem->header) + (POS)))
+
+/** Identifies a diskmap file ("diskmap" in ASCII), and the version of its layout */
+#define MEM_MAGIC 0x0070616d6b736964ULL
+#define MEM_VERSION 9
+
+/** Number of named roots in the header, and maximum length of their names (including '\0') */
+#define MEM_ROOT_COUNT 8
+#define MEM_ROOT_NAME_LEN 24
+
+/** A named entry point into the memory mapped file, e.g. the header of a hash table */
+struct mem_root {
+	char name[MEM_ROOT_NAME_LEN];
+	MEMPTR ptr;                         // 0 if slot is unused
+};
+
+/** Free blocks are kept in bins (segregated free lists). Blocks smaller than MEM_SMALL_LIMIT
+ * have one bin per size (multiples of MEM_ALIGN), bigger blocks have two bins per power of two */
+#define MEM_BIN_COUNT 128
+#define MEM_SMALL_BINS 64
+#define MEM_SMALL_LIMIT (MEM_SMALL_BINS * MEM_ALIGN)
+/** How many blocks of a big bin are checked before taking a block from a bigger bin */
+#define MEM_BIN_SCAN 8
+
+/** Block sizes are multiples of MEM_ALIGN, and the content of a block is aligned to MEM_ALIGN bytes */
+#define MEM_ALIGN 16
+#define MEM_MIN_BLOCK (sizeof(struct mem_free_block) + sizeof(uint64_t))
+/** Position of the first block; the content of blocks starts at a multiple of MEM_ALIGN */
+#define MEM_FIRST_BLOCK ((sizeof(struct mem_header) + sizeof(struct mem_block) + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN - sizeof(struct mem_block))
+
+/** Strings are stored in chunks (string arena), with a 4 byte length before each string. 
+ * The first chunk has MEM_STR_CHUNK bytes, every following chunk is twice as big, up to MEM_STR_CHUNK_MAX.
+ * Strings that need more than MEM_STR_LARGE bytes get their own block */
+#define MEM_STR_CHUNK (64 << 10)
+#define MEM_STR_CHUNK_MAX (16 << 20)
+#define MEM_STR_LARGE 1024
+
+/** Flags stored in the lowest bits of mem_block.size */
+#define MEM_INUSE 1
+#define MEM_PREV_INUSE 2
+#define MEM_FLAGS (MEM_INUSE | MEM_PREV_INUSE)
 
 /** Header of the memory */
 struct mem_header {
-	BLOCK_POS next_free;
+	uint64_t magic;
+	uint64_t version;
 	size_t size;
+	BLOCK_POS top;                      // start of the unused space at the end, all blocks lie before it
+	uint64_t bin_map[MEM_BIN_COUNT/64]; // bit i is set if bins[i] is not empty
+	BLOCK_POS bins[MEM_BIN_COUNT];      // first free block of each bin, 0 if empty
+	MEMPTR str_pos;                     // where the next string of the string arena is stored
+	MEMPTR str_end;                     // end of the current chunk of the string arena
+	size_t str_chunk;                   // size of the next chunk of the string arena
+	size_t str_garbage;                 // bytes of freed strings in the string arena, which cannot be reused
+	struct mem_root roots[MEM_ROOT_COUNT];
+	uint64_t seq;                       // odd while a writer changes the content, see mem_write_begin(...)
+	MEMPTR intern_ptr;                  // header of the hash set of interned strings, 0 if none, see ht_intern_str(...)
 };
 
-/** An allocated part of memory */
+/** Header of each block of memory. The content of the block follows directly after it */
 struct mem_block {
-	BLOCK_POS prev;
-	BLOCK_POS next;
+	uint64_t size;                      // size of the block including header, or-ed with MEM_INUSE/MEM_PREV_INUSE
+};
+
+/** A block that is not in use. Its size is repeated in its last 8 bytes (boundary tag), 
+ * so that mem_free(...) of the following block can find its start, and merge both */
+struct mem_free_block {
+	uint64_t size;
+	BLOCK_POS next;                     // next free block of the same bin, 0 if none
+	BLOCK_POS prev;                     // previous free block of the same bin, 0 if it is the first
+};
+
+/** Default for mem.grow_chunk */
+#define MEM_GROW_CHUNK (1 << 20)
+
+/** Changes are tracked in ranges of 2^MEM_DIRTY_SHIFT bytes (64 KB), see mem_mark_dirty(...) */
+#define MEM_DIRTY_SHIFT 16
+#define MEM_DIRTY_RANGE (1ULL << MEM_DIRTY_SHIFT)
+
+/** Durability modes, see mem_set_durability(...) */
+#define MEM_DURABILITY_NONE 0           // never write to disk explicitly; the kernel writes eventually, also after mem_close(...)
+#define MEM_DURABILITY_PERIODIC 1       // start writing dirty ranges in the background, at most every flush_interval_ms
+#define MEM_DURABILITY_COMMIT 2         // write dirty ranges in mem_commit(...) and mem_close(...), and wait for the disk (default)
+#define MEM_DURABILITY_BACKGROUND 3     // a thread writes dirty ranges at least every flush_interval_ms, and waits for the disk
+
+/** Default limit of dirty bytes for MEM_DURABILITY_BACKGROUND, see mem_set_dirty_limit(...) */
+#define MEM_DIRTY_LIMIT (64 << 20)
+
+/** Flags for mem_open_flags(...) and mem_open_reader_flags(...) */
+#define MEM_POPULATE 1                  // read the whole file into the page cache and map it while opening (MAP_POPULATE)
+#define MEM_WILLNEED 2                  // start reading the whole file in the background while opening (MADV_WILLNEED)
+
+/** Number of entries of the probe histograms of struct mem_stats and struct ht_stats; the last counts all longer probes */
+#define MEM_STATS_PROBES 16
+
+/** Counters of a handle, see mem_get_stats(...). They are only counted if diskmap is compiled with -DDISKMAP_STATS, 
+ * otherwise they stay 0 and cost nothing. Threads that use the same handle might lose counts */
+struct mem_stats {
+	uint64_t lookups;                   // ht_lookup(...) and related calls
+	uint64_t lookup_misses;
+	uint64_t lookup_probes[MEM_STATS_PROBES]; // lookups that ended i buckets (robin hood) or i groups (swiss) after the home bucket
+	uint64_t inserts;                   // new keys
+	uint64_t insert_probes[MEM_STATS_PROBES]; // new keys stored i buckets (robin hood) or i groups (swiss) after their home
+	uint64_t displacements;             // entries moved by robin hood inserts ("steal from the rich"), also while resizing
+	uint64_t resizes;                   // of bucket arrays
+	uint64_t resize_ns;
+	uint64_t allocs;                    // calls of mem_alloc(...)
+	uint64_t alloc_steps;               // blocks and bin words checked by mem_alloc(...) to find a free block
+	uint64_t alloc_top;                 // allocations at the end of the used space, without a free block
+	uint64_t frees;
+	uint64_t merges;                    // free blocks merged with their neighbours
+	uint64_t grows;                     // calls of mem_resize(...)
+	uint64_t grow_ns;
+	uint64_t flushes;                   // msync/sync_file_range calls of mem_flush_dirty(...) and mem_sync(...)
+	uint64_t flush_ns;
+	uint64_t flush_bytes;
+	// computed by mem_get_stats(...)
+	size_t file_size;                   // mem_header.size
+	size_t used_size;                   // up to mem_header.top
+	size_t free_blocks;                 // blocks in the bins, e.g. old bucket arrays that have not been reused yet
+	size_t free_bytes;
+	size_t str_garbage;                 // removed strings in the string arena, see mem_free_str(...)
+	size_t dirty_bytes;                 // see mem_dirty_size(...)
+};
+
+/** STAT(mem, CODE) runs CODE with the struct mem_stats of mem as 'stats'. STAT_START(var) declares var with the current time in ns, 
+ * for durations in STAT(...) */
+#ifdef DISKMAP_STATS
+static inline uint64_t mem_stats_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+#define STAT(MEM, CODE) do { struct mem_stats* stats = &((struct mem*)(MEM))->stats; CODE; } while(0)
+#define STAT_START(VAR) uint64_t VAR = mem_stats_now()
+#else
+#define STAT(MEM, CODE) do { } while(0)
+#define STAT_START(VAR) do { } while(0)
+#endif
+
+/** Background thread of MEM_DURABILITY_BACKGROUND, see mem_set_durability(...) */
+struct mem_flusher {
+	pthread_t thread;
+	pthread_mutex_t lock;               // protects the fields below, and mem.dirty against mem_dirty_resize(...)
+	pthread_cond_t work;                // signaled when a flush is requested, or the thread should stop
+	pthread_cond_t done;                // signaled when a flush is completed
+	bool stop;
+	bool discard;                       // stop without writing the remaining ranges
+	uint64_t requested;                 // number of flushes requested by mem_commit(...) and by the dirty limit
+	uint64_t completed;                 // all requests up to this number are on disk
+	size_t dirty_ranges;                // bits set in mem.dirty, updated atomically
+	uint64_t* ranges;                   // the ranges the thread is writing, taken from mem.dirty
+	size_t words;
 };
 
 /** Handle used by clients */
 struct mem {
 	struct mem_header* header;
 	int fd;
+	size_t grow_chunk;                  // minimum number of bytes the file grows at once, see mem_set_grow_chunk(...)
+	size_t mapped_size;                 // size of the mapping; for readers, mem_header.size might already be bigger
+	bool readonly;                      // opened with mem_open_reader(...)
+	int write_depth;                    // nesting of mem_write_begin(...)
+	int durability;                     // MEM_DURABILITY_NONE, ...
+	long flush_interval_ms;             // for MEM_DURABILITY_PERIODIC
+	struct timespec last_flush;
+	uint64_t* dirty;                    // bit i is set if range i (of MEM_DIRTY_RANGE bytes) was changed since the last flush
+	size_t dirty_words;                 // number of words of the bitmap 'dirty'
+	struct mem_flusher* flusher;        // for MEM_DURABILITY_BACKGROUND, otherwise NULL
+	size_t max_dirty;                   // bytes, see mem_set_dirty_limit(...)
+	struct mem_stats stats;             // counters, see mem_get_stats(...)
 };
 
-/** Setup memory header and first block */
+/** Make the bitmap of dirty ranges big enough for the whole mapping */
+void mem_dirty_resize(struct mem *mem) {
+	size_t words = ((mem->mapped_size >> MEM_DIRTY_SHIFT) + 64) / 64;
+	if(words <= mem->dirty_words) return;
+	if(mem->flusher != NULL) pthread_mutex_lock(&mem->flusher->lock);
+	mem->dirty = realloc(mem->dirty, words * sizeof(uint64_t));
+	if(mem->dirty == NULL) handle_error("Error allocating memory");
+	memset(mem->dirty + mem->dirty_words, 0, (words - mem->dirty_words) * sizeof(uint64_t));
+	mem->dirty_words = words;
+	if(mem->flusher != NULL) pthread_mutex_unlock(&mem->flusher->lock);
+}
+
+/** Create handle for a mapping */
+struct mem* mem_handle(int fd, void* ptr, size_t size, bool readonly) {
+	struct mem *mem = malloc(sizeof(struct mem));
+	if(mem == NULL) handle_error("Error allocating memory");
+	mem->fd = fd;
+	mem->header = ptr;
+	mem->grow_chunk = MEM_GROW_CHUNK;
+	mem->mapped_size = size;
+	mem->readonly = readonly;
+	mem->write_depth = 0;
+	mem->durability = MEM_DURABILITY_COMMIT;
+	mem->flush_interval_ms = 0;
+	clock_gettime(CLOCK_MONOTONIC, &mem->last_flush);
+	mem->dirty = NULL;
+	mem->dirty_words = 0;
+	mem->flusher = NULL;
+	mem->max_dirty = MEM_DIRTY_LIMIT;
+	memset(&mem->stats, 0, sizeof(mem->stats));
+	if(!readonly) mem_dirty_resize(mem);
+	return mem;
+}
+
+/** Remember that len bytes at pos have been changed, so that the next flush writes them to disk.
+ * The library calls it for everything it writes, including the bucket returned by ht_value(...). 
+ * Call it if you change memory obtained by other means, e.g. a block of mem_alloc(...) after it was first written */
+static inline void mem_mark_dirty(struct mem *mem, MEMPTR pos, size_t len) {
+	if(mem->dirty == NULL || len == 0) return;
+	for(size_t i = pos >> MEM_DIRTY_SHIFT; i <= (pos + len - 1) >> MEM_DIRTY_SHIFT; i++) {
+		uint64_t bit = 1ULL << (i % 64);
+		if(mem->flusher == NULL) mem->dirty[i / 64] |= bit;
+		// the flusher takes the bits at the same time
+		else if(!(__atomic_fetch_or(&mem->dirty[i / 64], bit, __ATOMIC_RELAXED) & bit)) {
+			__atomic_add_fetch(&mem->flusher->dirty_ranges, 1, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+/** Returns true if the byte at pos was changed since the last flush */
+bool mem_is_dirty(struct mem *mem, MEMPTR pos) {
+	size_t i = pos >> MEM_DIRTY_SHIFT;
+	return mem->dirty != NULL && ((__atomic_load_n(&mem->dirty[i / 64], __ATOMIC_RELAXED) >> (i % 64)) & 1);
+}
+
+/** Number of bytes in dirty ranges, i.e. an upper bound of what the next flush writes */
+size_t mem_dirty_size(struct mem *mem) {
+	size_t ranges = 0;
+	// the thread of MEM_DURABILITY_BACKGROUND might clear bits at the same time
+	for(size_t w=0; w<mem->dirty_words; w++) ranges += __builtin_popcountll(__atomic_load_n(&mem->dirty[w], __ATOMIC_RELAXED));
+	return ranges * MEM_DIRTY_RANGE;
+}
+
+/** Setup memory header, without any blocks */
 void mem_init(struct mem *mem) {
-	BLOCK_POS first = sizeof(struct mem);
-	BLOCK_POS second = first + sizeof(struct mem_block);
-	mem->header->next_free = second;
-	BLOCK(first)->next = second;
-	BLOCK(first)->prev = 0;
-	BLOCK(second)->prev = first;
-	BLOCK(second)->next = 0;
+	mem->header->magic = MEM_MAGIC;
+	mem->header->version = MEM_VERSION;
+	mem->header->top = MEM_FIRST_BLOCK;
+	memset(mem->header->bin_map, 0, sizeof(mem->header->bin_map));
+	memset(mem->header->bins, 0, sizeof(mem->header->bins));
+	memset(mem->header->roots, 0, sizeof(mem->header->roots));
+	mem->header->str_pos = 0;
+	mem->header->str_end = 0;
+	mem->header->str_chunk = MEM_STR_CHUNK;
+	mem->header->str_garbage = 0;
+	mem->header->seq = 0;
+	mem->header->intern_ptr = 0;
+}
+
+/** Map size bytes of a file, with the warm-up requested by flags (MEM_POPULATE, ...) */
+void* mem_map(int fd, size_t size, int prot, int flags) {
+	int map_flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if(flags & MEM_POPULATE) map_flags |= MAP_POPULATE;
+#endif
+	void* ptr = mmap(NULL, size, prot, map_flags, fd, 0);
+	if (ptr == MAP_FAILED) handle_error("Error mapping file to memory");
+	if(flags & MEM_WILLNEED) madvise(ptr, size, MADV_WILLNEED);
+	return ptr;
 }
 
-/** Create a memory mapping at the specified file */ 
-struct mem* mem_create(char *file, int initial_size) {
+/** Create a memory mapping at the specified file. The initial size is rounded up to a multiple of the page size */ 
+struct mem* mem_create(char *file, size_t initial_size) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	initial_size = (max(initial_size, sizeof(struct mem_header)) + page - 1) / page * page;
 	int fd;
 	if((fd = open(file, O_RDWR | O_CREAT , (mode_t)0600)) == -1) handle_error("Error opening file for writing");
-	if (lseek(fd, initial_size+1, SEEK_SET) == -1) handle_error("Error seeking");
-	if (write(fd, "", 1) == -1) handle_error("Error writing");
+	if (ftruncate(fd, initial_size) == -1) handle_error("Error setting the file size");
 
-	void* ptr = mmap(NULL, initial_size, PROT_WRITE, MAP_SHARED, fd, 0);
-	if (ptr == MAP_FAILED) handle_error("Error mapping file to memory");
-	struct mem *mem = malloc(sizeof(struct mem));
-	mem->fd = fd;
-	mem->header = ptr;
+	void* ptr = mem_map(fd, initial_size, PROT_WRITE, 0);
+	struct mem *mem = mem_handle(fd, ptr, initial_size, false);
 	mem->header->size = initial_size;
 	mem_init(mem);
 	return mem;
 }
 
-/** Write changes to disk */
+/** Read and check the header of an existing file. Returns false if it was not written by diskmap, or by an incompatible version */
+bool mem_check_header(int fd, char *file, struct mem_header* header) {
+	struct stat fileInfo = {0};
+	if (fstat(fd, &fileInfo) == -1) handle_error("Error getting the file size");
+	size_t file_size = fileInfo.st_size < 0 ? 0 : (size_t)fileInfo.st_size;
+	if (file_size < sizeof(*header) || pread(fd, header, sizeof(*header), 0) != (ssize_t)sizeof(*header)
+			|| header->magic != MEM_MAGIC || header->version != MEM_VERSION || header->size > file_size) {
+		fprintf(stderr, "Error opening %s: not a diskmap file of version %d\n", file, MEM_VERSION);
+		return false;
+	}
+	return true;
+}
+
+/** Open the memory mapping of an existing file, keeping its content. 
+ * Creates a new one (see mem_create(...)) if the file does not exist or is empty.
+ * With MEM_POPULATE or MEM_WILLNEED, the first lookups do not wait for the disk (at the cost of reading the whole file).
+ * Returns NULL if the file was not written by diskmap, or by an incompatible version */
+struct mem* mem_open_flags(char *file, size_t initial_size, int flags) {
+	int fd;
+	if((fd = open(file, O_RDWR | O_CREAT, (mode_t)0600)) == -1) handle_error("Error opening file for writing");
+	struct stat fileInfo = {0};
+	if (fstat(fd, &fileInfo) == -1) handle_error("Error getting the file size");
+	if (fileInfo.st_size == 0) {
+		close(fd);
+		return mem_create(file, initial_size);
+	}
+
+	struct mem_header header;
+	if (!mem_check_header(fd, file, &header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* ptr = mem_map(fd, header.size, PROT_WRITE, flags);
+	return mem_handle(fd, ptr, header.size, false);
+}
+
+/** Open the memory mapping of an existing file, or create a new one, see mem_open_flags(...) */
+struct mem* mem_open(char *file, size_t initial_size) {
+	return mem_open_flags(file, initial_size, 0);
+}
+
+/** Open an existing file read-only, for a reader that runs concurrently to a writer in another process (or thread, 
+ * with its own handle). Use it with ht_lookup_shared(...), or with mem_read_begin(...) and mem_read_retry(...).
+ * Flags are MEM_POPULATE, ... or 0, see mem_open_flags(...).
+ * Returns NULL if the file does not exist, was not written by diskmap, or by an incompatible version */
+struct mem* mem_open_reader_flags(char *file, int flags) {
+	int fd;
+	if((fd = open(file, O_RDONLY)) == -1) return NULL;
+	struct mem_header header;
+	if (!mem_check_header(fd, file, &header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* ptr = mem_map(fd, header.size, PROT_READ, flags);
+	return mem_handle(fd, ptr, header.size, true);
+}
+
+/** Open an existing file read-only, see mem_open_reader_flags(...) */
+struct mem* mem_open_reader(char *file) {
+	return mem_open_reader_flags(file, 0);
+}
+
+/** Set the minimum number of bytes by which the file grows when mem_alloc(...) runs out of space. 
+ * It is rounded up to a multiple of the page size. Bigger chunks mean fewer calls to mem_resize(...) */
+void mem_set_grow_chunk(struct mem *mem, size_t bytes) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	mem->grow_chunk = (bytes + page - 1) / page * page;
+}
+
+/** Give the kernel a hint how len bytes at pos will be accessed (MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED, ...), 
+ * see madvise(2). The range is extended to whole pages, and cut at the end of the mapping. Failures are ignored */
+void mem_advise(struct mem *mem, MEMPTR pos, size_t len, int advice) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t start = pos / page * page;
+	size_t end = min(pos + len, mem->mapped_size);
+	if(end > start) madvise(MEMPTR(start), end - start, advice);
+}
+
+/** Write the ranges changed since the last flush (and the header) to disk, and mark them as clean. 
+ * With 'wait', returns when they are on disk, otherwise only starts writing them */
+void mem_flush_dirty(struct mem *mem, bool wait) {
+	// the header changes with almost every write
+	mem->dirty[0] |= 1;
+	size_t ranges = (mem->mapped_size + MEM_DIRTY_RANGE - 1) >> MEM_DIRTY_SHIFT;
+	for(size_t i=0; i<ranges; ) {
+		if(mem->dirty[i / 64] == 0) {
+			i = (i / 64 + 1) * 64;
+			continue;
+		}
+		if(!((mem->dirty[i / 64] >> (i % 64)) & 1)) {
+			i++;
+			continue;
+		}
+		// write whole runs of dirty ranges at once
+		size_t first = i;
+		for(; i<ranges && ((mem->dirty[i / 64] >> (i % 64)) & 1); i++) mem->dirty[i / 64] &= ~(1ULL << (i % 64));
+		size_t from = first << MEM_DIRTY_SHIFT, len = min(i << MEM_DIRTY_SHIFT, mem->mapped_size) - from;
+		STAT_START(start);
+		if(wait) {
+			if (msync((char*)mem->header + from, len, MS_SYNC) == -1) handle_error("Error syncing");
+		} else {
+#ifdef SYNC_FILE_RANGE_WRITE
+			// MS_ASYNC does not start writing on Linux
+			if (sync_file_range(mem->fd, from, len, SYNC_FILE_RANGE_WRITE) == -1) handle_error("Error syncing");
+#else
+			if (msync((char*)mem->header + from, len, MS_ASYNC) == -1) handle_error("Error syncing");
+#endif
+		}
+		STAT(mem, stats->flushes++; stats->flush_ns += mem_stats_now() - start; stats->flush_bytes += len);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &mem->last_flush);
+}
+
+/** Main loop of the thread of MEM_DURABILITY_BACKGROUND. Every flush_interval_ms, or when a flush is requested, 
+ * it takes the dirty bits, writes their ranges with sync_file_range(...) (on Linux), and waits with fdatasync(...).
+ * It uses file offsets, so the mapping may move while it writes */
+static void* mem_flusher_run(void* arg) {
+	struct mem* mem = arg;
+	struct mem_flusher* flusher = mem->flusher;
+	pthread_mutex_lock(&flusher->lock);
+	while(true) {
+		if(!flusher->stop && flusher->requested == flusher->completed) {
+			// an interval of 0 would make the thread spin, and swap the bitmap all the time
+			long interval_ms = max(mem->flush_interval_ms, 1);
+			struct timespec until;
+			clock_gettime(CLOCK_MONOTONIC, &until);
+			until.tv_sec += interval_ms / 1000;
+			until.tv_nsec += interval_ms % 1000 * 1000000;
+			if(until.tv_nsec >= 1000000000) {
+				until.tv_sec++;
+				until.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&flusher->work, &flusher->lock, &until);
+		}
+		if(flusher->discard) break;
+		uint64_t target = flusher->requested;
+		if(flusher->words < mem->dirty_words) {
+			flusher->ranges = realloc(flusher->ranges, mem->dirty_words * sizeof(uint64_t));
+			if(flusher->ranges == NULL) handle_error("Error allocating memory");
+			flusher->words = mem->dirty_words;
+		}
+		size_t words = mem->dirty_words, count = 0;
+		for(size_t w=0; w<words; w++) {
+			flusher->ranges[w] = __atomic_exchange_n(&mem->dirty[w], 0, __ATOMIC_ACQ_REL);
+			count += __builtin_popcountll(flusher->ranges[w]);
+		}
+		__atomic_sub_fetch(&flusher->dirty_ranges, count, __ATOMIC_RELAXED);
+		bool stop = flusher->stop;
+		if(count != 0) {
+			pthread_mutex_unlock(&flusher->lock);
+			// the header changes with almost every write
+			flusher->ranges[0] |= 1;
+			STAT_START(start);
+#ifdef SYNC_FILE_RANGE_WRITE
+			for(size_t i=0; i<words * 64; ) {
+				if(flusher->ranges[i / 64] == 0) {
+					i = (i / 64 + 1) * 64;
+					continue;
+				}
+				if(!((flusher->ranges[i / 64] >> (i % 64)) & 1)) {
+					i++;
+					continue;
+				}
+				size_t first = i;
+				for(; i<words * 64 && ((flusher->ranges[i / 64] >> (i % 64)) & 1); i++);
+				if (sync_file_range(mem->fd, first << MEM_DIRTY_SHIFT, (i - first) << MEM_DIRTY_SHIFT, SYNC_FILE_RANGE_WRITE) == -1) {
+					handle_error("Error syncing");
+				}
+			}
+#endif
+			if (fdatasync(mem->fd) == -1) handle_error("Error syncing");
+			STAT(mem, stats->flushes++; stats->flush_ns += mem_stats_now() - start; stats->flush_bytes += count * MEM_DIRTY_RANGE);
+			pthread_mutex_lock(&flusher->lock);
+		}
+		flusher->completed = target;
+		pthread_cond_broadcast(&flusher->done);
+		if(stop) break;
+	}
+	pthread_mutex_unlock(&flusher->lock);
+	return NULL;
+}
+
+/** Request a flush from the thread of MEM_DURABILITY_BACKGROUND, and wait until everything changed before is on disk */
+void mem_flusher_wait(struct mem *mem) {
+	struct mem_flusher* flusher = mem->flusher;
+	pthread_mutex_lock(&flusher->lock);
+	uint64_t request = ++flusher->requested;
+	pthread_cond_signal(&flusher->work);
+	while(flusher->completed < request) pthread_cond_wait(&flusher->done, &flusher->lock);
+	pthread_mutex_unlock(&flusher->lock);
+}
+
+/** Start the thread of MEM_DURABILITY_BACKGROUND */
+void mem_flusher_start(struct mem *mem) {
+	struct mem_flusher* flusher = calloc(1, sizeof(struct mem_flusher));
+	if(flusher == NULL) handle_error("Error allocating memory");
+	pthread_mutex_init(&flusher->lock, NULL);
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&flusher->work, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&flusher->done, NULL);
+	// bits set before are counted once
+	size_t ranges = 0;
+	for(size_t w=0; w<mem->dirty_words; w++) ranges += __builtin_popcountll(mem->dirty[w]);
+	flusher->dirty_ranges = ranges;
+	mem->flusher = flusher;
+	if(pthread_create(&flusher->thread, NULL, mem_flusher_run, mem) != 0) handle_error("Error creating thread");
+}
+
+/** Stop the thread of MEM_DURABILITY_BACKGROUND. With 'flush', it writes the remaining dirty ranges before */
+void mem_flusher_stop(struct mem *mem, bool flush) {
+	struct mem_flusher* flusher = mem->flusher;
+	if(flusher == NULL) return;
+	pthread_mutex_lock(&flusher->lock);
+	flusher->stop = true;
+	flusher->discard = !flush;
+	pthread_cond_signal(&flusher->work);
+	pthread_mutex_unlock(&flusher->lock);
+	pthread_join(flusher->thread, NULL);
+	mem->flusher = NULL;
+	pthread_cond_destroy(&flusher->work);
+	pthread_cond_destroy(&flusher->done);
+	pthread_mutex_destroy(&flusher->lock);
+	free(flusher->ranges);
+	free(flusher);
+}
+
+/** Write all changes since the last flush to disk (checkpoint), and wait until they are written. 
+ * Only the ranges that have been changed are written, see mem_mark_dirty(...) */
+void mem_commit(struct mem *mem) {
+	if(mem->flusher != NULL) mem_flusher_wait(mem);
+	else mem_flush_dirty(mem, true);
+}
+
+/** Choose when changes are written to disk: MEM_DURABILITY_NONE, MEM_DURABILITY_PERIODIC (every interval_ms, 
+ * checked when a hash table function finishes a change), MEM_DURABILITY_COMMIT (only mem_commit(...) and mem_close(...)), 
+ * or MEM_DURABILITY_BACKGROUND: a thread writes the changes and waits for the disk, so that they are durable after about 
+ * interval_ms (at least 1 ms, plus the time to write them), while the caller continues. The caller only waits when more than 
+ * mem_set_dirty_limit(...) bytes are dirty. Do not write to the file from other threads in this mode */
+void mem_set_durability(struct mem *mem, int mode, long interval_ms) {
+	if(mem->flusher != NULL && mode != MEM_DURABILITY_BACKGROUND) mem_flusher_stop(mem, true);
+	mem->durability = mode;
+	mem->flush_interval_ms = interval_ms;
+	if(mode == MEM_DURABILITY_BACKGROUND && mem->flusher == NULL && !mem->readonly) mem_flusher_start(mem);
+}
+
+/** Set how many bytes may be dirty with MEM_DURABILITY_BACKGROUND (default MEM_DIRTY_LIMIT). 
+ * When a change leaves more, the caller waits until the thread has written them (back-pressure).
+ * The limit belongs to the handle, so it can be set before the mode, and stays when the mode changes */
+void mem_set_dirty_limit(struct mem *mem, size_t bytes) {
+	mem->max_dirty = bytes;
+}
+
+/** Start writing the dirty ranges, if the durability mode is MEM_DURABILITY_PERIODIC and the interval has passed.
+ * With MEM_DURABILITY_BACKGROUND, wait for the thread if too many bytes are dirty */
+void mem_flush_periodic(struct mem *mem) {
+	if(mem->flusher != NULL) {
+		size_t ranges = __atomic_load_n(&mem->flusher->dirty_ranges, __ATOMIC_RELAXED);
+		if(ranges * MEM_DIRTY_RANGE > mem->max_dirty) mem_flusher_wait(mem);
+		return;
+	}
+	if(mem->durability != MEM_DURABILITY_PERIODIC) return;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long elapsed_ms = (now.tv_sec - mem->last_flush.tv_sec) * 1000 + (now.tv_nsec - mem->last_flush.tv_nsec) / 1000000;
+	if(elapsed_ms >= mem->flush_interval_ms) mem_flush_dirty(mem, false);
+}
+
+/** Start changing the content of the memory mapped file. Readers (see mem_read_begin(...)) that run at the same time 
+ * repeat their reads. The hash table functions call it themselves, but if you write a value into a bucket 
+ * while readers are running, surround it with mem_write_begin(...) and mem_write_end(...). Calls can be nested */
+void mem_write_begin(struct mem *mem) {
+	if(mem->write_depth++ == 0) {
+		__atomic_store_n(&mem->header->seq, mem->header->seq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+}
+
+/** Finish changing the content, see mem_write_begin(...) */
+void mem_write_end(struct mem *mem) {
+	if(--mem->write_depth == 0) {
+		__atomic_store_n(&mem->header->seq, mem->header->seq + 1, __ATOMIC_RELEASE);
+		mem_flush_periodic(mem);
+	}
+}
+
+/** Map 'size' bytes of the file instead of the current mapping, which might move.
+ * Hints of mem_advise(...) split the mapping into parts that mremap can not grow together. So the hints are reset before, 
+ * and if that is not possible (MADV_HUGEPAGE), the file is mapped again */
+void* mem_remap(struct mem *mem, size_t size, int prot) {
+#ifdef MREMAP_MAYMOVE
+	madvise(mem->header, mem->mapped_size, MADV_NORMAL);
+	void* ptr = mremap(mem->header, mem->mapped_size, size, MREMAP_MAYMOVE);
+	if (ptr != MAP_FAILED) return ptr;
+#endif
+	if(munmap(mem->header, mem->mapped_size) == -1) handle_error("Error unmapping");
+	return mem_map(mem->fd, size, prot, 0);
+}
+
+/** Start reading data that a writer might change concurrently. Waits until no writer is active, 
+ * and maps the whole file if it has become bigger. Pass the result to mem_read_retry(...) after reading */
+uint64_t mem_read_begin(struct mem *mem) {
+	uint64_t seq;
+	while((seq = __atomic_load_n(&mem->header->seq, __ATOMIC_ACQUIRE)) & 1) {
+		sched_yield();
+	}
+	size_t size = __atomic_load_n(&mem->header->size, __ATOMIC_RELAXED);
+	if(size > mem->mapped_size) {
+		mem->header = mem_remap(mem, size, PROT_READ);
+		mem->mapped_size = size;
+	}
+	return seq;
+}
+
+/** Returns true if a writer changed the content since the corresponding mem_read_begin(...). 
+ * In that case, everything read in between might be inconsistent and needs to be read again */
+bool mem_read_retry(struct mem *mem, uint64_t seq) {
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return __atomic_load_n(&mem->header->seq, __ATOMIC_RELAXED) != seq;
+}
+
+/** Store the position of a root object (e.g. the header of a hash table) under a name, 
+ * so that it can be found again after mem_open(...). Replaces an existing root with the same name.
+ * Returns false if the name is too long, or all root slots are in use */
+bool mem_set_root(struct mem *mem, char *name, MEMPTR ptr) {
+	if(strlen(name) >= MEM_ROOT_NAME_LEN) return false;
+	struct mem_root* free_root = NULL;
+	for(int i=0; i<MEM_ROOT_COUNT; i++) {
+		struct mem_root* root = &mem->header->roots[i];
+		if(root->ptr != 0 && strcmp(root->name, name) == 0) {
+			mem_write_begin(mem);
+			root->ptr = ptr;
+			mem_write_end(mem);
+			return true;
+		}
+		if(root->ptr == 0 && free_root == NULL) free_root = root;
+	}
+	if(free_root == NULL) return false;
+	mem_write_begin(mem);
+	strcpy(free_root->name, name);
+	free_root->ptr = ptr;
+	mem_write_end(mem);
+	return true;
+}
+
+/** Get the position of a root object stored with mem_set_root(...). Returns 0 if none exists */
+MEMPTR mem_get_root(struct mem *mem, char *name) {
+	for(int i=0; i<MEM_ROOT_COUNT; i++) {
+		struct mem_root* root = &mem->header->roots[i];
+		if(root->ptr != 0 && strcmp(root->name, name) == 0) return root->ptr;
+	}
+	return 0;
+}
+
+/** Write the whole mapping to disk, and wait until it is written */
 void mem_sync(struct mem* mem) {
-	if (msync(mem->header, mem->header->size, MS_SYNC) == -1) handle_error("Error syncing");
+	STAT_START(start);
+	if (msync(mem->header, mem->mapped_size, MS_SYNC) == -1) handle_error("Error syncing");
+	STAT(mem, stats->flushes++; stats->flush_ns += mem_stats_now() - start; stats->flush_bytes += mem->mapped_size);
+	// the thread of MEM_DURABILITY_BACKGROUND clears the bits itself
+	if(mem->flusher != NULL) mem_flusher_wait(mem);
+	else if(mem->dirty != NULL) memset(mem->dirty, 0, mem->dirty_words * sizeof(uint64_t));
+	clock_gettime(CLOCK_MONOTONIC, &mem->last_flush);
 }
 
 /** Remove memory mapping */
 void mem_unmap(struct mem* mem) {
-	if(munmap(mem->header, mem->header->size) == -1) handle_error("Error unmapping");
+	if(munmap(mem->header, mem->mapped_size) == -1) handle_error("Error unmapping");
 }
 
 /** Close without writing to disk */
 void mem_abandon(struct mem* mem) {
+	mem_flusher_stop(mem, false);
 	mem_unmap(mem);
 	struct stat fileInfo = {0};
 	if (fstat(mem->fd, &fileInfo) == -1) handle_error("Error getting the file size");
@@ -125,80 +729,301 @@ void mem_abandon(struct mem* mem) {
 	mem->fd = 0;
 }
 
-/** Close everything */
+/** Close everything. Writes the dirty ranges to disk, unless the durability mode is MEM_DURABILITY_NONE */
 void mem_close(struct mem* mem) {
-	mem_sync(mem);
+	if(!mem->readonly && mem->durability != MEM_DURABILITY_NONE) mem_commit(mem);
 	mem_abandon(mem);
+	free(mem->dirty);
+	mem->dirty = NULL;
 }
 
-/** Make underlying file bigger */
+/** Make underlying file bigger, to at least 'size' bytes. 
+ * The file grows by at least mem.grow_chunk bytes, and its size stays a multiple of the page size. 
+ * Does not write anything to disk. The mapping might move, which invalidates all pointers into it */
 void mem_resize(struct mem *mem, size_t size) {
-	debug_print("resizing from %llu to %llu\n", mem->header->size, size);
-	mem_sync(mem);
-	mem_unmap(mem);
-	if (lseek(mem->fd, size, SEEK_SET) == -1) handle_error("Error seeking");
-	if (write(mem->fd, "", 1) == -1) handle_error("Error writing");
+	size_t old_size = mem->header->size;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size = max(size, old_size + mem->grow_chunk);
+	size = (size + page - 1) / page * page;
+	debug_print("resizing from %zu to %zu\n", old_size, size);
+	STAT_START(start);
+
+	if (ftruncate(mem->fd, size) == -1) handle_error("Error setting the file size");
 	void* old_ptr = mem->header;
-	mem->header = mmap(old_ptr, size, PROT_WRITE, MAP_SHARED , mem->fd, 0);
+	mem->header = mem_remap(mem, size, PROT_WRITE);
+	mem->mapped_size = size;
+	mem_dirty_resize(mem);
 	if(old_ptr != mem->header) {
 		debug_print("mem_resize changed ptr from %p to %p!\n", old_ptr, mem->header);
-		//exit(-1);
 	}
-	mem->header->size = size;
+	// readers map the new size in mem_read_begin(...)
+	__atomic_store_n(&mem->header->size, size, __ATOMIC_RELEASE);
+	STAT(mem, stats->grows++; stats->grow_ns += mem_stats_now() - start);
+}
+
+/** Grow the file, so that blocks of 'size' bytes in total can be allocated without growing it again */
+void mem_reserve(struct mem *mem, size_t size) {
+	if(mem->header->top + size > mem->header->size) mem_resize(mem, mem->header->top + size);
+}
+
+/** Bin for free blocks of the given size */
+size_t mem_bin(size_t size) {
+	if(size < MEM_SMALL_LIMIT) return size / MEM_ALIGN;
+	int log = 63 - __builtin_clzll(size);
+	// two bins per power of two, distinguished by the bit after the highest bit
+	size_t bin = MEM_SMALL_BINS + 2 * (log - __builtin_ctzll(MEM_SMALL_LIMIT)) + ((size >> (log - 1)) & 1);
+	return min(bin, MEM_BIN_COUNT - 1);
+}
+
+/** Add free block to its bin */
+void mem_bin_insert(struct mem *mem, BLOCK_POS pos) {
+	size_t bin = mem_bin(FREE_BLOCK(pos)->size & ~MEM_FLAGS);
+	BLOCK_POS first = mem->header->bins[bin];
+	FREE_BLOCK(pos)->next = first;
+	FREE_BLOCK(pos)->prev = 0;
+	mem_mark_dirty(mem, pos, sizeof(struct mem_free_block));
+	if(first != 0) {
+		FREE_BLOCK(first)->prev = pos;
+		mem_mark_dirty(mem, first, sizeof(struct mem_free_block));
+	}
+	mem->header->bins[bin] = pos;
+	mem->header->bin_map[bin / 64] |= 1ULL << (bin % 64);
+}
+
+/** Remove free block from its bin */
+void mem_bin_remove(struct mem *mem, BLOCK_POS pos) {
+	size_t bin = mem_bin(FREE_BLOCK(pos)->size & ~MEM_FLAGS);
+	BLOCK_POS prev = FREE_BLOCK(pos)->prev, next = FREE_BLOCK(pos)->next;
+	if(prev != 0) {
+		FREE_BLOCK(prev)->next = next;
+		mem_mark_dirty(mem, prev, sizeof(struct mem_free_block));
+	}
+	else mem->header->bins[bin] = next;
+	if(next != 0) {
+		FREE_BLOCK(next)->prev = prev;
+		mem_mark_dirty(mem, next, sizeof(struct mem_free_block));
+	}
+	if(mem->header->bins[bin] == 0) mem->header->bin_map[bin / 64] &= ~(1ULL << (bin % 64));
+}
+
+/** Find a free block with at least 'size' bytes, and remove it from its bin. Returns 0 if there is none */
+BLOCK_POS mem_bin_take(struct mem *mem, size_t size) {
+	size_t bin = mem_bin(size);
+	if(bin >= MEM_SMALL_BINS) {
+		// blocks of a big bin have different sizes, so check some of them
+		BLOCK_POS pos = mem->header->bins[bin];
+		for(int i=0; pos != 0 && i < MEM_BIN_SCAN; i++, pos = FREE_BLOCK(pos)->next) {
+			STAT(mem, stats->alloc_steps++);
+			if((FREE_BLOCK(pos)->size & ~MEM_FLAGS) >= size) {
+				mem_bin_remove(mem, pos);
+				return pos;
+			}
+		}
+		bin++;
+	}
+	// any block of the first non-empty bin starting from 'bin' is big enough
+	for(size_t word = bin / 64; word < MEM_BIN_COUNT / 64; word++) {
+		uint64_t bits = mem->header->bin_map[word];
+		STAT(mem, stats->alloc_steps++);
+		if(word == bin / 64) bits &= ~0ULL << (bin % 64);
+		if(bits != 0) {
+			BLOCK_POS pos = mem->header->bins[word * 64 + __builtin_ctzll(bits)];
+			mem_bin_remove(mem, pos);
+			return pos;
+		}
+	}
+	return 0;
 }
 
-/** Reserve a certain amount of memory */
+/** Reserve a certain amount of memory. Returns the position of the reserved memory, aligned to MEM_ALIGN bytes */
 uint64_t mem_alloc(struct mem *mem, size_t size) {
-	BLOCK_POS free = mem->header->next_free;
-	size_t needed = sizeof(struct mem_block) + size;
-	while(!(BLOCK(free)->next - free > needed || BLOCK(free)->next == 0)) {
-		free = BLOCK(free)->next;
-	}
-	BLOCK_POS prev = BLOCK(free)->prev;
-	BLOCK_POS next = BLOCK(prev)->next;
-
-	if(BLOCK(free)->next == 0) {
-		next = free + needed;
-		// align
-		next = ((next >> 2)+1)<<2;
-		if(next + sizeof(struct mem_block) >= mem->header->size) {
-			size_t new_size = next + sizeof(struct mem_block);
-			new_size = (size_t)(new_size * 1.5);
-			new_size = ((new_size>>8)+1)<<8;
-			mem_resize(mem, new_size);
-		}
-		BLOCK(free)->next = next;
-		BLOCK(next)->next = 0;
-	}
-	mem->header->next_free = BLOCK(free)->next;
-
-	BLOCK(free)->next = next;
-	BLOCK(free)->prev = prev;
-	BLOCK(prev)->next = free;
-	BLOCK(next)->prev = free;
-
-	return free + sizeof(struct mem_block);
-}
-
-/** Give ownership of memory back to memory management */
-void mem_free(struct mem *mem, void *ptr) {
-	// TODO: use index instead of pointer
-	// TODO: merge continuous free blocks
-	struct mem_block* block = ptr - sizeof(struct mem_block);
-	struct mem_block* prev = (void*)mem + block->prev;
-	struct mem_block* next = (void*)mem + block->next;
-	prev->next = (void*)next - (void*)mem;
-	next->prev = (void*)prev - (void*)mem;
-	block->next = mem->header->next_free;
-	mem->header->next_free = (void*)block - (void*)mem;
-}
-
-/** Write string to memory mapped file. Returns its position */
+	size_t needed = (sizeof(struct mem_block) + size + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+	needed = max(needed, MEM_MIN_BLOCK);
+	STAT(mem, stats->allocs++);
+
+	BLOCK_POS pos = mem_bin_take(mem, needed);
+	if(pos != 0) {
+		size_t block_size = FREE_BLOCK(pos)->size & ~MEM_FLAGS;
+		if(block_size - needed >= MEM_MIN_BLOCK) {
+			// split, and give the rest back (its following block stays in use, so no merging necessary)
+			BLOCK_POS rest = pos + needed;
+			BLOCK(rest)->size = (block_size - needed) | MEM_PREV_INUSE;
+			*(uint64_t*)MEMPTR(rest + block_size - needed - sizeof(uint64_t)) = block_size - needed;
+			mem_mark_dirty(mem, rest + block_size - needed - sizeof(uint64_t), sizeof(uint64_t));
+			mem_bin_insert(mem, rest);
+			block_size = needed;
+		}
+		else if(pos + block_size != mem->header->top) {
+			BLOCK(pos + block_size)->size |= MEM_PREV_INUSE;
+			mem_mark_dirty(mem, pos + block_size, sizeof(struct mem_block));
+		}
+		BLOCK(pos)->size = block_size | MEM_INUSE | MEM_PREV_INUSE;
+		// the caller writes the content
+		mem_mark_dirty(mem, pos, block_size);
+		return pos + sizeof(struct mem_block);
+	}
+
+	// take space at the end; the block before it is always in use, as mem_free(...) merges free blocks into the top
+	STAT(mem, stats->alloc_top++);
+	pos = mem->header->top;
+	if(pos + needed > mem->header->size) {
+		mem_resize(mem, pos + needed + (pos + needed) / 2);
+	}
+	mem->header->top = pos + needed;
+	BLOCK(pos)->size = needed | MEM_INUSE | MEM_PREV_INUSE;
+	mem_mark_dirty(mem, pos, needed);
+	return pos + sizeof(struct mem_block);
+}
+
+/** Give ownership of memory back to memory management. 
+ * @param ptr position returned by mem_alloc(...) */
+void mem_free(struct mem *mem, MEMPTR ptr);
+
+/** Allocate a block whose content starts at a multiple of 'align' (a power of two), e.g. of the page size. 
+ * The unused space before and after it is given back. Free it with mem_free(...) */
+uint64_t mem_alloc_aligned(struct mem *mem, size_t size, size_t align) {
+	if(align <= MEM_ALIGN) return mem_alloc(mem, size);
+	// room for a free block before the aligned content
+	MEMPTR ptr = mem_alloc(mem, size + align + MEM_MIN_BLOCK);
+	MEMPTR aligned = (ptr + MEM_MIN_BLOCK + align - 1) / align * align;
+	BLOCK_POS pos = ptr - sizeof(struct mem_block), start = aligned - sizeof(struct mem_block);
+	size_t block_size = BLOCK(pos)->size & ~MEM_FLAGS;
+	size_t needed = (sizeof(struct mem_block) + size + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+	size_t rest = block_size - (start - pos) - needed;
+	BLOCK(start)->size = (rest >= MEM_MIN_BLOCK ? needed : needed + rest) | MEM_INUSE | MEM_PREV_INUSE;
+	mem_mark_dirty(mem, start, sizeof(struct mem_block));
+	if(rest >= MEM_MIN_BLOCK) {
+		BLOCK(start + needed)->size = rest | MEM_INUSE | MEM_PREV_INUSE;
+		mem_free(mem, start + needed + sizeof(struct mem_block));
+	}
+	// the block before is a multiple of MEM_ALIGN, and at least MEM_MIN_BLOCK
+	BLOCK(pos)->size = (start - pos) | MEM_INUSE | (BLOCK(pos)->size & MEM_PREV_INUSE);
+	mem_free(mem, ptr);
+	return aligned;
+}
+
+/** Give ownership of memory back to memory management. 
+ * @param ptr position returned by mem_alloc(...) */
+void mem_free(struct mem *mem, MEMPTR ptr) {
+	BLOCK_POS pos = ptr - sizeof(struct mem_block);
+	size_t size = BLOCK(pos)->size & ~MEM_FLAGS;
+	STAT(mem, stats->frees++);
+
+	// merge with previous block, its size is stored in its last bytes
+	if(!(BLOCK(pos)->size & MEM_PREV_INUSE)) {
+		STAT(mem, stats->merges++);
+		size_t prev_size = *(uint64_t*)MEMPTR(pos - sizeof(uint64_t));
+		pos -= prev_size;
+		size += prev_size;
+		mem_bin_remove(mem, pos);
+	}
+
+	// merge with the unused space at the end
+	BLOCK_POS next = pos + size;
+	if(next == mem->header->top) {
+		mem->header->top = pos;
+		return;
+	}
+
+	// merge with next block
+	if(!(BLOCK(next)->size & MEM_INUSE)) {
+		STAT(mem, stats->merges++);
+		size_t next_size = BLOCK(next)->size & ~MEM_FLAGS;
+		mem_bin_remove(mem, next);
+		size += next_size;
+		next += next_size;
+		if(next == mem->header->top) {
+			mem->header->top = pos;
+			return;
+		}
+	}
+	BLOCK(next)->size &= ~MEM_PREV_INUSE;
+	mem_mark_dirty(mem, next, sizeof(struct mem_block));
+
+	// previous block is in use, otherwise it would have been merged
+	BLOCK(pos)->size = size | MEM_PREV_INUSE;
+	*(uint64_t*)MEMPTR(pos + size - sizeof(uint64_t)) = size;
+	mem_mark_dirty(mem, pos + size - sizeof(uint64_t), sizeof(uint64_t));
+	mem_bin_insert(mem, pos);
+}
+
+/** Counters of the handle (all 0 without -DDISKMAP_STATS), and the current usage of the file */
+struct mem_stats mem_get_stats(struct mem *mem) {
+	struct mem_stats result = mem->stats;
+	result.file_size = mem->header->size;
+	result.used_size = mem->header->top;
+	result.free_blocks = result.free_bytes = 0;
+	for(size_t bin = 0; bin < MEM_BIN_COUNT; bin++) {
+		for(BLOCK_POS pos = mem->header->bins[bin]; pos != 0; pos = FREE_BLOCK(pos)->next) {
+			result.free_blocks++;
+			result.free_bytes += FREE_BLOCK(pos)->size & ~MEM_FLAGS;
+		}
+	}
+	result.str_garbage = mem->header->str_garbage;
+	result.dirty_bytes = mem_dirty_size(mem);
+	return result;
+}
+
+/** Set all counters of the handle to 0 */
+void mem_reset_stats(struct mem *mem) {
+	memset(&mem->stats, 0, sizeof(mem->stats));
+}
+
+/** Write len bytes to memory mapped file, preceded by their length and followed by '\0'. Returns their position.
+ * Short byte strings are appended to the string arena, so they do not need a block header.
+ * The bytes may reside in the memory mapped file itself */
+MEMPTR mem_insert_bytes(struct mem *mem, const void *data, size_t len) {
+	char* str = (char*)data;
+	size_t needed = sizeof(uint32_t) + len + 1;
+	if(len > UINT32_MAX) handle_error("String too long");
+	// allocating might move the mapping
+	bool inside = (void*)str >= (void*)mem->header && (void*)str < MEMPTR(mem->header->size);
+	MEMPTR str_pos = inside ? (void*)str - (void*)mem->header : 0;
+	MEMPTR ptr;
+	if(needed > MEM_STR_LARGE) {
+		ptr = mem_alloc(mem, needed);
+	}
+	else {
+		if(mem->header->str_pos + needed > mem->header->str_end) {
+			// start a new chunk, the rest of the current one stays unused
+			size_t chunk = mem->header->str_chunk;
+			MEMPTR tmp = mem_alloc(mem, chunk);
+			mem->header->str_pos = tmp;
+			mem->header->str_end = tmp + chunk;
+			mem->header->str_chunk = min(2 * chunk, MEM_STR_CHUNK_MAX);
+		}
+		ptr = mem->header->str_pos;
+		mem->header->str_pos += needed;
+	}
+	if(inside) str = MEMPTR(str_pos);
+	uint32_t len32 = len;
+	memcpy(MEMPTR(ptr), &len32, sizeof(uint32_t));
+	memcpy(MEMPTR(ptr + sizeof(uint32_t)), str, len);
+	*(char*)MEMPTR(ptr + sizeof(uint32_t) + len) = '\0';
+	mem_mark_dirty(mem, ptr, needed);
+	return ptr + sizeof(uint32_t);
+}
+
+/** Write string to memory mapped file, see mem_insert_bytes(...). Returns its position */
 MEMPTR mem_insert_str(struct mem *mem, char *str) {
-	size_t len = strlen(str) + 1;
-	MEMPTR ptr = mem_alloc(mem, len);
-	memcpy(MEMPTR(ptr), str, len);
-	return ptr;
+	return mem_insert_bytes(mem, str, strlen(str));
+}
+
+/** Length of a string written by mem_insert_str(...) or mem_insert_bytes(...), without the terminating '\0' */
+size_t mem_str_len(struct mem *mem, MEMPTR ptr) {
+	uint32_t len;
+	memcpy(&len, MEMPTR(ptr - sizeof(uint32_t)), sizeof(uint32_t));
+	return len;
+}
+
+/** Give the memory of a string written by mem_insert_str(...) back. A string in the string arena can only be reused
+ * if it was the last one written, otherwise its size is added to mem_header.str_garbage */
+void mem_free_str(struct mem *mem, MEMPTR ptr) {
+	size_t needed = sizeof(uint32_t) + mem_str_len(mem, ptr) + 1;
+	MEMPTR start = ptr - sizeof(uint32_t);
+	if(needed > MEM_STR_LARGE) mem_free(mem, start);
+	else if(start + needed == mem->header->str_pos) mem->header->str_pos = start;
+	else mem->header->str_garbage += needed;
 }
 
 //********************************************************************************
@@ -219,27 +1044,101 @@ uint64_t hash(char *str){
 	return v == 0 ? 1 : v;
 }
 
-/** Handle for hash table. Resides in main memory. */
-struct hash_table { // note: this struct only contains runtime configuration
-	void* mem;                          // hande for memory-mapped file
-	uint64_t header_ptr;                // ptr to hashmap (into mapped area)
-};
+/** FNV-1a of len bytes, which may contain '\0'. Includes a terminating '\0', so equals hash(...) for strings */
+uint64_t hash_bytes(const void *key, size_t len) {
+	const char* str = key;
+	uint64_t v = 0xcbf29ce484222325;
+	for(size_t i=0; i<len; i++) {
+		v = v ^ str[i];
+		v *= 0x100000001b3;
+	}
+	v *= 0x100000001b3;
+	return v == 0 ? 1 : v;
+}
 
-/** Header for hash table. Resides in memory mapped file. Never moves. */
-struct hash_table_header {
-	size_t bucket_count;      // number of slots in hash table
-	size_t bucket_size;       // size of one slot in bytes
-	size_t filled;            // how many slots are occupied
-	size_t max_dist;          // how many slots is an entry from its ideal position?
-	uint64_t buckets_ptr;     // ptr to bucket array (into mapped area)
-};
+// adopted from wyhash (final version 4.2, public domain), https://github.com/wangyi-fudan/wyhash
+/** 64x64 bit multiplication, folding the 128 bit result */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+	__uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_read8(const uint8_t* p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t hash_read4(const uint8_t* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+/** Hash of len bytes, processing 16 or 48 bytes per step */
+uint64_t hash_wy_bytes(const void* key, size_t len) {
+	static const uint64_t secret[4] = {0x2d358dccaa6c78a5ULL, 0x8bb84b93962eacc9ULL, 0x4b33a62ed433d4a3ULL, 0x4d5a2da51de1aa47ULL};
+	const uint8_t* p = key;
+	uint64_t seed = hash_mix(secret[0], secret[1]);
+	uint64_t a, b;
+	if(len <= 16) {
+		if(len >= 4) {
+			a = (hash_read4(p) << 32) | hash_read4(p + ((len >> 3) << 2));
+			b = (hash_read4(p + len - 4) << 32) | hash_read4(p + len - 4 - ((len >> 3) << 2));
+		}
+		else if(len > 0) {
+			a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+			b = 0;
+		}
+		else a = b = 0;
+	}
+	else {
+		size_t i = len;
+		if(i > 48) {
+			uint64_t see1 = seed, see2 = seed;
+			do {
+				seed = hash_mix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+				see1 = hash_mix(hash_read8(p + 16) ^ secret[2], hash_read8(p + 24) ^ see1);
+				see2 = hash_mix(hash_read8(p + 32) ^ secret[3], hash_read8(p + 40) ^ see2);
+				p += 48;
+				i -= 48;
+			} while(i > 48);
+			seed ^= see1 ^ see2;
+		}
+		while(i > 16) {
+			seed = hash_mix(hash_read8(p) ^ secret[1], hash_read8(p + 8) ^ seed);
+			i -= 16;
+			p += 16;
+		}
+		a = hash_read8(p + i - 16);
+		b = hash_read8(p + i - 8);
+	}
+	a ^= secret[1];
+	b ^= seed;
+	__uint128_t r = (__uint128_t)a * b;
+	return hash_mix((uint64_t)r ^ secret[0] ^ len, (uint64_t)(r >> 64) ^ secret[1]);
+}
+
+/** wyhash of a string, for tables with HT_WYHASH. Much faster than FNV-1a for long keys */
+uint64_t hash_wy(char *str) {
+	uint64_t v = hash_wy_bytes(str, strlen(str));
+	return v == 0 ? 1 : v;
+}
 
-/** A bucket for storing a key and its hash (to speed up comparisons) */
-struct hash_bucket {
-	uint64_t hash; // hashcode of the key, 0 indicates empty bucket
-	uint64_t keyptr; // index relative to underlying mem
+/** Tags of the value of a HT_MULTIMAP bucket. Without a tag, the value is the header of a nested hash table */
+#define MULTIMAP_SINGLE (1ULL << 63)    // the value is the position of the only string of the set
+#define MULTIMAP_ARRAY (1ULL << 62)     // the value is the position of a struct multimap_array
+#define MULTIMAP_TAGS (MULTIMAP_SINGLE | MULTIMAP_ARRAY)
+/** Capacity of the first array of a HT_MULTIMAP value set, and maximum number of values before promoting it to a nested table */
+#define MULTIMAP_ARRAY_FIRST 4
+#define MULTIMAP_SMALL 8
+
+/** Small set of values of a HT_MULTIMAP key */
+struct multimap_array {
+	uint32_t count;
+	uint32_t capacity;
+	MEMPTR vals[];                      // positions of the strings
 };
 
+/** Number of buckets in a group of a HT_SWISS table, and value of the control byte of an empty bucket */
+#define HT_GROUP_SIZE 16
+#define HT_CTRL_EMPTY 0x80
+#define HT_CTRL_DELETED 0xfe
+
+/** Default maximum load factor of robin hood tables, see ht_set_max_load(...) */
+#define HT_MAX_LOAD 0.9
+
 /** Gets hash bucket as a real pointer. Resizing mem or hash table invalidates this pointer. Buckets_ptr points to the bucket array */
 struct hash_bucket* ht_bucket_rel(struct hash_table* table, size_t idx, uint64_t buckets_ptr) {
 	struct hash_bucket* bucket = (void*)(HTMEMPTR(buckets_ptr) + idx*HTHEADER(table)->bucket_size);
@@ -252,76 +1151,212 @@ struct hash_bucket* ht_bucket(struct hash_table* table, size_t idx) {
 }
 
 /** Get main memory addr of value (relative to bucket pointer). You must not write more data than requested by ht_init(...) */
-void* ht_value_rel(struct hash_bucket* bucket) {
-	return ((char*)bucket) + sizeof(struct hash_bucket);
+void* ht_value_rel(struct hash_table* table, struct hash_bucket* bucket) {
+	return ((char*)bucket) + sizeof(uint64_t) + HTHEADER(table)->key_size;
+}
+
+/** Mark buckets first, ..., first+count-1 as dirty (see mem_mark_dirty(...)), wrapping around at the end of the bucket array */
+void ht_mark_buckets(struct hash_table* table, size_t first, size_t count) {
+	struct hash_table_header* header = HTHEADER(table);
+	size_t until_end = min(count, header->bucket_count - first);
+	mem_mark_dirty(table->mem, header->buckets_ptr + first * header->bucket_size, until_end * header->bucket_size);
+	mem_mark_dirty(table->mem, header->buckets_ptr, (count - until_end) * header->bucket_size);
+}
+
+/** Mark the header of a table as dirty, see mem_mark_dirty(...) */
+void ht_mark_header(struct hash_table* table) {
+	mem_mark_dirty(table->mem, table->header_ptr, sizeof(struct hash_table_header));
+}
+
+/** Bucket arrays smaller than this get no access pattern hints (see ht_advise(...)), as they only span a few pages */
+#define HT_ADVISE_MIN (1 << 20)
+
+/** Give the kernel a hint for size bytes of a bucket array (or control bytes) at ptr, if they are big enough */
+static void ht_advise_range(struct hash_table* table, uint64_t ptr, size_t size, int advice) {
+	if(size >= HT_ADVISE_MIN) mem_advise(table->mem, ptr, size, advice);
+}
+
+/** Give the kernel a hint how the bucket array (and the control bytes) of a table will be accessed, see mem_advise(...).
+ * The library uses MADV_RANDOM for new bucket arrays, so lookups do not read ahead, and MADV_SEQUENTIAL while copying them 
+ * during a resize. Iterating does not change the hints, as a loop might end early; before a full scan of a big table, 
+ * call ht_advise(table, MADV_SEQUENTIAL), and ht_advise(table, MADV_RANDOM) after it. Hints belong to the mapping of a process, and growing the file resets them (see mem_remap(...)),
+ * so call ht_advise(table, MADV_RANDOM) after opening a file, and after inserting many keys into other tables.
+ * With HT_HUGEPAGES, MADV_RANDOM also asks for transparent huge pages (MADV_HUGEPAGE), which the kernel provides 
+ * e.g. for files on tmpfs mounted with huge=advise. Tables smaller than HT_ADVISE_MIN are left alone */
+void ht_advise(struct hash_table* table, int advice) {
+	struct hash_table_header* header = HTHEADER(table);
+	size_t size = header->bucket_count * header->bucket_size;
+	ht_advise_range(table, header->buckets_ptr, size, advice);
+	if(header->ctrl_ptr != 0) ht_advise_range(table, header->ctrl_ptr, header->bucket_count, advice);
+#ifdef MADV_HUGEPAGE
+	if(advice == MADV_RANDOM && (header->flags & HT_HUGEPAGES)) ht_advise_range(table, header->buckets_ptr, size, MADV_HUGEPAGE);
+#endif
 }
 
-/** Get main memory addr of value (by table and bucket index). You must not write more data than requested by ht_init(...) */
+/** Get main memory addr of value (by table and bucket index). You must not write more data than requested by ht_init(...).
+ * As the value is usually written, its bucket is marked as dirty */
 void* ht_value(struct hash_table* table, int64_t bucket_idx) {
-	return ht_value_rel(ht_bucket(table, bucket_idx));
+	ht_mark_buckets(table, bucket_idx, 1);
+	return ht_value_rel(table, ht_bucket(table, bucket_idx));
+}
+
+/** Get main memory addr of the key of a bucket, either inside of the bucket, or in the string heap */
+char* ht_bucket_key(struct hash_table* table, struct hash_bucket* bucket) {
+	if(HTHEADER(table)->flags & HT_INLINE_KEYS) {
+		char* key = (char*)&bucket->keyptr;
+		if((unsigned char)key[HT_INLINE_KEY_SIZE-1] != HT_KEY_SPILLED) return key;
+	}
+	return HTMEMPTR(bucket->keyptr);
+}
+
+/** Hash of a key, with the hash function of the table. Pass it to ht_lookup_hashed(...) or ht_insert_hashed(...) */
+uint64_t ht_hash(struct hash_table* table, char* key) {
+	return HTHEADER(table)->flags & HT_WYHASH ? hash_wy(key) : hash(key);
+}
+
+/** Hash of len bytes with the hash function selected by the flags of a table (see HT_WYHASH) */
+static inline uint64_t hash_flags(uint64_t flags, const void* key, size_t len) {
+	if(flags & HT_WYHASH) {
+		uint64_t v = hash_wy_bytes(key, len);
+		return v == 0 ? 1 : v;
+	}
+	return hash_bytes(key, len);
+}
+
+/** Hash of a binary key of len bytes, with the hash function of the table. Equals ht_hash(...) for strings */
+uint64_t ht_hash_bytes(struct hash_table* table, const void* key, size_t len) {
+	return hash_flags(HTHEADER(table)->flags, key, len);
+}
+
+/** Get main memory addr of the key (by table and bucket index) */
+char* ht_key(struct hash_table* table, int64_t bucket_idx) {
+	return ht_bucket_key(table, ht_bucket(table, bucket_idx));
+}
+
+/** Length of the key of a bucket, without the terminating '\0' */
+static inline size_t ht_bucket_key_len(struct hash_table* table, struct hash_bucket* bucket) {
+	if(HTHEADER(table)->flags & HT_INLINE_KEYS) {
+		unsigned char len = ((char*)&bucket->keyptr)[HT_INLINE_KEY_SIZE-1];
+		if(len != HT_KEY_SPILLED) return len;
+	}
+	return mem_str_len(table->mem, bucket->keyptr);
+}
+
+/** Length of the key (by table and bucket index), e.g. of a binary key inserted with ht_insert_bytes(...) */
+size_t ht_key_len(struct hash_table* table, int64_t bucket_idx) {
+	return ht_bucket_key_len(table, ht_bucket(table, bucket_idx));
 }
 
 /** Init a hash table. Writes header and array of buckets to memory mapped file.
- * @param value_size amount of space reserved in each bucket for user-defined content */
-struct hash_table ht_init(void* mem, size_t value_size) {
+ * @param value_size amount of space reserved in each bucket for user-defined content 
+ * @param flags HT_INLINE_KEYS, ... or 0 */
+size_t ht_max_filled(struct hash_table* table, size_t bucket_count);
+
+/** Init a hash table with a bucket array that is big enough for 'expected' entries, so that inserting them does not resize it.
+ * Also grows the file once for the bucket array. See ht_init_flags(...) */
+struct hash_table ht_init_capacity(void* mem, size_t value_size, uint64_t flags, size_t expected) {
 	struct hash_table result;
 	struct hash_table *table = &result;
 	table->mem = mem;
 	table->header_ptr = mem_alloc(mem, sizeof(struct hash_table_header));
+	// interned keys are compared by their position, so they always need one
+	if(flags & HT_INTERN) flags &= ~HT_INLINE_KEYS;
+	// the bucket only contains the position of the value
+	if(flags & HT_BLOB_VALUES) value_size = sizeof(MEMPTR);
 
 	struct hash_table_header* header = HTHEADER(table);
-	header->bucket_size = sizeof(struct hash_bucket) + value_size;
-	header->bucket_count = 2;
+	header->flags = flags;
+	header->key_size = flags & HT_INLINE_KEYS ? HT_INLINE_KEY_SIZE : sizeof(uint64_t);
+	header->bucket_size = sizeof(uint64_t) + header->key_size + value_size;
+	header->bucket_count = flags & HT_SWISS ? HT_GROUP_SIZE : 2;
 	header->filled = 0;
 	header->max_dist = 0;
-
-	// need temporary variable, because mem_alloc might change header
-	uint64_t tmp = mem_alloc(mem, header->bucket_count * header->bucket_size);
+	header->ctrl_ptr = 0;
+	header->tombstones = 0;
+	header->max_load = 0;
+	while(ht_max_filled(table, header->bucket_count) < expected) header->bucket_count *= 2;
+
+	// need temporary variable, because mem_reserve and mem_alloc might change header
+	size_t size = header->bucket_count * header->bucket_size;
+	if(expected > 0) mem_reserve(mem, size + header->bucket_count + 4 * MEM_ALIGN);
+	uint64_t tmp = mem_alloc(mem, size);
 	header = HTHEADER(table);
 	header->buckets_ptr = tmp;
-	for(int i=0; i<header->bucket_count; i++) {
-		ht_bucket(table, i)->hash = 0;
+	memset(HTMEMPTR(tmp), 0, header->bucket_count * header->bucket_size);
+	if(flags & HT_SWISS) {
+		tmp = mem_alloc(mem, header->bucket_count);
+		HTHEADER(table)->ctrl_ptr = tmp;
+		memset(HTMEMPTR(tmp), HT_CTRL_EMPTY, HTHEADER(table)->bucket_count);
 	}
+	ht_advise(table, MADV_RANDOM);
+	return result;
+}
+
+/** Init a hash table. Writes header and array of buckets to memory mapped file.
+ * @param value_size amount of space reserved in each bucket for user-defined content 
+ * @param flags HT_INLINE_KEYS, ... or 0 */
+struct hash_table ht_init_flags(void* mem, size_t value_size, uint64_t flags) {
+	return ht_init_capacity(mem, value_size, flags, 0);
+}
+
+/** Init a hash table, with keys in the string heap. See ht_init_flags(...) */
+struct hash_table ht_init(void* mem, size_t value_size) {
+	return ht_init_flags(mem, value_size, 0);
+}
+
+/** Get handle of a hash table that already exists in the memory mapped file, 
+ * e.g. after mem_open(...). header_ptr is the value of hash_table.header_ptr, see also mem_get_root(...) */
+struct hash_table ht_open(void* mem, uint64_t header_ptr) {
+	struct hash_table result;
+	result.mem = mem;
+	result.header_ptr = header_ptr;
 	return result;
 }
 
+/** Header of a table as a real pointer, for code that cannot use HTHEADER(...), e.g. diskmap.hpp. Resizing mem invalidates this pointer */
+struct hash_table_header* ht_header(struct hash_table* table) {
+	return HTHEADER(table);
+}
+
 /** Get index of first non-empty bucket, that follows bucket with index 'bucket_idx'
  * Returns -1 if none exists */
 int64_t ht_next(struct hash_table* table, int64_t bucket_idx) {
-	for(int i=bucket_idx + 1; i<HTHEADER(table)->bucket_count; i++) { \
-		if(ht_bucket(table, i)->hash != 0) return i;
+	struct hash_table_header* header = HTHEADER(table);
+	char* buckets = HTMEMPTR(header->buckets_ptr);
+	for(size_t i=bucket_idx + 1; i<header->bucket_count; i++) {
+		if(((struct hash_bucket*)(buckets + i * header->bucket_size))->hash != 0) return i;
 	}
 	return -1;
 }
 
-/** Macros for iterating over all keys in hash table. Cannot be nested */
-#define HTFOREACH(TABLE)       for(int i=ht_next((TABLE), -1); i >= 0; i = ht_next((TABLE), i)) 
+/** Macros for iterating over all keys in hash table. Cannot be nested, see HTITER(...) for an alternative */
+#define HTFOREACH(TABLE)       for(int64_t i=ht_next((TABLE), -1); i >= 0; i = ht_next((TABLE), i)) 
 // returns key of current bucket
-#define HTFOREACH_KEY(TABLE)   MEMPTR(ht_bucket((TABLE), i)->keyptr)
+#define HTFOREACH_KEY(TABLE)   ht_key((TABLE), i)
 
 /** Print statistics, for debugging */
 void ht_print_stat(struct hash_table* table) {
 	printf("---------------------------------------\n");
 	struct hash_table_header* header = HTHEADER(table);
-	printf("hashtable header idx %zu, (current addr %p), bucket size %zu, 'key size' %zu, max dist %zu\n", table->header_ptr, header, header->bucket_size, sizeof(struct hash_bucket), header->max_dist); 
+	printf("hashtable header idx %zu, (current addr %p), bucket size %zu, 'key size' %zu, max dist %zu\n", table->header_ptr, header, header->bucket_size, sizeof(uint64_t) + header->key_size, header->max_dist); 
 	printf("bucket_count %zu, filled %zu, filled %g %%\n", header->bucket_count, header->filled, (float)header->filled  / header->bucket_count * 100);
 }
 
 /** Print statistics and content, for debugging. Do not use it for big hash tables. */
 void ht_print(struct hash_table* table) {
 	ht_print_stat(table);
-	for(int i=0; i<HTHEADER(table)->bucket_count; i++) {
+	for(size_t i=0; i<HTHEADER(table)->bucket_count; i++) {
 		struct hash_bucket* bucket = ht_bucket(table, i);
-		printf("table ptr %p bucket %d hash %llx, addr %p", HTHEADER(table)->buckets_ptr, i, bucket->hash, &(bucket->hash));
+		printf("table ptr %zu bucket %zu hash %llx, addr %p", (size_t)HTHEADER(table)->buckets_ptr, i, (unsigned long long)bucket->hash, &(bucket->hash));
 		if(bucket->hash != 0) {
-			printf(", key '%s'", HTMEMPTR(bucket->keyptr));
-			size_t best = bucket->hash % HTHEADER(table)->bucket_count;
-			printf(" best bucket %d", best);
-			uint64_t value_size = HTHEADER(table)->bucket_size - sizeof(struct hash_bucket);
+			printf(", key '%s'", ht_bucket_key(table, bucket));
+			size_t best = bucket->hash & (HTHEADER(table)->bucket_count - 1);
+			printf(" best bucket %zu", best);
+			uint64_t value_size = HTHEADER(table)->bucket_size - sizeof(uint64_t) - HTHEADER(table)->key_size;
 			if(value_size > 0) {
 				printf(", value ");
 				unsigned char* val = ht_value(table, i);
-				for(int j=0; j<min(value_size, 10); j++) {
+				for(size_t j=0; j<min(value_size, 10); j++) {
 					printf(" %x", val[j]);
 				}
 			}
@@ -331,121 +1366,647 @@ void ht_print(struct hash_table* table) {
 	printf("---------------------------------------\n");
 }
 
-// declare method used in insert
-void ht_resize(struct hash_table* table);
+// control bytes of HT_SWISS tables, see section 'swiss table' below
 
-/** Search bucket index of key, retun -1 if not existing */
-int64_t ht_lookup(struct hash_table* table, char* key) {
-	uint64_t h = hash(key);
-	size_t pos = h % HTHEADER(table)->bucket_count, dist = 0;
-	struct hash_bucket* bucket;
-	do {
-		bucket = ht_bucket(table, pos);
+/** Control byte for a hash */
+static inline uint8_t ht_swiss_tag(uint64_t h) {
+	return h >> 57;
+}
+
+/** Bit i of the result is set if ctrl[i] == tag */
+static inline uint32_t ht_swiss_match(uint8_t* ctrl, uint8_t tag) {
+#ifdef __SSE2__
+	__m128i group = _mm_loadu_si128((__m128i*)ctrl);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+#else
+	uint32_t result = 0;
+	for(int i=0; i<HT_GROUP_SIZE; i++) result |= (uint32_t)(ctrl[i] == tag) << i;
+	return result;
+#endif
+}
+
+/** Bit i of the result is set if bucket i of the group is empty */
+static inline uint32_t ht_swiss_match_empty(uint8_t* ctrl) {
+	return ht_swiss_match(ctrl, HT_CTRL_EMPTY);
+}
+
+/** Bit i of the result is set if bucket i of the group is empty or deleted, i.e., the highest bit of ctrl[i] is set */
+static inline uint32_t ht_swiss_match_free(uint8_t* ctrl) {
+#ifdef __SSE2__
+	return _mm_movemask_epi8(_mm_loadu_si128((__m128i*)ctrl));
+#else
+	uint32_t result = 0;
+	for(int i=0; i<HT_GROUP_SIZE; i++) result |= (uint32_t)(ctrl[i] >> 7) << i;
+	return result;
+#endif
+}
+
+/** How many buckets ht_iter_next(...) prefetches ahead, when scanning a robin hood table */
+#define HT_ITER_PREFETCH 256
+
+/** Start iterating over the non-empty buckets of a table */
+struct ht_iter ht_iter(struct hash_table* table) {
+	struct hash_table_header* header = HTHEADER(table);
+	struct ht_iter it = {table, -1, HTMEMPTR(header->buckets_ptr), NULL, header->bucket_count, header->bucket_size, 0, 0, 0};
+	if(header->flags & HT_SWISS) it.ctrl = (uint8_t*)HTMEMPTR(header->ctrl_ptr);
+	return it;
+}
+
+/** Advance to the next non-empty bucket (it->idx). Returns false at the end.
+ * Works on 64 buckets at once: swiss tables get their occupancy from the control bytes, 
+ * robin hood tables from the hash words of the buckets, which are prefetched ahead. Empty words are skipped */
+bool ht_iter_next(struct ht_iter* it) {
+	while(it->bits == 0) {
+		if(it->base >= it->bucket_count) return false;
+		size_t count = min(64, it->bucket_count - it->base);
+		uint64_t bits = 0;
+		if(it->ctrl != NULL) {
+			// groups have 16 buckets and the bucket count is at least 16, so count is a multiple of 16
+			for(size_t g=0; g<count; g+=HT_GROUP_SIZE) {
+				bits |= (uint64_t)(~ht_swiss_match_free(it->ctrl + it->base + g) & 0xffff) << g;
+			}
+		}
+		else {
+			char* bucket = it->buckets + it->base * it->bucket_size;
+			for(size_t j=0; j<count; j++, bucket += it->bucket_size) {
+				__builtin_prefetch(bucket + HT_ITER_PREFETCH * it->bucket_size);
+				bits |= (uint64_t)(((struct hash_bucket*)bucket)->hash != 0) << j;
+			}
+		}
+		it->bits = bits;
+		it->word = it->base;
+		it->base += count;
+	}
+	it->idx = it->word + __builtin_ctzll(it->bits);
+	it->bits &= it->bits - 1;
+	return true;
+}
+
+/** Iterate over all non-empty buckets of a table, with the cursor IT (use IT.idx as bucket index). 
+ * Can be nested, as long as the file is not changed inside of the loop */
+#define HTITER(TABLE, IT)  for(struct ht_iter IT = ht_iter(TABLE); ht_iter_next(&IT); )
+
+/** Distance of bucket 'pos' from the home of hash h: in buckets for robin hood tables, 
+ * in steps of the probe sequence of groups for HT_SWISS tables */
+size_t ht_probe_length(struct hash_table* table, uint64_t h, size_t pos) {
+	struct hash_table_header* header = HTHEADER(table);
+	if(!(header->flags & HT_SWISS)) return (pos - h) & (header->bucket_count - 1);
+	size_t group_mask = header->bucket_count / HT_GROUP_SIZE - 1;
+	size_t group = h & group_mask, step = 0;
+	while(group != pos / HT_GROUP_SIZE && step <= group_mask) {
+		step++;
+		group = (group + step) & group_mask;
+	}
+	return step;
+}
+
+// declare methods used in insert, lookup, and remove
+MEMPTR ht_intern_bytes(struct mem* mem, const void* key, size_t len);
+MEMPTR ht_intern_str(struct mem* mem, char* str);
+MEMPTR ht_intern_lookup(struct mem* mem, char* str, uint64_t h);
+MEMPTR ht_intern_lookup_bytes(struct mem* mem, const void* key, size_t len, uint64_t h);
+void ht_resize(struct hash_table* table);
+void ht_reserve(struct hash_table* table, size_t count);
+void ht_resize_to(struct hash_table* table, size_t bucket_count);
+int64_t ht_swiss_lookup(struct hash_table* table, const void* key, size_t len, uint64_t h);
+int64_t ht_swiss_place(struct hash_table* table, struct hash_bucket* entry);
+void ht_swiss_resize(struct hash_table* table, size_t bucket_count);
+void ht_swiss_remove_at(struct hash_table* table, size_t pos);
+
+/** Compare the key of a bucket, whose hash is equal, with key (of len bytes): compares the lengths, then the bytes.
+ * For HT_INTERN tables, keyptr is the position of the interned key, and only positions are compared */
+static inline bool ht_key_equals(struct hash_table* table, struct hash_bucket* bucket, const void* key, size_t len, MEMPTR keyptr) {
+	if(keyptr != 0) return bucket->keyptr == keyptr;
+	return ht_bucket_key_len(table, bucket) == len && memcmp(key, ht_bucket_key(table, bucket), len) == 0;
+}
+
+/** Search bucket index of a key of len bytes, whose hash (see ht_hash_bytes(...)) is h. Return -1 if not existing */
+int64_t ht_lookup_bytes_hashed(struct hash_table* table, const void* key, size_t len, uint64_t h) {
+	struct hash_table_header* header = HTHEADER(table);
+	if(header->flags & HT_SWISS) return ht_swiss_lookup(table, key, len, h);
+	MEMPTR keyptr = 0;
+	if(header->flags & HT_INTERN) {
+		// a string that was never interned is not a key of any HT_INTERN table
+		keyptr = ht_intern_lookup_bytes(table->mem, key, len, header->flags & HT_WYHASH ? hash_bytes(key, len) : h);
+		if(keyptr == 0) {
+			STAT(table->mem, stats->lookups++; stats->lookup_misses++; stats->lookup_probes[0]++);
+			return -1;
+		}
+	}
+	size_t mask = header->bucket_count - 1;
+	size_t pos = h & mask, dist = 0;
+	struct hash_bucket* bucket;
+	do {
+		bucket = ht_bucket(table, pos);
 		// only need to check 'max_dist'-many buckets
-		if(bucket->hash == 0 || dist > HTHEADER(table)->max_dist) return -1;
-		if(bucket->hash == h) {
-			int cmp = strcmp(key, HTMEMPTR(bucket->keyptr));
-			if(cmp == 0) return pos;
+		if(bucket->hash == 0 || dist > header->max_dist) {
+			STAT(table->mem, stats->lookups++; stats->lookup_misses++; stats->lookup_probes[min(dist, MEM_STATS_PROBES - 1)]++);
+			return -1;
 		}
-		if(++pos == HTHEADER(table)->bucket_count) pos = 0; // wrap at end of table
+		if(bucket->hash == h && ht_key_equals(table, bucket, key, len, keyptr)) {
+			STAT(table->mem, stats->lookups++; stats->lookup_probes[min(dist, MEM_STATS_PROBES - 1)]++);
+			return pos;
+		}
+		pos = (pos + 1) & mask; // wrap at end of table
 		dist++;
 	} while(1);
 	return pos;
 }
 
-// adopted from https://www.sebastiansylvan.com/post/robin-hood-hashing-should-be-your-default-hash-table-implementation/
-/** You probably want to use ht_insert(...). Inserts the key into the hash table. Makes table bigger if necessary. 
- * @param key position of key string stored in memory mapped file
- * Returns bucket index. */
-int64_t ht_insert_intern(struct hash_table* table, uint64_t key) {
-	// check whether we need to make the hashtable bigger
-	int max_filled = min(floor(0.9 * HTHEADER(table)->bucket_count), HTHEADER(table)->bucket_count-1);
-	if(HTHEADER(table)->filled >= max_filled) {
-		ht_resize(table);
+/** Search bucket index of key, whose hash is h. Return -1 if not existing */
+int64_t ht_lookup_hashed(struct hash_table* table, char* key, uint64_t h) {
+	return ht_lookup_bytes_hashed(table, key, strlen(key), h);
+}
+
+/** Search bucket index of a binary key of len bytes (which may contain '\0'), return -1 if not existing */
+int64_t ht_lookup_bytes(struct hash_table* table, const void* key, size_t len) {
+	return ht_lookup_bytes_hashed(table, key, len, ht_hash_bytes(table, key, len));
+}
+
+/** Search bucket index of key, retun -1 if not existing */
+int64_t ht_lookup(struct hash_table* table, char* key) {
+	return ht_lookup_hashed(table, key, ht_hash(table, key));
+}
+
+/** Number of keys of ht_lookup_batch(...) whose memory accesses overlap */
+#define HT_BATCH 32
+
+/** Search bucket indices of n keys, and write them to out_idx (-1 for keys that do not exist). 
+ * Works on groups of HT_BATCH keys: first hashes all keys of a group and prefetches their home buckets, 
+ * then prefetches the keys referenced by these buckets, and only then compares the keys. 
+ * So the cache misses and page faults of the keys of a group overlap, instead of happening one after another */
+void ht_lookup_batch(struct hash_table* table, char** keys, size_t n, int64_t* out_idx) {
+	uint64_t hashes[HT_BATCH];
+	for(size_t start = 0; start < n; start += HT_BATCH) {
+		size_t count = min(n - start, HT_BATCH);
+		struct hash_table_header* header = HTHEADER(table);
+		bool swiss = header->flags & HT_SWISS;
+		size_t mask = header->bucket_count - 1;
+		uint8_t* ctrl = swiss ? (uint8_t*)HTMEMPTR(header->ctrl_ptr) : NULL;
+		size_t group_mask = header->bucket_count / HT_GROUP_SIZE - 1;
+
+		for(size_t i=0; i<count; i++) {
+			hashes[i] = ht_hash(table, keys[start + i]);
+			if(swiss) __builtin_prefetch(ctrl + (hashes[i] & group_mask) * HT_GROUP_SIZE);
+			else __builtin_prefetch(ht_bucket(table, hashes[i] & mask));
+		}
+		for(size_t i=0; i<count; i++) {
+			uint64_t h = hashes[i];
+			if(swiss) {
+				size_t group = h & group_mask;
+				uint32_t match = ht_swiss_match(ctrl + group * HT_GROUP_SIZE, ht_swiss_tag(h));
+				if(match != 0) __builtin_prefetch(ht_bucket(table, group * HT_GROUP_SIZE + __builtin_ctz(match)));
+			}
+			else {
+				struct hash_bucket* bucket = ht_bucket(table, h & mask);
+				if(bucket->hash == h) __builtin_prefetch(ht_bucket_key(table, bucket));
+			}
+		}
+		for(size_t i=0; i<count; i++) {
+			out_idx[start + i] = ht_lookup_hashed(table, keys[start + i], hashes[i]);
+		}
 	}
-	HTHEADER(table)->filled++;
+}
+
+// adopted from https://www.sebastiansylvan.com/post/robin-hood-hashing-should-be-your-default-hash-table-implementation/
+/** Robin hood insert for a fixed bucket size. Always inlined, so that the compiler can specialize 
+ * the copies of buckets when bucket_size is a constant. See ht_place(...) */
+static inline __attribute__((always_inline)) 
+int64_t ht_place_sized(struct hash_table* table, struct hash_bucket* entry, struct hash_bucket* tmp, size_t bucket_size) {
+	// placing does not allocate, so the pointers stay valid
+	struct hash_table_header* header = HTHEADER(table);
+	char* buckets = HTMEMPTR(header->buckets_ptr);
+	size_t mask = header->bucket_count - 1;
+	size_t max_dist = header->max_dist;
 
-	// robin hood insert
 	int64_t result = -1;
-	struct hash_bucket* to_insert = calloc(1, HTHEADER(table)->bucket_size);
-	struct hash_bucket* tmp = calloc(1, HTHEADER(table)->bucket_size);
-	to_insert->hash = hash(HTMEMPTR(key));
-	to_insert->keyptr = key;
-	int pos = to_insert->hash % HTHEADER(table)->bucket_count;
+	size_t home = entry->hash & mask, pos = home;
 	size_t insert_dist = 0;
 	do {
 		// search empty bucket
-		struct hash_bucket* bucket = ht_bucket(table, pos);
+		struct hash_bucket* bucket = (struct hash_bucket*)(buckets + pos * bucket_size);
 		if(bucket->hash == 0) {
 			// insert new entry
-			memcpy(bucket, to_insert, HTHEADER(table)->bucket_size);
+			memcpy(bucket, entry, bucket_size);
 			if(result < 0) result = pos;
-			HTHEADER(table)->max_dist = max(HTHEADER(table)->max_dist, insert_dist);
+			max_dist = max(max_dist, insert_dist);
 			break;
 		}
 		else {
 			// steal from the rich
-			int exist_dist = ((pos - bucket->hash) % HTHEADER(table)->bucket_count);
+			size_t exist_dist = (pos - bucket->hash) & mask;
 			if(insert_dist > exist_dist) {
 				// copy everything, hash, key, and value (if existing)
-				memcpy(tmp, bucket, HTHEADER(table)->bucket_size);
-				memcpy(bucket, to_insert, HTHEADER(table)->bucket_size);
-				memcpy(to_insert, tmp, HTHEADER(table)->bucket_size);
-				HTHEADER(table)->max_dist = max(HTHEADER(table)->max_dist, insert_dist);
+				memcpy(tmp, bucket, bucket_size);
+				memcpy(bucket, entry, bucket_size);
+				memcpy(entry, tmp, bucket_size);
+				STAT(table->mem, stats->displacements++);
+				max_dist = max(max_dist, insert_dist);
 				insert_dist = exist_dist;
 				if(result < 0) result = pos;
 			}
 		}
-		insert_dist++; pos++;
-		if(pos == HTHEADER(table)->bucket_count) pos = 0;
+		insert_dist++;
+		pos = (pos + 1) & mask;
 	} while(1);
+	header->max_dist = max_dist;
+	// all buckets from the home bucket up to the empty one might have changed
+	ht_mark_buckets(table, home, ((pos - home) & mask) + 1);
 	return result;
 }
 
-/** Make bucket array twice as big, and copy all existing keys (with their values) */
-void ht_resize(struct hash_table* table) {
-	size_t old_count = HTHEADER(table)->bucket_count;
-	HTHEADER(table)->bucket_count *= 2;
-	size_t size = HTHEADER(table)->bucket_count * HTHEADER(table)->bucket_size;
+/** Robin hood insert of a complete bucket (hash, key, and value) into the bucket array. Does not check the load factor.
+ * @param entry bucket to insert, gets overwritten
+ * @param tmp space for one bucket, used for swapping
+ * Returns bucket index where 'entry' was stored. */
+int64_t ht_place(struct hash_table* table, struct hash_bucket* entry, struct hash_bucket* tmp) {
+	// specialize for common value sizes: none (hash set), and one or two 8 byte words
+	switch(HTHEADER(table)->bucket_size) {
+		case sizeof(struct hash_bucket):      return ht_place_sized(table, entry, tmp, sizeof(struct hash_bucket));
+		case sizeof(struct hash_bucket) + 8:  return ht_place_sized(table, entry, tmp, sizeof(struct hash_bucket) + 8);
+		case sizeof(struct hash_bucket) + 16: return ht_place_sized(table, entry, tmp, sizeof(struct hash_bucket) + 16);
+		default: return ht_place_sized(table, entry, tmp, HTHEADER(table)->bucket_size);
+	}
+}
+
+/** Maximum number of entries of the table, if it had 'bucket_count' buckets */
+size_t ht_max_filled(struct hash_table* table, size_t bucket_count) {
+	struct hash_table_header* header = HTHEADER(table);
+	if(header->max_load == 0 && (header->flags & HT_SWISS)) return bucket_count / 8 * 7;
+	double max_load = header->max_load == 0 ? HT_MAX_LOAD : header->max_load;
+	return min((size_t)(max_load * bucket_count), bucket_count-1);
+}
+
+/** Set the maximum fraction of occupied buckets (load factor, more than 0 and at most 1). 
+ * Lower values make lookups faster, higher ones need less space. Pass 0 for the default. The bucket array grows if necessary */
+void ht_set_max_load(struct hash_table* table, double max_load) {
+	if(max_load != 0 && !(max_load > 0 && max_load <= 1)) handle_error("Invalid load factor");
+	HTHEADER(table)->max_load = max_load;
+	ht_mark_header(table);
+	ht_reserve(table, HTHEADER(table)->filled);
+}
+
+/** Make the hashtable bigger, if there is no space for another entry */
+void ht_grow(struct hash_table* table) {
+	size_t max_filled = ht_max_filled(table, HTHEADER(table)->bucket_count);
+	if(HTHEADER(table)->filled >= max_filled) {
+		ht_resize(table);
+	}
+	else if(HTHEADER(table)->filled + HTHEADER(table)->tombstones >= max_filled) {
+		// too many removed buckets in a HT_SWISS table, rebuild it with the same size
+		ht_resize_to(table, HTHEADER(table)->bucket_count);
+	}
+}
+
+/** Insert a new entry, whose hash and key have already been set. Returns bucket index */
+int64_t ht_insert_entry(struct hash_table* table, struct hash_bucket* entry) {
+	HTHEADER(table)->filled++;
+	ht_mark_header(table);
+	int64_t pos;
+	if(HTHEADER(table)->flags & HT_SWISS) pos = ht_swiss_place(table, entry);
+	else {
+		char swap[HTHEADER(table)->bucket_size];
+		pos = ht_place(table, entry, (struct hash_bucket*)swap);
+	}
+	STAT(table->mem, stats->inserts++; stats->insert_probes[min(ht_probe_length(table, ht_bucket(table, pos)->hash, pos), MEM_STATS_PROBES - 1)]++);
+	return pos;
+}
+
+/** Set the key of an entry. Short keys of HT_INLINE_KEYS tables are copied into the entry, 
+ * other keys are written to the memory mapped file (see mem_insert_bytes(...)) unless 'keyptr' is not 0 
+ * @param key the key, len bytes
+ * @param keyptr position of the key, if it is already stored in the memory mapped file */
+void ht_set_key(struct hash_table* table, struct hash_bucket* entry, const void* key, size_t len, MEMPTR keyptr) {
+	if(HTHEADER(table)->flags & HT_INLINE_KEYS) {
+		char* inline_key = (char*)&entry->keyptr;
+		if(len <= HT_INLINE_KEY_SIZE - 2) {
+			memcpy(inline_key, key, len);
+			inline_key[len] = '\0';
+			inline_key[HT_INLINE_KEY_SIZE-1] = len;
+			return;
+		}
+		inline_key[HT_INLINE_KEY_SIZE-1] = HT_KEY_SPILLED;
+	}
+	if(HTHEADER(table)->flags & HT_INTERN) entry->keyptr = ht_intern_bytes(table->mem, key, len);
+	else entry->keyptr = keyptr != 0 ? keyptr : mem_insert_bytes(table->mem, key, len);
+}
+
+/** You probably want to use ht_insert_str(...). Inserts the key into the hash table. Makes table bigger if necessary. 
+ * @param key position of key string stored in memory mapped file
+ * Returns bucket index. */
+int64_t ht_insert_intern(struct hash_table* table, uint64_t key) {
+	// check whether we need to make the hashtable bigger
+	mem_write_begin(table->mem);
+	ht_grow(table);
+
+	// robin hood insert, buckets on the stack
+	size_t bucket_size = HTHEADER(table)->bucket_size;
+	char entry[bucket_size];
+	memset(entry, 0, bucket_size);
+	struct hash_bucket* to_insert = (struct hash_bucket*)entry;
+	size_t len = mem_str_len(table->mem, key);
+	to_insert->hash = ht_hash_bytes(table, HTMEMPTR(key), len);
+	ht_set_key(table, to_insert, HTMEMPTR(key), len, key);
+	int64_t result = ht_insert_entry(table, to_insert);
+	mem_write_end(table->mem);
+	return result;
+}
 
+/** Replace the bucket array by one with 'bucket_count' buckets (a power of two, big enough for all entries), 
+ * and move all existing buckets (with their values) into it.
+ * The hashes stored in the buckets are reused, so no key is read. The old bucket array is freed */
+void ht_resize_to(struct hash_table* table, size_t bucket_count) {
+	STAT_START(start);
+	if(HTHEADER(table)->flags & HT_SWISS) {
+		ht_swiss_resize(table, bucket_count);
+		STAT(table->mem, stats->resizes++; stats->resize_ns += mem_stats_now() - start);
+		return;
+	}
+	size_t old_count = HTHEADER(table)->bucket_count;
+	size_t bucket_size = HTHEADER(table)->bucket_size;
 	uint64_t old_ptr = HTHEADER(table)->buckets_ptr;
-	HTHEADER(table)->filled = 0;
-	HTHEADER(table)->max_dist = 0;
+	size_t size = bucket_count * bucket_size;
 
 	// temporary variable necessary, as alloc invalidates pointer used by HTHEADER(table)
 	uint64_t tmp = mem_alloc(table->mem, size);
 	HTHEADER(table)->buckets_ptr = tmp;
+	HTHEADER(table)->bucket_count = bucket_count;
+	HTHEADER(table)->max_dist = 0;
+	ht_mark_header(table);
 	memset(HTMEMPTR(HTHEADER(table)->buckets_ptr), 0, size);
-	uint64_t value_size = HTHEADER(table)->bucket_size - sizeof(struct hash_bucket);
-	for(int i=0; i<old_count; i++) {
+	ht_advise(table, MADV_RANDOM);
+	ht_advise_range(table, old_ptr, old_count * bucket_size, MADV_SEQUENTIAL);
+
+	char entry[bucket_size], swap[bucket_size];
+	for(size_t i=0; i<old_count; i++) {
 		struct hash_bucket* old_bucket = ht_bucket_rel(table, i, old_ptr);
 		if(old_bucket->hash != 0) {
-			int64_t bucket_idx = ht_insert_intern(table, old_bucket->keyptr);
-			memcpy(ht_value(table, bucket_idx), ht_value_rel(old_bucket), value_size);
+			memcpy(entry, old_bucket, bucket_size);
+			ht_place(table, (struct hash_bucket*)entry, (struct hash_bucket*)swap);
 		}
 	}
-	memset(HTMEMPTR(old_ptr), 0xff, old_count * HTHEADER(table)->bucket_size);
+	// the memory is reused for other data
+	ht_advise_range(table, old_ptr, old_count * bucket_size, MADV_NORMAL);
+	mem_free(table->mem, old_ptr);
+	STAT(table->mem, stats->resizes++; stats->resize_ns += mem_stats_now() - start);
+}
+
+/** Occupancy of a hash table, see ht_get_stats(...) */
+struct ht_stats {
+	size_t bucket_count;
+	size_t filled;
+	size_t tombstones;                  // HT_SWISS only
+	double load;                        // filled / bucket_count
+	size_t max_dist;                    // longest probe length, see ht_probe_length(...)
+	double mean_dist;
+	size_t dist[MEM_STATS_PROBES];      // entries with probe length i, the last counts all longer ones
+};
+
+/** Scan the bucket array, and compute the distribution of the probe lengths of its entries */
+struct ht_stats ht_get_stats(struct hash_table* table) {
+	struct ht_stats result;
+	memset(&result, 0, sizeof(result));
+	struct hash_table_header* header = HTHEADER(table);
+	result.bucket_count = header->bucket_count;
+	result.tombstones = header->flags & HT_SWISS ? header->tombstones : 0;
+	size_t sum = 0;
+	for(size_t i = 0; i < header->bucket_count; i++) {
+		uint64_t h = ht_bucket(table, i)->hash;
+		if(h == 0) continue;
+		size_t dist = ht_probe_length(table, h, i);
+		result.filled++;
+		result.max_dist = max(result.max_dist, dist);
+		result.dist[min(dist, MEM_STATS_PROBES - 1)]++;
+		sum += dist;
+	}
+	result.load = (double)result.filled / result.bucket_count;
+	result.mean_dist = result.filled == 0 ? 0 : (double)sum / result.filled;
+	return result;
+}
+
+/** Make bucket array twice as big, see ht_resize_to(...) */
+void ht_resize(struct hash_table* table) {
+	ht_resize_to(table, 2 * HTHEADER(table)->bucket_count);
+}
+
+/** Make the bucket array big enough for 'count' entries, so that inserting them does not resize it */
+void ht_reserve(struct hash_table* table, size_t count) {
+	size_t bucket_count = HTHEADER(table)->bucket_count;
+	while(ht_max_filled(table, bucket_count) < count) bucket_count *= 2;
+	if(bucket_count > HTHEADER(table)->bucket_count) {
+		mem_write_begin(table->mem);
+		ht_resize_to(table, bucket_count);
+		mem_write_end(table->mem);
+	}
+}
+
+/** Insert a key of len bytes, whose hash (see ht_hash_bytes(...)) is h, into hashtable. Returns bucket index */
+int64_t ht_insert_bytes_hashed(struct hash_table* table, const void* data, size_t len, uint64_t h) {
+	// check whether key already exists
+	int64_t pos = ht_lookup_bytes_hashed(table, data, len, h);
+	if(pos >= 0) return pos;
+
+	// resizing might move the mapping, and the key might reside in it
+	struct mem* mem = table->mem;
+	char* key = (char*)data;
+	bool inside = (void*)key >= (void*)mem->header && (void*)key < MEMPTR(mem->header->size);
+	MEMPTR key_pos = inside ? (void*)key - (void*)mem->header : 0;
+	mem_write_begin(mem);
+	ht_grow(table);
+	if(inside) key = MEMPTR(key_pos);
+
+	// internalize string, if it is not stored in the bucket
+	size_t bucket_size = HTHEADER(table)->bucket_size;
+	char entry[bucket_size];
+	memset(entry, 0, bucket_size);
+	struct hash_bucket* to_insert = (struct hash_bucket*)entry;
+	to_insert->hash = h;
+	ht_set_key(table, to_insert, key, len, 0);
+	pos = ht_insert_entry(table, to_insert);
+	mem_write_end(mem);
+	return pos;
+}
+
+/** Insert string, whose hash (see ht_hash(...)) is h, into hashtable. Returns bucket index */
+int64_t ht_insert_hashed(struct hash_table* table, char* key, uint64_t h) {
+	return ht_insert_bytes_hashed(table, key, strlen(key), h);
+}
+
+/** Insert a binary key of len bytes (which may contain '\0') into hashtable. The key is stored with its length, 
+ * see ht_key_len(...). Returns bucket index */
+int64_t ht_insert_bytes(struct hash_table* table, const void* key, size_t len) {
+	return ht_insert_bytes_hashed(table, key, len, ht_hash_bytes(table, key, len));
+}
+
+/** Set the value of a bucket of a HT_BLOB_VALUES table to len bytes, which are written to the memory mapped file
+ * like keys (see mem_insert_bytes(...)). The previous value of the bucket is freed */
+void ht_set_blob(struct hash_table* table, int64_t bucket_idx, const void* data, size_t len) {
+	mem_write_begin(table->mem);
+	MEMPTR old = *(MEMPTR*)ht_value_rel(table, ht_bucket(table, bucket_idx));
+	MEMPTR blob = mem_insert_bytes(table->mem, data, len);
+	if(old != 0) mem_free_str(table->mem, old);
+	*(MEMPTR*)ht_value(table, bucket_idx) = blob;
+	mem_write_end(table->mem);
+}
+
+/** Get main memory addr of the value of a bucket of a HT_BLOB_VALUES table, and write its length to len (unless NULL).
+ * Returns NULL if no value was set. Like all pointers into the file, it is invalid after the file grows */
+void* ht_get_blob(struct hash_table* table, int64_t bucket_idx, size_t* len) {
+	MEMPTR blob = *(MEMPTR*)ht_value_rel(table, ht_bucket(table, bucket_idx));
+	if(len != NULL) *len = blob == 0 ? 0 : mem_str_len(table->mem, blob);
+	return blob == 0 ? NULL : HTMEMPTR(blob);
 }
 
 /** Insert string into hashtable. Returns bucket index */
 int64_t ht_insert_str(struct hash_table* table, char* key) {
-	// check whether key already exists
-	int64_t pos = ht_lookup(table, key);
-	if(pos >= 0) pos;
+	return ht_insert_hashed(table, key, ht_hash(table, key));
+}
+
+/** Write a value string of a HT_MULTIMAP table, interned if the table has HT_INTERN */
+MEMPTR multimap_store_str(struct hash_table* table, char* val) {
+	if(HTHEADER(table)->flags & HT_INTERN) return ht_intern_str(table->mem, val);
+	return mem_insert_str(table->mem, val);
+}
+
+/** Give a value string of a HT_MULTIMAP table back, see multimap_store_str(...) */
+void multimap_free_str(struct hash_table* table, MEMPTR str) {
+	if(!(HTHEADER(table)->flags & HT_INTERN)) mem_free_str(table->mem, str);
+}
+
+/** Compare a value string of a HT_MULTIMAP table with val. interned is the position of val for HT_INTERN tables, see ht_key_equals(...) */
+bool multimap_str_equals(struct hash_table* table, MEMPTR str, char* val, MEMPTR interned) {
+	if(HTHEADER(table)->flags & HT_INTERN) return str == interned;
+	return strcmp(HTMEMPTR(str), val) == 0;
+}
+
+/** Number of values of the key in bucket 'bucket_idx' of a multi-map */
+size_t multimap_count(struct hash_table* table, int64_t bucket_idx) {
+	uint64_t set = *(uint64_t*)ht_value_rel(table, ht_bucket(table, bucket_idx));
+	if(set & MULTIMAP_SINGLE) return 1;
+	if(set & MULTIMAP_ARRAY) return ((struct multimap_array*)HTMEMPTR(set & ~MULTIMAP_TAGS))->count;
+	struct hash_table values = ht_open(table->mem, set);
+	return HTHEADER(&values)->filled;
+}
+
+/** Move the value string 'str' of a small HT_MULTIMAP set into its nested table 'tab'. Without HT_INLINE_KEYS and HT_INTERN
+ * the nested table takes over the string at its position */
+void multimap_promote_str(struct hash_table* table, struct hash_table* tab, MEMPTR str) {
+	struct mem* mem = table->mem;
+	if(HTHEADER(tab)->flags & (HT_INLINE_KEYS | HT_INTERN)) {
+		ht_insert_str(tab, MEMPTR(str));
+		multimap_free_str(table, str);
+	}
+	else ht_insert_intern(tab, str);
+}
+
+/** Replace the small value set of the HT_MULTIMAP key in bucket 'pos' by a nested table (of the same kind as the multi-map),
+ * with space for at least 'reserve' values. Returns the nested table */
+struct hash_table multimap_promote(struct hash_table* table, int64_t pos, size_t reserve) {
+	struct mem* mem = table->mem;
+	uint64_t set = *(uint64_t*)ht_value(table, pos);
+	struct hash_table tab = ht_init_flags(mem, 0, HTHEADER(table)->flags & ~HT_MULTIMAP);
+	ht_reserve(&tab, reserve);
+	if(set & MULTIMAP_SINGLE) multimap_promote_str(table, &tab, set & ~MULTIMAP_TAGS);
+	else {
+		for(size_t i=0; ; i++) {
+			// inserting might move the mapping
+			struct multimap_array* array = MEMPTR(set & ~MULTIMAP_TAGS);
+			if(i == array->count) break;
+			multimap_promote_str(table, &tab, array->vals[i]);
+		}
+		mem_free(mem, set & ~MULTIMAP_TAGS);
+	}
+	*(uint64_t*)ht_value(table, pos) = tab.header_ptr;
+	return tab;
+}
+
+/** Add a value to the set of the existing HT_MULTIMAP key in bucket 'pos': up to MULTIMAP_SMALL values 
+ * are stored in a struct multimap_array, more in a nested hash table */
+void multimap_add_small(struct hash_table* table, int64_t pos, char* val) {
+	struct mem* mem = table->mem;
+	uint64_t set = *(uint64_t*)ht_value(table, pos);
+	if(!(set & MULTIMAP_TAGS)) {
+		struct hash_table tab = ht_open(mem, set);
+		ht_insert_str(&tab, val);
+		return;
+	}
+	// allocating might move the mapping, and the value might reside in it
+	bool inside = (void*)val >= (void*)mem->header && (void*)val < MEMPTR(mem->header->size);
+	MEMPTR val_pos = inside ? (void*)val - (void*)mem->header : 0;
+#define MULTIMAP_VAL (inside ? (char*)MEMPTR(val_pos) : val)
+
+	MEMPTR interned = HTHEADER(table)->flags & HT_INTERN ? ht_intern_lookup(mem, val, hash(val)) : 0;
+	if(set & MULTIMAP_SINGLE) {
+		if(multimap_str_equals(table, set & ~MULTIMAP_TAGS, val, interned)) return;
+		MEMPTR array_ptr = mem_alloc(mem, sizeof(struct multimap_array) + MULTIMAP_ARRAY_FIRST * sizeof(MEMPTR));
+		struct multimap_array* array = MEMPTR(array_ptr);
+		array->count = 1;
+		array->capacity = MULTIMAP_ARRAY_FIRST;
+		array->vals[0] = set & ~MULTIMAP_TAGS;
+		set = array_ptr | MULTIMAP_ARRAY;
+		*(uint64_t*)ht_value(table, pos) = set;
+	}
+	else {
+		MEMPTR array_ptr = set & ~MULTIMAP_TAGS;
+		struct multimap_array* array = MEMPTR(array_ptr);
+		for(size_t i=0; i<array->count; i++) {
+			if(multimap_str_equals(table, array->vals[i], val, interned)) return;
+		}
+		if(array->count == array->capacity && array->capacity < MULTIMAP_SMALL) {
+			// grow the array
+			size_t capacity = 2 * array->capacity;
+			MEMPTR grown_ptr = mem_alloc(mem, sizeof(struct multimap_array) + capacity * sizeof(MEMPTR));
+			array = MEMPTR(array_ptr);
+			struct multimap_array* grown = MEMPTR(grown_ptr);
+			memcpy(grown, array, sizeof(struct multimap_array) + array->count * sizeof(MEMPTR));
+			grown->capacity = capacity;
+			mem_free(mem, array_ptr);
+			set = grown_ptr | MULTIMAP_ARRAY;
+			*(uint64_t*)ht_value(table, pos) = set;
+		}
+		else if(array->count == array->capacity) {
+			struct hash_table tab = multimap_promote(table, pos, array->count + 1);
+			ht_insert_str(&tab, MULTIMAP_VAL);
+			return;
+		}
+	}
+	MEMPTR str = multimap_store_str(table, MULTIMAP_VAL);
+	struct multimap_array* array = MEMPTR(set & ~MULTIMAP_TAGS);
+	array->vals[array->count++] = str;
+	mem_mark_dirty(mem, set & ~MULTIMAP_TAGS, sizeof(struct multimap_array) + array->count * sizeof(MEMPTR));
+#undef MULTIMAP_VAL
+}
 
-	// internalize string
-	uint64_t keyptr = mem_insert_str(table->mem, key);
-	return ht_insert_intern(table, keyptr);
+/** Insert a key value pair into a HT_MULTIMAP table: the first value is stored in the bucket, see multimap_add_small(...) */
+void multimap_insert_small(struct hash_table* table, char* key, char* val) {
+	int64_t pos = ht_lookup(table, key);
+	if(pos >= 0) {
+		multimap_add_small(table, pos, val);
+		return;
+	}
+	struct mem* mem = table->mem;
+	bool inside = (void*)val >= (void*)mem->header && (void*)val < MEMPTR(mem->header->size);
+	MEMPTR val_pos = inside ? (void*)val - (void*)mem->header : 0;
+	pos = ht_insert_str(table, key);
+	MEMPTR str = multimap_store_str(table, inside ? (char*)MEMPTR(val_pos) : val);
+	*(uint64_t*)ht_value(table, pos) = str | MULTIMAP_SINGLE;
 }
 
-/** Insert a key value pair into multi-map hash table. Requires ht_init(..., sizeof(MEMPTR)) */
+/** Insert a key value pair into multi-map hash table. Requires ht_init(..., sizeof(MEMPTR)), or multimap_init(...) */
 void multimap_insert_key_val(struct hash_table* table, char* key, char* val) {
+	mem_write_begin(table->mem);
+	if(HTHEADER(table)->flags & HT_MULTIMAP) {
+		multimap_insert_small(table, key, val);
+		mem_write_end(table->mem);
+		return;
+	}
 	int64_t pos = ht_lookup(table, key);
 	// key didn't exist yet, create hashtable
 	struct hash_table tab;
 	if(pos < 0) {
 		pos = ht_insert_str(table, key);
-		tab = ht_init(table->mem, 0);
+		// the set of values uses the same kind of table as the multi-map
+		tab = ht_init_flags(table->mem, 0, HTHEADER(table)->flags);
 		uint64_t* val = ht_value(table, pos);
 		val[0] = tab.header_ptr;
 	}
@@ -455,6 +2016,51 @@ void multimap_insert_key_val(struct hash_table* table, char* key, char* val) {
 		tab.header_ptr = val[0];
 	}
 	ht_insert_str(&tab, val);
+	mem_write_end(table->mem);
+}
+
+/** Insert k values for one key into a multi-map. Looks the key up only once, 
+ * and makes the set of values big enough for all of them at once */
+void multimap_insert_key_vals(struct hash_table* table, char* key, char** vals, size_t k) {
+	if(k == 0) return;
+	struct mem* mem = table->mem;
+	mem_write_begin(mem);
+	// the only probe for the key: it is found or added by ht_insert_str(...), which might move the mapping
+	bool inside = (void*)vals[0] >= (void*)mem->header && (void*)vals[0] < MEMPTR(mem->header->size);
+	MEMPTR val_pos = inside ? (void*)vals[0] - (void*)mem->header : 0;
+	size_t filled = HTHEADER(table)->filled;
+	int64_t pos = ht_insert_str(table, key);
+	char* first = inside ? (char*)MEMPTR(val_pos) : vals[0];
+	bool created = HTHEADER(table)->filled != filled;
+	bool small = HTHEADER(table)->flags & HT_MULTIMAP;
+	struct hash_table tab;
+	if(created && small && k <= MULTIMAP_SMALL) {
+		MEMPTR str = multimap_store_str(table, first);
+		*(uint64_t*)ht_value(table, pos) = str | MULTIMAP_SINGLE;
+		// adding values only changes the set, so 'pos' stays valid
+		for(size_t i=1; i<k; i++) multimap_add_small(table, pos, vals[i]);
+		mem_write_end(mem);
+		return;
+	}
+	if(created) {
+		tab = ht_init_flags(mem, 0, HTHEADER(table)->flags & ~HT_MULTIMAP);
+		*(uint64_t*)ht_value(table, pos) = tab.header_ptr;
+	}
+	else if(small && (*(uint64_t*)ht_value(table, pos) & MULTIMAP_TAGS)) {
+		size_t count = multimap_count(table, pos);
+		if(count + k <= MULTIMAP_SMALL) {
+			for(size_t i=0; i<k; i++) multimap_add_small(table, pos, i == 0 ? first : vals[i]);
+			mem_write_end(mem);
+			return;
+		}
+		tab = multimap_promote(table, pos, count + k);
+	}
+	else {
+		tab = ht_open(mem, *(uint64_t*)ht_value(table, pos));
+	}
+	ht_reserve(&tab, HTHEADER(&tab)->filled + k);
+	for(size_t i=0; i<k; i++) ht_insert_str(&tab, i == 0 ? first : vals[i]);
+	mem_write_end(mem);
 }
 
 /** Get a multimap, which was stored in the value of another hashmap */
@@ -465,6 +2071,1573 @@ struct hash_table multimap_get(struct mem* mem, void* ptr) {
 	return tab;
 }
 
+/** Init a multi-map, that stores small sets of values (up to MULTIMAP_SMALL) without a nested hash table. 
+ * Read the values with multimap_iter(...) or MULTIMAP_FOREACH(...), rather than multimap_get(...)
+ * @param flags see ht_init_flags(...), also used for the nested tables */
+struct hash_table multimap_init(struct mem* mem, uint64_t flags) {
+	return ht_init_flags(mem, sizeof(MEMPTR), flags | HT_MULTIMAP);
+}
+
+/** Start iterating over the values of the key in bucket 'bucket_idx' of a multi-map */
+struct multimap_iter multimap_iter(struct hash_table* table, int64_t bucket_idx) {
+	struct multimap_iter it = {table, *(uint64_t*)ht_value_rel(table, ht_bucket(table, bucket_idx)), 0};
+	return it;
+}
+
+/** Advance to the next value (it->val). Returns false at the end. The file must not change while iterating */
+bool multimap_iter_next(struct multimap_iter* it) {
+	struct hash_table* table = it->table;
+	if(it->set & MULTIMAP_SINGLE) {
+		it->val = HTMEMPTR(it->set & ~MULTIMAP_TAGS);
+		return it->i++ == 0;
+	}
+	if(it->set & MULTIMAP_ARRAY) {
+		struct multimap_array* array = (struct multimap_array*)HTMEMPTR(it->set & ~MULTIMAP_TAGS);
+		if(it->i >= array->count) return false;
+		it->val = HTMEMPTR(array->vals[it->i++]);
+		return true;
+	}
+	// the cursor refers to nested_table, so it is only created here, where 'it' does not move anymore
+	if(it->i++ == 0) {
+		it->nested_table = ht_open(table->mem, it->set);
+		it->nested = ht_iter(&it->nested_table);
+	}
+	if(!ht_iter_next(&it->nested)) return false;
+	it->val = ht_key(&it->nested_table, it->nested.idx);
+	return true;
+}
+
+/** Iterate over all values (IT.val) of the key in bucket BUCKET_IDX of a multi-map */
+#define MULTIMAP_FOREACH(TABLE, BUCKET_IDX, IT)  for(struct multimap_iter IT = multimap_iter((TABLE), (BUCKET_IDX)); multimap_iter_next(&IT); )
+
+/** Store a string (of len bytes) only once per file: returns the position of an existing copy, or writes a new one.
+ * The copies are kept in a hash set (mem_header.intern_ptr), and are never freed. Used for the keys of HT_INTERN tables */
+MEMPTR ht_intern_bytes(struct mem* mem, const void* key, size_t len) {
+	char* str = (char*)key;
+	if(mem->header->intern_ptr == 0) {
+		// creating the set might move the mapping, and the string might reside in it
+		bool inside = (void*)str >= (void*)mem->header && (void*)str < MEMPTR(mem->header->size);
+		MEMPTR str_pos = inside ? (void*)str - (void*)mem->header : 0;
+		struct hash_table strings = ht_init(mem, 0);
+		mem->header->intern_ptr = strings.header_ptr;
+		if(inside) str = MEMPTR(str_pos);
+	}
+	struct hash_table strings = ht_open(mem, mem->header->intern_ptr);
+	struct hash_table* table = &strings;
+	return ht_bucket(table, ht_insert_bytes(table, str, len))->keyptr;
+}
+
+/** Store a string only once per file, see ht_intern_bytes(...) */
+MEMPTR ht_intern_str(struct mem* mem, char* str) {
+	return ht_intern_bytes(mem, str, strlen(str));
+}
+
+/** Position of the interned copy of a string of len bytes (whose FNV-1a hash is h), or 0 if it was never interned */
+MEMPTR ht_intern_lookup_bytes(struct mem* mem, const void* key, size_t len, uint64_t h) {
+	if(mem->header->intern_ptr == 0) return 0;
+	struct hash_table strings = ht_open(mem, mem->header->intern_ptr);
+	int64_t pos = ht_lookup_bytes_hashed(&strings, key, len, h);
+	return pos < 0 ? 0 : ht_bucket(&strings, pos)->keyptr;
+}
+
+/** Position of the interned copy of a string (whose hash is h), or 0 if it was never interned */
+MEMPTR ht_intern_lookup(struct mem* mem, char* str, uint64_t h) {
+	return ht_intern_lookup_bytes(mem, str, strlen(str), h);
+}
+
+/** Give the memory of the key of a bucket back, if it is stored in the string heap and not interned */
+void ht_free_key(struct hash_table* table, struct hash_bucket* bucket) {
+	if(HTHEADER(table)->flags & HT_INTERN) return;
+	if(HTHEADER(table)->flags & HT_INLINE_KEYS) {
+		char* key = (char*)&bucket->keyptr;
+		if((unsigned char)key[HT_INLINE_KEY_SIZE-1] != HT_KEY_SPILLED) return;
+	}
+	mem_free_str(table->mem, bucket->keyptr);
+}
+
+/** Give the memory of the value of a bucket back, if it is a blob of a HT_BLOB_VALUES table */
+void ht_free_blob(struct hash_table* table, struct hash_bucket* bucket) {
+	if(!(HTHEADER(table)->flags & HT_BLOB_VALUES)) return;
+	MEMPTR blob = *(MEMPTR*)ht_value_rel(table, bucket);
+	if(blob != 0) mem_free_str(table->mem, blob);
+}
+
+/** Remove the entry in bucket 'bucket_idx', and free its key. Its value is not touched (except for the blobs of 
+ * HT_BLOB_VALUES tables); free it before, if necessary.
+ * Robin hood tables move the following buckets of the cluster one bucket back (backward shift deletion), 
+ * so bucket indices obtained before are invalid afterwards. With HT_SHRINK, the bucket array is halved when it is less than a quarter full */
+void ht_remove_idx(struct hash_table* table, int64_t bucket_idx) {
+	mem_write_begin(table->mem);
+	ht_free_key(table, ht_bucket(table, bucket_idx));
+	ht_free_blob(table, ht_bucket(table, bucket_idx));
+	HTHEADER(table)->filled--;
+	ht_mark_header(table);
+	if(HTHEADER(table)->flags & HT_SWISS) {
+		ht_swiss_remove_at(table, bucket_idx);
+	}
+	else {
+		struct hash_table_header* header = HTHEADER(table);
+		size_t mask = header->bucket_count - 1, bucket_size = header->bucket_size;
+		size_t pos = bucket_idx, next = (pos + 1) & mask;
+		// shift back until an empty bucket, or a bucket at its ideal position
+		while(ht_bucket(table, next)->hash != 0 && ((next - ht_bucket(table, next)->hash) & mask) != 0) {
+			memcpy(ht_bucket(table, pos), ht_bucket(table, next), bucket_size);
+			pos = next;
+			next = (next + 1) & mask;
+		}
+		memset(ht_bucket(table, pos), 0, bucket_size);
+		ht_mark_buckets(table, bucket_idx, ((pos - bucket_idx) & mask) + 1);
+	}
+
+	struct hash_table_header* header = HTHEADER(table);
+	size_t min_count = header->flags & HT_SWISS ? HT_GROUP_SIZE : 2;
+	if((header->flags & HT_SHRINK) && header->bucket_count > min_count
+			&& header->filled < ht_max_filled(table, header->bucket_count) / 4) {
+		ht_resize_to(table, header->bucket_count / 2);
+	}
+	mem_write_end(table->mem);
+}
+
+/** Remove key from the hash table, see ht_remove_idx(...). Returns false if the key did not exist */
+bool ht_remove(struct hash_table* table, char* key) {
+	int64_t pos = ht_lookup(table, key);
+	if(pos < 0) return false;
+	ht_remove_idx(table, pos);
+	return true;
+}
+
+/** Remove a binary key of len bytes from the hash table, see ht_remove_idx(...). Returns false if the key did not exist */
+bool ht_remove_bytes(struct hash_table* table, const void* key, size_t len) {
+	int64_t pos = ht_lookup_bytes(table, key, len);
+	if(pos < 0) return false;
+	ht_remove_idx(table, pos);
+	return true;
+}
+
+/** Give all memory of a hash table back: keys, blobs, bucket array, and header. The handle must not be used afterwards */
+void ht_free(struct hash_table* table) {
+	mem_write_begin(table->mem);
+	HTITER(table, it) {
+		ht_free_key(table, ht_bucket(table, it.idx));
+		ht_free_blob(table, ht_bucket(table, it.idx));
+	}
+	ht_advise(table, MADV_NORMAL);
+	mem_free(table->mem, HTHEADER(table)->buckets_ptr);
+	if(HTHEADER(table)->ctrl_ptr != 0) mem_free(table->mem, HTHEADER(table)->ctrl_ptr);
+	mem_free(table->mem, table->header_ptr);
+	mem_write_end(table->mem);
+}
+
+/** Remove a key and all its values from a multi-map. Returns false if the key did not exist */
+bool multimap_remove_key(struct hash_table* table, char* key) {
+	int64_t pos = ht_lookup(table, key);
+	if(pos < 0) return false;
+	uint64_t set = *(uint64_t*)ht_value(table, pos);
+	mem_write_begin(table->mem);
+	if(set & MULTIMAP_SINGLE) {
+		multimap_free_str(table, set & ~MULTIMAP_TAGS);
+	}
+	else if(set & MULTIMAP_ARRAY) {
+		struct mem* mem = table->mem;
+		struct multimap_array* array = MEMPTR(set & ~MULTIMAP_TAGS);
+		for(size_t i=0; i<array->count; i++) multimap_free_str(table, array->vals[i]);
+		mem_free(mem, set & ~MULTIMAP_TAGS);
+	}
+	else {
+		struct hash_table values = ht_open(table->mem, set);
+		ht_free(&values);
+	}
+	ht_remove_idx(table, pos);
+	mem_write_end(table->mem);
+	return true;
+}
+
+/** Remove one value of a key from a multi-map. The key is removed with its last value. Returns false if the pair did not exist */
+bool multimap_remove_key_val(struct hash_table* table, char* key, char* val) {
+	int64_t pos = ht_lookup(table, key);
+	if(pos < 0) return false;
+	uint64_t set = *(uint64_t*)ht_value(table, pos);
+	if(set & MULTIMAP_TAGS) {
+		struct mem* mem = table->mem;
+		MEMPTR interned = HTHEADER(table)->flags & HT_INTERN ? ht_intern_lookup(mem, val, hash(val)) : 0;
+		if(set & MULTIMAP_SINGLE) {
+			if(!multimap_str_equals(table, set & ~MULTIMAP_TAGS, val, interned)) return false;
+			return multimap_remove_key(table, key);
+		}
+		struct multimap_array* array = MEMPTR(set & ~MULTIMAP_TAGS);
+		for(size_t i=0; i<array->count; i++) {
+			if(multimap_str_equals(table, array->vals[i], val, interned)) {
+				if(array->count == 1) return multimap_remove_key(table, key);
+				mem_write_begin(mem);
+				multimap_free_str(table, array->vals[i]);
+				array->vals[i] = array->vals[--array->count];
+				mem_mark_dirty(mem, set & ~MULTIMAP_TAGS, sizeof(struct multimap_array) + (array->count + 1) * sizeof(MEMPTR));
+				mem_write_end(mem);
+				return true;
+			}
+		}
+		return false;
+	}
+	struct hash_table values = multimap_get(table->mem, ht_value(table, pos));
+	if(ht_lookup(&values, val) < 0) return false;
+	mem_write_begin(table->mem);
+	ht_remove(&values, val);
+	if(HTHEADER(&values)->filled == 0) multimap_remove_key(table, key);
+	mem_write_end(table->mem);
+	return true;
+}
+
+
+//********************************************************************************
+// swiss table
+//********************************************************************************
+
+// Tables with HT_SWISS keep one control byte per bucket. It is HT_CTRL_EMPTY for an empty bucket,
+// or the highest 7 bits of the hash of its key. Buckets are split into groups of HT_GROUP_SIZE. 
+// A lookup compares the control bytes of a whole group at once with the key's 7 bits (with SSE2, if available),
+// and only compares the keys of the matching buckets. The buckets have the same layout as for robin hood hashing.
+
+/** Search bucket index of key with hash h in a HT_SWISS table, return -1 if not existing */
+int64_t ht_swiss_lookup(struct hash_table* table, const void* key, size_t len, uint64_t h) {
+	struct hash_table_header* header = HTHEADER(table);
+	MEMPTR keyptr = 0;
+	if(header->flags & HT_INTERN) {
+		keyptr = ht_intern_lookup_bytes(table->mem, key, len, header->flags & HT_WYHASH ? hash_bytes(key, len) : h);
+		if(keyptr == 0) {
+			STAT(table->mem, stats->lookups++; stats->lookup_misses++; stats->lookup_probes[0]++);
+			return -1;
+		}
+	}
+	uint8_t* ctrl = (uint8_t*)HTMEMPTR(header->ctrl_ptr);
+	size_t group_mask = header->bucket_count / HT_GROUP_SIZE - 1;
+	size_t group = h & group_mask;
+	uint8_t tag = ht_swiss_tag(h);
+	// triangular probing visits all groups, as the number of groups is a power of two
+	for(size_t step = 1; ; step++) {
+		uint8_t* group_ctrl = ctrl + group * HT_GROUP_SIZE;
+		for(uint32_t match = ht_swiss_match(group_ctrl, tag); match != 0; match &= match - 1) {
+			size_t pos = group * HT_GROUP_SIZE + __builtin_ctz(match);
+			struct hash_bucket* bucket = ht_bucket(table, pos);
+			if(bucket->hash == h && ht_key_equals(table, bucket, key, len, keyptr)) {
+				STAT(table->mem, stats->lookups++; stats->lookup_probes[min(step - 1, MEM_STATS_PROBES - 1)]++);
+				return pos;
+			}
+		}
+		if(ht_swiss_match_empty(group_ctrl) != 0) {
+			STAT(table->mem, stats->lookups++; stats->lookup_misses++; stats->lookup_probes[min(step - 1, MEM_STATS_PROBES - 1)]++);
+			return -1;
+		}
+		group = (group + step) & group_mask;
+	}
+}
+
+/** Copy a complete bucket into the first empty or deleted bucket of its probe sequence. Does not check the load factor.
+ * Returns the bucket index */
+int64_t ht_swiss_place(struct hash_table* table, struct hash_bucket* entry) {
+	struct hash_table_header* header = HTHEADER(table);
+	uint8_t* ctrl = (uint8_t*)HTMEMPTR(header->ctrl_ptr);
+	size_t group_mask = header->bucket_count / HT_GROUP_SIZE - 1;
+	size_t group = entry->hash & group_mask;
+	for(size_t step = 1; ; step++) {
+		uint32_t free = ht_swiss_match_free(ctrl + group * HT_GROUP_SIZE);
+		if(free != 0) {
+			size_t pos = group * HT_GROUP_SIZE + __builtin_ctz(free);
+			memcpy(ht_bucket(table, pos), entry, header->bucket_size);
+			if(ctrl[pos] == HT_CTRL_DELETED) header->tombstones--;
+			ctrl[pos] = ht_swiss_tag(entry->hash);
+			ht_mark_buckets(table, pos, 1);
+			mem_mark_dirty(table->mem, header->ctrl_ptr + pos, 1);
+			return pos;
+		}
+		group = (group + step) & group_mask;
+	}
+}
+
+/** Empty a bucket of a HT_SWISS table. Lookups stop at groups with an empty bucket, 
+ * so the bucket can only become empty if its group already has one; otherwise it is marked as deleted */
+void ht_swiss_remove_at(struct hash_table* table, size_t pos) {
+	struct hash_table_header* header = HTHEADER(table);
+	uint8_t* ctrl = (uint8_t*)HTMEMPTR(header->ctrl_ptr);
+	if(ht_swiss_match_empty(ctrl + pos / HT_GROUP_SIZE * HT_GROUP_SIZE) != 0) {
+		ctrl[pos] = HT_CTRL_EMPTY;
+	}
+	else {
+		ctrl[pos] = HT_CTRL_DELETED;
+		header->tombstones++;
+	}
+	memset(ht_bucket(table, pos), 0, header->bucket_size);
+	ht_mark_buckets(table, pos, 1);
+	mem_mark_dirty(table->mem, header->ctrl_ptr + pos, 1);
+}
+
+/** Replace bucket array and control bytes by ones with 'bucket_count' buckets, and move all existing buckets into them. 
+ * Removes all deleted buckets. Frees the old arrays */
+void ht_swiss_resize(struct hash_table* table, size_t bucket_count) {
+	size_t old_count = HTHEADER(table)->bucket_count;
+	size_t bucket_size = HTHEADER(table)->bucket_size;
+	uint64_t old_ptr = HTHEADER(table)->buckets_ptr;
+	uint64_t old_ctrl_ptr = HTHEADER(table)->ctrl_ptr;
+
+	// temporary variables necessary, as alloc invalidates pointer used by HTHEADER(table)
+	uint64_t buckets_ptr = mem_alloc(table->mem, bucket_count * bucket_size);
+	uint64_t ctrl_ptr = mem_alloc(table->mem, bucket_count);
+	HTHEADER(table)->buckets_ptr = buckets_ptr;
+	HTHEADER(table)->ctrl_ptr = ctrl_ptr;
+	HTHEADER(table)->bucket_count = bucket_count;
+	HTHEADER(table)->tombstones = 0;
+	ht_mark_header(table);
+	memset(HTMEMPTR(buckets_ptr), 0, bucket_count * bucket_size);
+	memset(HTMEMPTR(ctrl_ptr), HT_CTRL_EMPTY, bucket_count);
+	ht_advise(table, MADV_RANDOM);
+	ht_advise_range(table, old_ptr, old_count * bucket_size, MADV_SEQUENTIAL);
+
+	uint8_t* old_ctrl = (uint8_t*)HTMEMPTR(old_ctrl_ptr);
+	for(size_t i=0; i<old_count; i++) {
+		if(!(old_ctrl[i] & HT_CTRL_EMPTY)) {
+			ht_swiss_place(table, ht_bucket_rel(table, i, old_ptr));
+		}
+	}
+	// the memory is reused for other data
+	ht_advise_range(table, old_ptr, old_count * bucket_size, MADV_NORMAL);
+	mem_free(table->mem, old_ptr);
+	mem_free(table->mem, old_ctrl_ptr);
+}
+
+//********************************************************************************
+// bulk loading
+//********************************************************************************
+
+/** Number of bits sorted per pass by ht_builder_finish(...) */
+#define HT_RADIX_BITS 11
+
+/** Builds a hash table from many key value pairs at once, see ht_builder_init(...). Resides in main memory */
+struct ht_builder {
+	struct hash_table table;            // table that is built
+	char* entries;                      // complete buckets (hash, key, value) of all added pairs
+	size_t entry_size;                  // bucket size of the table
+	size_t count;                       // number of added pairs
+	size_t capacity;                    // number of pairs that fit into 'entries'
+};
+
+/** Start building a new hash table. Add the pairs with ht_builder_add(...), and get the table with ht_builder_finish(...).
+ * Compared to ht_insert_str(...), the bucket array is allocated only once, and written sequentially.
+ * @param value_size, flags see ht_init_flags(...)
+ * @param expected number of pairs that will be added, to reserve main memory for them (0 if unknown) */
+struct ht_builder ht_builder_init(void* mem, size_t value_size, uint64_t flags, size_t expected) {
+	struct ht_builder builder;
+	builder.table = ht_init_flags(mem, value_size, flags);
+	struct hash_table* table = &builder.table;
+	builder.entry_size = HTHEADER(table)->bucket_size;
+	builder.count = 0;
+	builder.capacity = max(expected, 1024);
+	builder.entries = malloc(builder.capacity * builder.entry_size);
+	if(builder.entries == NULL) handle_error("Error allocating memory");
+	return builder;
+}
+
+/** Add a key value pair. The key is written to the memory mapped file immediately, the bucket when finishing.
+ * @param value value_size bytes that are copied into the bucket, or NULL to leave the value empty (all 0) */
+void ht_builder_add(struct ht_builder* builder, char* key, void* value) {
+	struct hash_table* table = &builder->table;
+	if(builder->count == builder->capacity) {
+		builder->capacity *= 2;
+		builder->entries = realloc(builder->entries, builder->capacity * builder->entry_size);
+		if(builder->entries == NULL) handle_error("Error allocating memory");
+	}
+	struct hash_bucket* entry = (struct hash_bucket*)(builder->entries + builder->count * builder->entry_size);
+	memset(entry, 0, builder->entry_size);
+	entry->hash = ht_hash(table, key);
+	ht_set_key(table, entry, key, strlen(key), 0);
+	if(value != NULL) memcpy(ht_value_rel(table, entry), value, builder->entry_size - sizeof(uint64_t) - HTHEADER(table)->key_size);
+	builder->count++;
+}
+
+/** Write all added pairs to the table, and return it. If a key was added several times, the first pair is kept, 
+ * and the keys of the others are freed.
+ * Sizes the bucket array for all pairs, sorts the pairs by their home bucket (radix sort), and writes them in that order */
+struct hash_table ht_builder_finish(struct ht_builder* builder) {
+	struct hash_table* table = &builder->table;
+	size_t n = builder->count, entry_size = builder->entry_size;
+	bool swiss = HTHEADER(table)->flags & HT_SWISS;
+	mem_write_begin(table->mem);
+
+	// replace the bucket array (and control bytes) by one that is big enough
+	size_t count = HTHEADER(table)->bucket_count;
+	while(n > ht_max_filled(table, count)) count *= 2;
+	mem_free(table->mem, HTHEADER(table)->buckets_ptr);
+	uint64_t tmp = mem_alloc(table->mem, count * entry_size);
+	HTHEADER(table)->buckets_ptr = tmp;
+	memset(HTMEMPTR(tmp), 0, count * entry_size);
+	if(swiss) {
+		mem_free(table->mem, HTHEADER(table)->ctrl_ptr);
+		tmp = mem_alloc(table->mem, count);
+		HTHEADER(table)->ctrl_ptr = tmp;
+		memset(HTMEMPTR(tmp), HT_CTRL_EMPTY, count);
+	}
+	HTHEADER(table)->bucket_count = count;
+
+	// sort by home bucket (or home group), least significant digit first
+	size_t home_mask = swiss ? count / HT_GROUP_SIZE - 1 : count - 1;
+	int bits = __builtin_popcountll(home_mask);
+	char* src = builder->entries;
+	char* dst = malloc(max(n, 1) * entry_size);
+	if(dst == NULL) handle_error("Error allocating memory");
+	size_t offsets[1 << HT_RADIX_BITS];
+	for(int shift = 0; shift < bits; shift += HT_RADIX_BITS) {
+		size_t digit_mask = (1 << HT_RADIX_BITS) - 1;
+		memset(offsets, 0, sizeof(offsets));
+		for(size_t i=0; i<n; i++) {
+			offsets[((((struct hash_bucket*)(src + i * entry_size))->hash & home_mask) >> shift) & digit_mask]++;
+		}
+		size_t sum = 0;
+		for(size_t d=0; d <= digit_mask; d++) {
+			size_t c = offsets[d];
+			offsets[d] = sum;
+			sum += c;
+		}
+		for(size_t i=0; i<n; i++) {
+			struct hash_bucket* entry = (struct hash_bucket*)(src + i * entry_size);
+			size_t d = ((entry->hash & home_mask) >> shift) & digit_mask;
+			memcpy(dst + (offsets[d]++) * entry_size, entry, entry_size);
+		}
+		char* swap = src; src = dst; dst = swap;
+	}
+
+	// place pairs; duplicates have the same home, so they are close to each other
+	char swap[entry_size];
+	size_t next = 0, run_start = 0, filled = 0, max_dist = 0, overflow = 0;
+	for(size_t i=0; i<n; i++) {
+		struct hash_bucket* entry = (struct hash_bucket*)(src + i * entry_size);
+		size_t home = entry->hash & home_mask;
+		bool duplicate = false;
+		if(i == 0 || home != (((struct hash_bucket*)(src + (i-1) * entry_size))->hash & home_mask)) run_start = i;
+		for(size_t j=run_start; j<i && !duplicate; j++) {
+			struct hash_bucket* other = (struct hash_bucket*)(src + j * entry_size);
+			duplicate = other->hash == entry->hash && strcmp(ht_bucket_key(table, other), ht_bucket_key(table, entry)) == 0;
+		}
+		if(duplicate) {
+			// its key was already written by ht_builder_add(...)
+			ht_free_key(table, entry);
+			continue;
+		}
+		filled++;
+		if(swiss) {
+			ht_swiss_place(table, entry);
+			continue;
+		}
+		// robin hood tables keep buckets sorted by their home, so they can be written one after another
+		size_t pos = max(home, next);
+		if(pos < count) {
+			memcpy(ht_bucket(table, pos), entry, entry_size);
+			max_dist = max(max_dist, pos - home);
+			next = pos + 1;
+		}
+		else {
+			// would wrap around at the end of the table, insert these after all others
+			memcpy(dst + (overflow++) * entry_size, entry, entry_size);
+		}
+	}
+	HTHEADER(table)->max_dist = max_dist;
+	for(size_t i=0; i<overflow; i++) {
+		ht_place(table, (struct hash_bucket*)(dst + i * entry_size), (struct hash_bucket*)swap);
+	}
+	HTHEADER(table)->filled = filled;
+
+	free(src);
+	free(dst);
+	builder->entries = NULL;
+	ht_mark_header(table);
+	ht_advise(table, MADV_RANDOM);
+	mem_write_end(table->mem);
+	return *table;
+}
+
+//********************************************************************************
+// segmented tables
+//********************************************************************************
+
+// A segmented table (extendible hashing) is a directory of 2^global_depth entries, which point to segments:
+// robin hood tables with a fixed, page aligned bucket array of about SEGMENTED_SEGMENT_SIZE bytes.
+// Entry i is the segment of the keys whose hash has the bits i (above bit 32, see segmented_dir_idx(...)).
+// A segment with local depth d is used for the 2^(global_depth-d) entries with the same lowest d bits. 
+// When a segment is full, only its entries are split into two segments by bit d; the directory doubles when d reaches global_depth.
+// So growing never copies more than one segment, and a lookup reads a directory entry and a few buckets of one segment.
+
+#define SEGMENTED_SEGMENT_SIZE (64 << 10)
+#define SEGMENTED_MAX_DEPTH 32          // directory bits; a segment at this depth grows like a hash table instead
+#define SEGMENTED_DEPTH_SHIFT 56        // a directory entry is the position of a segment header, or-ed with its local depth << 56
+
+/** Header of a segmented table, in the memory mapped file */
+struct segmented_header {
+	size_t global_depth;
+	MEMPTR dir_ptr;                     // 2^global_depth directory entries
+	size_t segment_count;
+	size_t segment_buckets;             // bucket count of new segments, a power of two
+	size_t filled;                      // number of keys in all segments
+	size_t value_size;
+	uint64_t flags;                     // HT_INLINE_KEYS, HT_INTERN, HT_WYHASH, or HT_BLOB_VALUES of the segments
+};
+
+/** Handle of a segmented table, see segmented_init(...) */
+struct segmented_table {
+	void* mem;
+	uint64_t header_ptr;
+};
+
+static inline struct segmented_header* segmented_header(struct segmented_table* map) {
+	return (struct segmented_header*)((char*)((struct mem*)map->mem)->header + map->header_ptr);
+}
+
+static inline uint64_t* segmented_dir(struct segmented_table* map) {
+	return (uint64_t*)((char*)((struct mem*)map->mem)->header + segmented_header(map)->dir_ptr);
+}
+
+/** Directory entry of a hash. The segments use the lowest bits for the home bucket */
+static inline size_t segmented_dir_idx(uint64_t h, size_t depth) {
+	return (h >> 32) & ((1ULL << depth) - 1);
+}
+
+/** Create a segment, with an empty bucket array of segment_buckets buckets at a page boundary */
+struct hash_table segmented_new_segment(struct segmented_table* map) {
+	struct mem* mem = map->mem;
+	struct segmented_header* header = segmented_header(map);
+	size_t bucket_count = header->segment_buckets;
+	struct hash_table segment = ht_init_flags(mem, header->value_size, header->flags);
+	struct hash_table* table = &segment;
+	size_t size = bucket_count * HTHEADER(table)->bucket_size;
+	MEMPTR buckets = mem_alloc_aligned(mem, size, sysconf(_SC_PAGESIZE));
+	mem_free(mem, HTHEADER(table)->buckets_ptr);
+	HTHEADER(table)->buckets_ptr = buckets;
+	HTHEADER(table)->bucket_count = bucket_count;
+	ht_mark_header(table);
+	memset(HTMEMPTR(buckets), 0, size);
+	segmented_header(map)->segment_count++;
+	mem_mark_dirty(mem, map->header_ptr, sizeof(struct segmented_header));
+	return segment;
+}
+
+/** Init a segmented table (see above). Its segments are robin hood tables with these flags:
+ * HT_INLINE_KEYS, HT_INTERN, HT_WYHASH, HT_BLOB_VALUES, or 0.
+ * @param value_size amount of space reserved in each bucket for user-defined content */
+struct segmented_table segmented_init(struct mem* mem, size_t value_size, uint64_t flags) {
+	struct segmented_table map = {mem, mem_alloc(mem, sizeof(struct segmented_header))};
+	mem_write_begin(mem);
+	struct segmented_header* header = segmented_header(&map);
+	header->global_depth = 0;
+	header->segment_count = 0;
+	header->filled = 0;
+	header->value_size = flags & HT_BLOB_VALUES ? sizeof(MEMPTR) : value_size;
+	header->flags = flags & (HT_INLINE_KEYS | HT_INTERN | HT_WYHASH | HT_BLOB_VALUES);
+	size_t key_size = flags & HT_INLINE_KEYS && !(flags & HT_INTERN) ? HT_INLINE_KEY_SIZE : sizeof(uint64_t);
+	size_t bucket_size = sizeof(uint64_t) + key_size + header->value_size;
+	header->segment_buckets = 64;
+	while(2 * header->segment_buckets * bucket_size <= SEGMENTED_SEGMENT_SIZE) header->segment_buckets *= 2;
+	MEMPTR dir = mem_alloc(mem, sizeof(uint64_t));
+	segmented_header(&map)->dir_ptr = dir;
+	MEMPTR segment = segmented_new_segment(&map).header_ptr;
+	segmented_dir(&map)[0] = segment;
+	mem_mark_dirty(mem, segmented_header(&map)->dir_ptr, sizeof(uint64_t));
+	mem_mark_dirty(mem, map.header_ptr, sizeof(struct segmented_header));
+	mem_write_end(mem);
+	return map;
+}
+
+/** Get handle of a segmented table that already exists in the memory mapped file, see ht_open(...) */
+struct segmented_table segmented_open(struct mem* mem, uint64_t header_ptr) {
+	struct segmented_table map = {mem, header_ptr};
+	return map;
+}
+
+/** The segment of a key with hash h */
+static inline struct hash_table segmented_segment(struct segmented_table* map, uint64_t h) {
+	uint64_t entry = segmented_dir(map)[segmented_dir_idx(h, segmented_header(map)->global_depth)];
+	struct hash_table segment = {map->mem, entry & ((1ULL << SEGMENTED_DEPTH_SHIFT) - 1)};
+	return segment;
+}
+
+/** Split the segment of hash h into two (doubling the directory if necessary). 
+ * Returns false if its local depth is SEGMENTED_MAX_DEPTH already */
+bool segmented_split(struct segmented_table* map, uint64_t h) {
+	struct mem* mem = map->mem;
+	size_t global_depth = segmented_header(map)->global_depth;
+	size_t idx = segmented_dir_idx(h, global_depth);
+	uint64_t entry = segmented_dir(map)[idx];
+	size_t depth = entry >> SEGMENTED_DEPTH_SHIFT;
+	if(depth >= SEGMENTED_MAX_DEPTH) return false;
+	if(depth == global_depth) {
+		// the upper half of the directory is a copy of the lower half
+		size_t count = 1ULL << global_depth;
+		MEMPTR dir = mem_alloc(mem, 2 * count * sizeof(uint64_t));
+		memcpy(MEMPTR(dir), segmented_dir(map), count * sizeof(uint64_t));
+		memcpy((uint64_t*)MEMPTR(dir) + count, segmented_dir(map), count * sizeof(uint64_t));
+		mem_free(mem, segmented_header(map)->dir_ptr);
+		segmented_header(map)->dir_ptr = dir;
+		segmented_header(map)->global_depth = ++global_depth;
+		mem_mark_dirty(mem, map->header_ptr, sizeof(struct segmented_header));
+		mem_mark_dirty(mem, dir, 2 * count * sizeof(uint64_t));
+	}
+
+	// take the entries out of the segment, and place them into it or the new segment
+	struct hash_table old = {mem, entry & ((1ULL << SEGMENTED_DEPTH_SHIFT) - 1)};
+	struct hash_table split = segmented_new_segment(map);
+	struct hash_table* table = &old;
+	size_t bucket_count = HTHEADER(table)->bucket_count, bucket_size = HTHEADER(table)->bucket_size;
+	char* entries = malloc(bucket_count * bucket_size);
+	if(entries == NULL) handle_error("Error allocating memory");
+	memcpy(entries, HTMEMPTR(HTHEADER(table)->buckets_ptr), bucket_count * bucket_size);
+	memset(HTMEMPTR(HTHEADER(table)->buckets_ptr), 0, bucket_count * bucket_size);
+	HTHEADER(table)->filled = 0;
+	HTHEADER(table)->max_dist = 0;
+	ht_mark_buckets(table, 0, bucket_count);
+	for(size_t i=0; i<bucket_count; i++) {
+		struct hash_bucket* bucket = (struct hash_bucket*)(entries + i * bucket_size);
+		if(bucket->hash == 0) continue;
+		ht_insert_entry(((bucket->hash >> 32) >> depth) & 1 ? &split : &old, bucket);
+	}
+	free(entries);
+
+	// every directory entry of the old segment with bit 'depth' set gets the new one
+	uint64_t* dir = segmented_dir(map);
+	size_t low = idx & ((1ULL << depth) - 1);
+	for(size_t i=low; i < (1ULL << global_depth); i += 1ULL << depth) {
+		uint64_t ptr = (i >> depth) & 1 ? split.header_ptr : old.header_ptr;
+		dir[i] = ptr | ((uint64_t)(depth + 1) << SEGMENTED_DEPTH_SHIFT);
+	}
+	mem_mark_dirty(mem, segmented_header(map)->dir_ptr, (1ULL << global_depth) * sizeof(uint64_t));
+	return true;
+}
+
+/** Search a binary key of len bytes. Returns its bucket index in 'segment' (see ht_value(...), ht_key(...)), or -1 if not existing */
+int64_t segmented_lookup_bytes(struct segmented_table* map, const void* key, size_t len, struct hash_table* segment) {
+	uint64_t h = hash_flags(segmented_header(map)->flags, key, len);
+	*segment = segmented_segment(map, h);
+	return ht_lookup_bytes_hashed(segment, key, len, h);
+}
+
+/** Search a string key, see segmented_lookup_bytes(...) */
+int64_t segmented_lookup(struct segmented_table* map, char* key, struct hash_table* segment) {
+	return segmented_lookup_bytes(map, key, strlen(key), segment);
+}
+
+/** Insert a binary key of len bytes, unless it exists. Returns its bucket index in 'segment'.
+ * A full segment is split first, the other segments are not changed */
+int64_t segmented_insert_bytes(struct segmented_table* map, const void* data, size_t len, struct hash_table* segment) {
+	struct mem* mem = map->mem;
+	char* key = (char*)data;
+	uint64_t h = hash_flags(segmented_header(map)->flags, key, len);
+	// splitting might move the mapping, and the key might reside in it
+	bool inside = (void*)key >= (void*)mem->header && (void*)key < MEMPTR(mem->header->size);
+	MEMPTR key_pos = inside ? (void*)key - (void*)mem->header : 0;
+	mem_write_begin(mem);
+	while(true) {
+		*segment = segmented_segment(map, h);
+		struct hash_table* table = segment;
+		if(HTHEADER(table)->filled < ht_max_filled(table, HTHEADER(table)->bucket_count)) break;
+		int64_t pos = ht_lookup_bytes_hashed(segment, key, len, h);
+		if(pos >= 0) {
+			mem_write_end(mem);
+			return pos;
+		}
+		// a segment that can not be split grows, see ht_grow(...)
+		if(!segmented_split(map, h)) break;
+		if(inside) key = MEMPTR(key_pos);
+	}
+	struct hash_table* table = segment;
+	size_t filled = HTHEADER(table)->filled;
+	int64_t pos = ht_insert_bytes_hashed(segment, key, len, h);
+	if(HTHEADER(table)->filled != filled) {
+		segmented_header(map)->filled++;
+		mem_mark_dirty(mem, map->header_ptr, sizeof(struct segmented_header));
+	}
+	mem_write_end(mem);
+	return pos;
+}
+
+/** Insert a string key, see segmented_insert_bytes(...) */
+int64_t segmented_insert_str(struct segmented_table* map, char* key, struct hash_table* segment) {
+	return segmented_insert_bytes(map, key, strlen(key), segment);
+}
+
+/** Remove a binary key of len bytes. Returns false if it did not exist. Segments are not merged again */
+bool segmented_remove_bytes(struct segmented_table* map, const void* key, size_t len) {
+	struct hash_table segment;
+	int64_t pos = segmented_lookup_bytes(map, key, len, &segment);
+	if(pos < 0) return false;
+	mem_write_begin(map->mem);
+	ht_remove_idx(&segment, pos);
+	segmented_header(map)->filled--;
+	mem_mark_dirty(map->mem, map->header_ptr, sizeof(struct segmented_header));
+	mem_write_end(map->mem);
+	return true;
+}
+
+/** Remove a string key, see segmented_remove_bytes(...) */
+bool segmented_remove(struct segmented_table* map, char* key) {
+	return segmented_remove_bytes(map, key, strlen(key));
+}
+
+/** Cursor over all buckets of a segmented table, see SEGMENTED_ITER(...) */
+struct segmented_iter {
+	struct segmented_table* map;
+	size_t dir_idx;                     // directory entry of the current segment
+	struct hash_table segment;          // current segment, and the bucket index in it
+	int64_t idx;
+};
+
+struct segmented_iter segmented_iter(struct segmented_table* map) {
+	struct segmented_iter it = {map, 0, {map->mem, 0}, -1};
+	return it;
+}
+
+/** Advance to the next filled bucket (it->segment, it->idx). Returns false at the end. The table must not change while iterating */
+bool segmented_iter_next(struct segmented_iter* it) {
+	struct segmented_header* header = segmented_header(it->map);
+	while(it->dir_idx < (1ULL << header->global_depth)) {
+		uint64_t entry = segmented_dir(it->map)[it->dir_idx];
+		// a segment of depth d is visited at its first directory entry, which is below 2^d
+		if(it->dir_idx < (1ULL << (entry >> SEGMENTED_DEPTH_SHIFT))) {
+			it->segment.header_ptr = entry & ((1ULL << SEGMENTED_DEPTH_SHIFT) - 1);
+			int64_t next = ht_next(&it->segment, it->idx);
+			if(next >= 0) {
+				it->idx = next;
+				return true;
+			}
+		}
+		it->dir_idx++;
+		it->idx = -1;
+	}
+	return false;
+}
+
+/** Iterate over all buckets (IT.segment, IT.idx) of a segmented table */
+#define SEGMENTED_ITER(MAP, IT)  for(struct segmented_iter IT = segmented_iter(MAP); segmented_iter_next(&IT); )
+
+//********************************************************************************
+// compaction
+//********************************************************************************
+
+/** Flags for ht_copy(...) */
+#define HT_COPY_NESTED 1                // the values are headers of nested tables (multi-map without HT_MULTIMAP), copy these too
+
+struct hash_table ht_copy(struct hash_table* src, struct mem* dst, uint64_t copy_flags);
+
+/** Copy the value 'set' of a HT_MULTIMAP bucket of src to the bucket 'pos' of dst: strings, arrays, or a nested table */
+void multimap_copy_value(struct hash_table* src, uint64_t set, struct hash_table* dst, int64_t pos) {
+	struct mem* mem = src->mem;
+	struct hash_table* table = dst;
+	uint64_t copy;
+	if(set & MULTIMAP_SINGLE) {
+		copy = multimap_store_str(dst, MEMPTR(set & ~MULTIMAP_TAGS)) | MULTIMAP_SINGLE;
+	}
+	else if(set & MULTIMAP_ARRAY) {
+		struct multimap_array* array = MEMPTR(set & ~MULTIMAP_TAGS);
+		size_t size = sizeof(struct multimap_array) + array->capacity * sizeof(MEMPTR);
+		MEMPTR array_ptr = mem_alloc(dst->mem, size);
+		struct multimap_array* copied = (struct multimap_array*)HTMEMPTR(array_ptr);
+		copied->count = array->count;
+		copied->capacity = array->capacity;
+		// the strings follow the array
+		for(size_t i=0; i<array->count; i++) {
+			MEMPTR str = multimap_store_str(dst, MEMPTR(array->vals[i]));
+			((struct multimap_array*)HTMEMPTR(array_ptr))->vals[i] = str;
+		}
+		mem_mark_dirty(dst->mem, array_ptr, size);
+		copy = array_ptr | MULTIMAP_ARRAY;
+	}
+	else {
+		struct hash_table nested = ht_open(mem, set);
+		copy = ht_copy(&nested, dst->mem, 0).header_ptr;
+	}
+	*(uint64_t*)ht_value(dst, pos) = copy;
+}
+
+/** Copy a hash table into the file dst (which must not be the file of src), and return the copy. The bucket array of the copy is just big enough, 
+ * and has no tombstones. Then the keys (and blobs, and the sets of values of multi-maps) are written in bucket order, 
+ * so that a key usually lies next to the keys of the neighbouring buckets, and the strings of a table lie together.
+ * @param copy_flags HT_COPY_NESTED, or 0 */
+struct hash_table ht_copy(struct hash_table* src, struct mem* dst, uint64_t copy_flags) {
+	// src does not move, as only dst is written
+	struct hash_table* table = src;
+	struct hash_table_header* header = HTHEADER(table);
+	uint8_t* ctrl = header->ctrl_ptr != 0 ? (uint8_t*)HTMEMPTR(header->ctrl_ptr) : NULL;
+	uint64_t flags = header->flags;
+	size_t bucket_size = header->bucket_size, value_size = bucket_size - sizeof(uint64_t) - header->key_size;
+	mem_write_begin(dst);
+	struct hash_table copy = ht_init_capacity(dst, value_size, flags, header->max_load == 0 ? header->filled : 0);
+	table = &copy;
+	if(header->max_load != 0) {
+		HTHEADER(table)->max_load = header->max_load;
+		ht_reserve(table, header->filled);
+	}
+
+	// place the buckets with the keys and values of src, the hashes are reused
+	char entry[bucket_size];
+	for(size_t i=0; i<header->bucket_count; i++) {
+		struct hash_bucket* bucket = ht_bucket(src, i);
+		if(bucket->hash == 0 || (ctrl != NULL && (ctrl[i] & HT_CTRL_EMPTY))) continue;
+		memcpy(entry, bucket, bucket_size);
+		ht_insert_entry(&copy, (struct hash_bucket*)entry);
+	}
+
+	// then replace the positions in src by new copies, in bucket order
+	bool nested = (copy_flags & HT_COPY_NESTED) && !(flags & HT_MULTIMAP);
+	for(size_t i=0; i<HTHEADER(&copy)->bucket_count; i++) {
+		struct hash_bucket* bucket = ht_bucket(&copy, i);
+		if(bucket->hash == 0) continue;
+		if(!(flags & HT_INLINE_KEYS) || (unsigned char)((char*)&bucket->keyptr)[HT_INLINE_KEY_SIZE-1] == HT_KEY_SPILLED) {
+			char* key = ((char*)((struct mem*)src->mem)->header) + bucket->keyptr;
+			size_t len = mem_str_len(src->mem, bucket->keyptr);
+			MEMPTR keyptr = flags & HT_INTERN ? ht_intern_bytes(dst, key, len) : mem_insert_bytes(dst, key, len);
+			ht_bucket(&copy, i)->keyptr = keyptr;
+			ht_mark_buckets(&copy, i, 1);
+		}
+		uint64_t value = *(uint64_t*)ht_value_rel(&copy, ht_bucket(&copy, i));
+		if(value == 0) continue;
+		if(flags & HT_BLOB_VALUES) {
+			struct mem* mem = src->mem;
+			MEMPTR blob = mem_insert_bytes(dst, MEMPTR(value), mem_str_len(mem, value));
+			*(uint64_t*)ht_value(&copy, i) = blob;
+		}
+		else if(flags & HT_MULTIMAP) {
+			multimap_copy_value(src, value, &copy, i);
+		}
+		else if(nested) {
+			struct hash_table set = ht_open(src->mem, value);
+			MEMPTR set_ptr = ht_copy(&set, dst, 0).header_ptr;
+			*(uint64_t*)ht_value(&copy, i) = set_ptr;
+		}
+	}
+	mem_write_end(dst);
+	return copy;
+}
+
+/** Check that the header of a table at pos is plausible, before ht_copy(...) reads it */
+bool ht_check_header(struct mem* mem, MEMPTR pos) {
+	if(pos == 0 || pos + sizeof(struct hash_table_header) > mem->mapped_size) return false;
+	struct hash_table_header* header = MEMPTR(pos);
+	size_t count = header->bucket_count, bytes;
+	if(count == 0 || (count & (count - 1)) != 0 || header->key_size + sizeof(uint64_t) > header->bucket_size) return false;
+	if(__builtin_mul_overflow(count, header->bucket_size, &bytes)) return false;
+	if(header->buckets_ptr > mem->mapped_size || bytes > mem->mapped_size - header->buckets_ptr) return false;
+	return header->ctrl_ptr == 0 || header->ctrl_ptr + count <= mem->mapped_size;
+}
+
+/** Cut the free space at the end of the file: after the last block, and in the current chunk of the string arena, 
+ * if it is the last block. The mapping might move */
+void mem_trim(struct mem *mem) {
+	if(mem->header->str_end == mem->header->top && mem->header->str_end != 0) {
+		BLOCK_POS pos = MEM_FIRST_BLOCK, last = 0;
+		while(pos < mem->header->top) {
+			last = pos;
+			pos += BLOCK(pos)->size & ~MEM_FLAGS;
+		}
+		size_t size = (mem->header->str_pos - last + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN;
+		size = max(size, MEM_MIN_BLOCK);
+		BLOCK(last)->size = size | (BLOCK(last)->size & MEM_FLAGS);
+		mem->header->top = last + size;
+		mem->header->str_end = mem->header->top;
+		mem_mark_dirty(mem, last, sizeof(struct mem_block));
+	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t size = (mem->header->top + page - 1) / page * page;
+	if(size >= mem->header->size) return;
+	mem->header->size = size;
+	mem_mark_dirty(mem, 0, sizeof(struct mem_header));
+	mem_commit(mem);
+	void* ptr = mremap(mem->header, mem->mapped_size, size, 0);
+	if (ptr == MAP_FAILED) handle_error("Error mapping file to memory");
+	mem->mapped_size = size;
+	if (ftruncate(mem->fd, size) == -1) handle_error("Error setting the file size");
+}
+
+/** Rewrite all hash tables of the file src into a new file dst (see ht_copy(...)), under the same root names. 
+ * Garbage (old bucket arrays, freed blocks, removed strings, unused interned strings) is not copied, and the file is trimmed.
+ * Every root must be the header of a hash table; the 'nested_count' roots named in 'nested' are multi-maps without HT_MULTIMAP.
+ * Only what is reachable from the roots is copied, so data of tables without a root (see mem_set_root(...)) is lost.
+ * Nobody may write src at the same time. Returns false if src can not be opened, a root is not a hash table, 
+ * or src has data but no roots */
+bool mem_compact(char* src_file, char* dst_file, char** nested, size_t nested_count) {
+	struct mem* src = mem_open_reader(src_file);
+	if(src == NULL) return false;
+	size_t roots = 0;
+	for(int i=0; i<MEM_ROOT_COUNT; i++) {
+		struct mem_root* root = &src->header->roots[i];
+		if(root->ptr == 0) continue;
+		roots++;
+		if(!ht_check_header(src, root->ptr)) {
+			fprintf(stderr, "Error compacting %s: root %s is not a hash table\n", src_file, root->name);
+			mem_close(src);
+			return false;
+		}
+	}
+	if(roots == 0 && src->header->top > MEM_FIRST_BLOCK) {
+		fprintf(stderr, "Error compacting %s: the file has no roots, so none of its data would be copied (see mem_set_root(...))\n", src_file);
+		mem_close(src);
+		return false;
+	}
+	unlink(dst_file);
+	struct mem* dst = mem_create(dst_file, 4096);
+	mem_set_durability(dst, MEM_DURABILITY_NONE, 0);
+	for(int i=0; i<MEM_ROOT_COUNT; i++) {
+		struct mem_root* root = &src->header->roots[i];
+		if(root->ptr == 0) continue;
+		uint64_t copy_flags = 0;
+		for(size_t j=0; j<nested_count; j++) {
+			if(strcmp(nested[j], root->name) == 0) copy_flags |= HT_COPY_NESTED;
+		}
+		struct hash_table table = ht_open(src, root->ptr);
+		mem_set_root(dst, root->name, ht_copy(&table, dst, copy_flags).header_ptr);
+	}
+	mem_trim(dst);
+	mem_sync(dst);
+	mem_close(dst);
+	mem_close(src);
+	return true;
+}
+
+//********************************************************************************
+// sharded maps
+//********************************************************************************
+
+/** One part of a sharded map: a hash table in a file of its own, with a lock for the threads that write to it */
+struct map_shard {
+	struct mem* mem;
+	struct hash_table table;
+	pthread_mutex_t lock;
+};
+
+/** Distributes keys to several independent hash tables (with their own files), so that several threads can insert at once */
+struct sharded_map {
+	size_t shard_count;        // always a power of two
+	struct map_shard* shards;
+	uint64_t flags;            // flags of the first table, for hashing keys without reading a shard that another thread might remap
+};
+
+/** Open the shards of a sharded map, in the files <base>.0, <base>.1, ... Creates files and tables that do not exist yet.
+ * shard_count is rounded up to a power of two; it needs to be the same every time the files are opened.
+ * @param value_size see ht_init(...), sizeof(MEMPTR) for a multi-map
+ * @param flags see ht_init_flags(...), used for new tables
+ * Returns NULL if one of the files was not written by diskmap */
+struct sharded_map* sharded_open(char* base, size_t shard_count, size_t value_size, uint64_t flags) {
+	struct sharded_map* map = malloc(sizeof(struct sharded_map));
+	if(map == NULL) handle_error("Error allocating sharded map");
+	map->shard_count = 1;
+	while(map->shard_count < shard_count) map->shard_count *= 2;
+	map->shards = calloc(map->shard_count, sizeof(struct map_shard));
+	if(map->shards == NULL) handle_error("Error allocating sharded map");
+
+	char file[strlen(base) + 32];
+	for(size_t i=0; i<map->shard_count; i++) {
+		struct map_shard* shard = &map->shards[i];
+		sprintf(file, "%s.%zu", base, i);
+		shard->mem = mem_open(file, 4096);
+		if(shard->mem == NULL) {
+			for(size_t j=0; j<i; j++) mem_close(map->shards[j].mem);
+			free(map->shards);
+			free(map);
+			return NULL;
+		}
+		MEMPTR root = mem_get_root(shard->mem, "shard");
+		if(root != 0) {
+			shard->table = ht_open(shard->mem, root);
+		} else {
+			shard->table = ht_init_flags(shard->mem, value_size, flags);
+			mem_set_root(shard->mem, "shard", shard->table.header_ptr);
+		}
+		pthread_mutex_init(&shard->lock, NULL);
+	}
+	struct hash_table* table = &map->shards[0].table;
+	map->flags = HTHEADER(table)->flags;
+	return map;
+}
+
+/** Hash of a key, as ht_hash(...) of the tables computes it */
+uint64_t sharded_hash(struct sharded_map* map, char* key) {
+	return map->flags & HT_WYHASH ? hash_wy(key) : hash(key);
+}
+
+/** Get the shard of a key, whose hash (see ht_hash(...), all shards use the same hash function) is h */
+struct map_shard* sharded_shard_hashed(struct sharded_map* map, uint64_t h) {
+	// the tables use the lowest bits of the hash for the home bucket, and swiss tables the highest for the tag
+	return &map->shards[(h >> 32) & (map->shard_count - 1)];
+}
+
+/** Get the shard of a key. Its lock needs to be held while using its table, if several threads access the map */
+struct map_shard* sharded_shard(struct sharded_map* map, char* key) {
+	return sharded_shard_hashed(map, sharded_hash(map, key));
+}
+
+/** Insert a key into a sharded hash map and copy its value (as many bytes as requested by sharded_open(...)), if value is not NULL.
+ * May be called by several threads at once */
+void sharded_insert_str(struct sharded_map* map, char* key, void* value) {
+	// the hash is computed only once, for choosing the shard and for inserting
+	uint64_t h = sharded_hash(map, key);
+	struct map_shard* shard = sharded_shard_hashed(map, h);
+	pthread_mutex_lock(&shard->lock);
+	struct hash_table* table = &shard->table;
+	int64_t pos = ht_insert_hashed(table, key, h);
+	if(value != NULL) {
+		size_t header_size = sizeof(uint64_t) + HTHEADER(table)->key_size;
+		memcpy(ht_value(table, pos), value, HTHEADER(table)->bucket_size - header_size);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/** Search a key in a sharded hash map. If the key exists, copies its value to 'value' (unless it is NULL) and returns true.
+ * May be called by several threads at once */
+bool sharded_lookup(struct sharded_map* map, char* key, void* value) {
+	uint64_t h = sharded_hash(map, key);
+	struct map_shard* shard = sharded_shard_hashed(map, h);
+	pthread_mutex_lock(&shard->lock);
+	struct hash_table* table = &shard->table;
+	int64_t pos = ht_lookup_hashed(table, key, h);
+	if(pos >= 0 && value != NULL) {
+		size_t header_size = sizeof(uint64_t) + HTHEADER(table)->key_size;
+		memcpy(value, ht_value(table, pos), HTHEADER(table)->bucket_size - header_size);
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return pos >= 0;
+}
+
+/** Like multimap_insert_key_val(...), for a sharded map. May be called by several threads at once */
+void sharded_multimap_insert_key_val(struct sharded_map* map, char* key, char* val) {
+	struct map_shard* shard = sharded_shard(map, key);
+	pthread_mutex_lock(&shard->lock);
+	multimap_insert_key_val(&shard->table, key, val);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/** Work of one thread of sharded_multimap_insert_parallel(...) */
+struct sharded_job {
+	struct sharded_map* map;
+	char** keys;
+	char** vals;
+	size_t n;
+	uint32_t* shard_of;      // shard index of each key
+	size_t worker, workers;
+	bool insert;             // first pass: compute shard_of for a slice of the keys, second pass: insert into own shards
+};
+
+static void* sharded_worker(void* arg) {
+	struct sharded_job* job = arg;
+	struct sharded_map* map = job->map;
+	if(!job->insert) {
+		size_t from = job->n * job->worker / job->workers, to = job->n * (job->worker + 1) / job->workers;
+		for(size_t i=from; i<to; i++) job->shard_of[i] = sharded_shard(map, job->keys[i]) - map->shards;
+		return NULL;
+	}
+	// every shard belongs to exactly one worker, so the locks are never contended
+	for(size_t s=job->worker; s<map->shard_count; s+=job->workers) pthread_mutex_lock(&map->shards[s].lock);
+	// one pass over all pairs, which keeps their order within each shard
+	for(size_t i=0; i<job->n; i++) {
+		uint32_t s = job->shard_of[i];
+		if(s % job->workers == job->worker) multimap_insert_key_val(&map->shards[s].table, job->keys[i], job->vals[i]);
+	}
+	for(size_t s=job->worker; s<map->shard_count; s+=job->workers) pthread_mutex_unlock(&map->shards[s].lock);
+	return NULL;
+}
+
+/** Insert n key value pairs into a sharded multi-map, using several threads. Each thread owns some of the shards,
+ * and inserts only the pairs whose keys belong to them, in their original order */
+void sharded_multimap_insert_parallel(struct sharded_map* map, char** keys, char** vals, size_t n, size_t threads) {
+	threads = max(1, min(threads, map->shard_count));
+	uint32_t* shard_of = malloc(n * sizeof(uint32_t) + 1);
+	if(shard_of == NULL) handle_error("Error allocating shard indices");
+	pthread_t ids[threads];
+	struct sharded_job jobs[threads];
+	for(int insert=0; insert<2; insert++) {
+		for(size_t t=0; t<threads; t++) {
+			jobs[t] = (struct sharded_job){map, keys, vals, n, shard_of, t, threads, insert};
+			if(pthread_create(&ids[t], NULL, sharded_worker, &jobs[t]) != 0) handle_error("Error creating thread");
+		}
+		for(size_t t=0; t<threads; t++) pthread_join(ids[t], NULL);
+	}
+	free(shard_of);
+}
+
+/** Position of an iteration over all shards, see SHARDEDFOREACH(...) */
+struct sharded_iter {
+	struct sharded_map* map;
+	size_t shard;
+	int64_t idx;                 // bucket index in the table of the current shard
+	struct hash_table* table;    // table of the current shard
+	struct ht_iter cursor;       // position in the table of the current shard
+};
+
+/** Start iterating over all keys of all shards */
+struct sharded_iter sharded_iter(struct sharded_map* map) {
+	struct sharded_iter it = {map, 0, -1, &map->shards[0].table};
+	it.cursor = ht_iter(it.table);
+	return it;
+}
+
+/** Advance to the next non-empty bucket (it->table, it->idx) of the sharded map. Returns false at the end */
+bool sharded_next(struct sharded_iter* it) {
+	while(!ht_iter_next(&it->cursor)) {
+		if(++it->shard >= it->map->shard_count) return false;
+		it->table = &it->map->shards[it->shard].table;
+		it->cursor = ht_iter(it->table);
+	}
+	it->idx = it->cursor.idx;
+	return true;
+}
+
+/** Iterate over all keys of a sharded map. Use ht_key(IT.table, IT.idx) and ht_value(IT.table, IT.idx). 
+ * Must not run concurrently to writing threads */
+#define SHARDEDFOREACH(MAP, IT)  for(struct sharded_iter IT = sharded_iter(MAP); sharded_next(&IT); )
+
+/** Write all shards to disk and close them */
+void sharded_close(struct sharded_map* map) {
+	for(size_t i=0; i<map->shard_count; i++) {
+		mem_close(map->shards[i].mem);
+		pthread_mutex_destroy(&map->shards[i].lock);
+	}
+	free(map->shards);
+	free(map);
+}
+
+//********************************************************************************
+// shared readers
+//********************************************************************************
+
+/** Check that the len bytes at pos lie inside of the part of the file that is mapped */
+static inline bool mem_mapped(struct mem* mem, MEMPTR pos, size_t len) {
+	return pos <= mem->mapped_size && len <= mem->mapped_size - pos;
+}
+
+/** Compare key (of length len) to the key of a bucket, without reading outside of the mapping */
+static bool ht_shared_key_equals(struct hash_table* table, struct hash_table_header* header, 
+		struct hash_bucket* bucket, const void* key, size_t len) {
+	struct mem* mem = table->mem;
+	if(header->flags & HT_INLINE_KEYS) {
+		char* inline_key = (char*)&bucket->keyptr;
+		unsigned char inline_len = inline_key[HT_INLINE_KEY_SIZE-1];
+		if(inline_len != HT_KEY_SPILLED) return inline_len == len && memcmp(key, inline_key, len) == 0;
+	}
+	MEMPTR keyptr = bucket->keyptr;
+	uint32_t stored_len;
+	if(keyptr < sizeof(uint32_t) || !mem_mapped(mem, keyptr - sizeof(uint32_t), sizeof(uint32_t) + len)) return false;
+	memcpy(&stored_len, MEMPTR(keyptr - sizeof(uint32_t)), sizeof(uint32_t));
+	return stored_len == len && memcmp(key, MEMPTR(keyptr), len) == 0;
+}
+
+/** One attempt of ht_lookup_shared(...). The table might be changed by a writer at the same time,
+ * so every position is checked against the mapping, and every probe sequence is bounded */
+static bool ht_shared_probe(struct hash_table* table, const void* key, size_t len, void* value) {
+	struct mem* mem = table->mem;
+	if(!mem_mapped(mem, table->header_ptr, sizeof(struct hash_table_header))) return false;
+	struct hash_table_header header = *HTHEADER(table);
+	uint64_t h = hash_flags(header.flags, key, len);
+	size_t count = header.bucket_count, bytes;
+	if(count == 0 || (count & (count - 1)) != 0 || header.key_size + sizeof(uint64_t) > header.bucket_size) return false;
+	if(__builtin_mul_overflow(count, header.bucket_size, &bytes) || !mem_mapped(mem, header.buckets_ptr, bytes)) return false;
+	char* buckets = MEMPTR(header.buckets_ptr);
+	struct hash_bucket* found = NULL;
+
+	if(header.flags & HT_SWISS) {
+		if(count < HT_GROUP_SIZE || !mem_mapped(mem, header.ctrl_ptr, count)) return false;
+		uint8_t* ctrl = MEMPTR(header.ctrl_ptr);
+		size_t group_mask = count / HT_GROUP_SIZE - 1;
+		size_t group = h & group_mask;
+		uint8_t tag = ht_swiss_tag(h);
+		for(size_t step = 1; step <= group_mask + 1 && found == NULL; step++) {
+			uint8_t* group_ctrl = ctrl + group * HT_GROUP_SIZE;
+			for(uint32_t match = ht_swiss_match(group_ctrl, tag); match != 0; match &= match - 1) {
+				struct hash_bucket* bucket = (void*)(buckets + (group * HT_GROUP_SIZE + __builtin_ctz(match)) * header.bucket_size);
+				if(bucket->hash == h && ht_shared_key_equals(table, &header, bucket, key, len)) {
+					found = bucket;
+					break;
+				}
+			}
+			if(ht_swiss_match_empty(group_ctrl) != 0) break;
+			group = (group + step) & group_mask;
+		}
+	} else {
+		size_t mask = count - 1;
+		size_t pos = h & mask;
+		for(size_t dist = 0; dist <= header.max_dist && dist < count; dist++) {
+			struct hash_bucket* bucket = (void*)(buckets + pos * header.bucket_size);
+			uint64_t bucket_hash = bucket->hash;
+			if(bucket_hash == 0) break;
+			if(bucket_hash == h && ht_shared_key_equals(table, &header, bucket, key, len)) {
+				found = bucket;
+				break;
+			}
+			pos = (pos + 1) & mask;
+		}
+	}
+	if(found == NULL) return false;
+	if(value != NULL) {
+		memcpy(value, (char*)found + sizeof(uint64_t) + header.key_size, header.bucket_size - sizeof(uint64_t) - header.key_size);
+	}
+	return true;
+}
+
+/** Lookup of a binary key of len bytes for readers in other processes, see ht_lookup_shared(...) */
+bool ht_lookup_shared_bytes(struct hash_table* table, const void* key, size_t len, void* value) {
+	bool found;
+	uint64_t seq;
+	do {
+		seq = mem_read_begin(table->mem);
+		found = ht_shared_probe(table, key, len, value);
+	} while(mem_read_retry(table->mem, seq));
+	return found;
+}
+
+/** Lookup for readers in other processes (see mem_open_reader(...)), while a writer changes the file. 
+ * Does not lock: repeats the lookup until no writer interfered. If the key exists, copies its value 
+ * (as many bytes as requested by ht_init(...)) to 'value' (unless it is NULL) and returns true */
+bool ht_lookup_shared(struct hash_table* table, char* key, void* value) {
+	return ht_lookup_shared_bytes(table, key, strlen(key), value);
+}
+
+//********************************************************************************
+// snapshots
+//********************************************************************************
+
+// A snapshot is a separate, immutable file with the content of one hash table, for deployments that only look up keys.
+// Its keys are placed with a minimal perfect hash (hash and displace, as in CHD): the hash of a key selects one of 
+// count / SNAPSHOT_BUCKET_KEYS buckets, and the 32 bit pilot of that bucket selects the slot of the key. 
+// snapshot_write(...) tries pilots until all keys of a bucket land in free slots, so the count keys fill exactly count slots.
+// A slot holds the position of the key and 16 bits of its hash, followed by the value for tables with fixed size values.
+// Keys (and variable size values) are written without padding in slot order after the slots.
+
+#define SNAPSHOT_MAGIC 0x0070616e736b7364ULL
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BUCKET_KEYS 4          // average number of keys per bucket of the perfect hash
+#define SNAPSHOT_POS_BITS 48            // the other bits of a slot are bits of the hash of the key
+
+/** First bytes of a snapshot file */
+struct snapshot_header {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t flags;                     // HT_WYHASH, HT_MULTIMAP (of any multi-map), HT_BLOB_VALUES of the table
+	uint64_t size;                      // size of the file
+	uint64_t count;                     // number of keys and of slots
+	uint64_t bucket_count;              // number of pilots
+	uint64_t slot_size;                 // 8 bytes, followed by the value (rounded up to 8 bytes) if the values have a fixed size
+	uint64_t value_size;                // 0 for HT_BLOB_VALUES and multi-maps, their values follow the keys
+	uint64_t pilots_ptr;                // uint32_t per bucket
+	uint64_t slots_ptr;
+};
+
+/** Handle of an open snapshot, see snapshot_open(...) */
+struct snapshot {
+	struct snapshot_header* header;
+	int fd;
+	uint32_t* pilots;
+	char* slots;
+};
+
+static inline size_t snapshot_bucket(uint64_t h, size_t bucket_count) {
+	return (size_t)(((unsigned __int128)(h >> 16) * bucket_count) >> 48);
+}
+
+static inline size_t snapshot_slot(uint64_t h, uint32_t pilot, size_t count) {
+	// murmur3 finalizer
+	uint64_t x = h ^ ((pilot + 1) * 0x9e3779b97f4a7c15ULL);
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ULL;
+	x ^= x >> 33;
+	return (size_t)(((unsigned __int128)x * count) >> 64);
+}
+
+static inline uint64_t snapshot_entry(struct snapshot* snap, int64_t idx) {
+	return *(uint64_t*)(snap->slots + idx * snap->header->slot_size);
+}
+
+/** Key of a snapshot entry: a bucket index of src, and its hash */
+struct snapshot_key {
+	uint64_t hash;
+	uint64_t idx;
+};
+
+static void snapshot_fwrite(FILE* f, const void* data, size_t len) {
+	if(len > 0 && fwrite(data, 1, len, f) != len) handle_error("Error writing snapshot");
+}
+
+/** Write a length and len bytes (and '\0') of a key or value */
+static void snapshot_fwrite_bytes(FILE* f, const void* data, size_t len) {
+	uint32_t len32 = len;
+	snapshot_fwrite(f, &len32, sizeof(len32));
+	snapshot_fwrite(f, data, len);
+	fputc('\0', f);
+}
+
+/** Write the value of bucket 'idx' of a table with variable size values: its blob, or the number of values of a multi-map and all of them.
+ * With 'nested', the value is the header of a nested table (a multi-map without HT_MULTIMAP) */
+static void snapshot_fwrite_value(FILE* f, struct hash_table* table, int64_t idx, bool nested) {
+	uint64_t flags = HTHEADER(table)->flags;
+	if(flags & HT_BLOB_VALUES) {
+		size_t len;
+		void* blob = ht_get_blob(table, idx, &len);
+		snapshot_fwrite_bytes(f, blob, len);
+		return;
+	}
+	uint32_t count;
+	if(!nested) {
+		count = multimap_count(table, idx);
+		snapshot_fwrite(f, &count, sizeof(count));
+		MULTIMAP_FOREACH(table, idx, it) snapshot_fwrite_bytes(f, it.val, strlen(it.val));
+		return;
+	}
+	struct hash_table values = multimap_get(table->mem, ht_value_rel(table, ht_bucket(table, idx)));
+	if(HTHEADER(&values)->filled > UINT32_MAX) handle_error("Too many values for a snapshot");
+	count = HTHEADER(&values)->filled;
+	snapshot_fwrite(f, &count, sizeof(count));
+	HTITER(&values, it) snapshot_fwrite_bytes(f, ht_key(&values, it.idx), ht_key_len(&values, it.idx));
+}
+
+/** Write the content of a hash table to a new snapshot file, for snapshot_open(...). The table is not changed.
+ * Multi-maps with HT_MULTIMAP are detected, others need copy_flags HT_COPY_NESTED (as for ht_copy(...)).
+ * The snapshot is written to <file>.tmp and renamed to file, so readers that have the old snapshot open keep reading it.
+ * Returns false if two keys have the same 64 bit hash, since the perfect hash can not separate them */
+bool snapshot_write(struct hash_table* table, char* file, uint64_t copy_flags) {
+	struct hash_table_header* header = HTHEADER(table);
+	uint8_t* ctrl = header->ctrl_ptr != 0 ? (uint8_t*)HTMEMPTR(header->ctrl_ptr) : NULL;
+	uint64_t flags = header->flags;
+	bool variable = (flags & (HT_BLOB_VALUES | HT_MULTIMAP)) || (copy_flags & HT_COPY_NESTED);
+	size_t count = header->filled, bucket_count = max(count / SNAPSHOT_BUCKET_KEYS, 1);
+	size_t value_size = header->bucket_size - sizeof(uint64_t) - header->key_size;
+	size_t slot_size = variable ? sizeof(uint64_t) : sizeof(uint64_t) + (value_size + 7) / 8 * 8;
+
+	// sort the keys by bucket (counting sort), the hashes are reused
+	struct snapshot_key* keys = malloc(max(count, 1) * sizeof(struct snapshot_key));
+	size_t* start = calloc(bucket_count + 1, sizeof(size_t));
+	uint32_t* pilots = calloc(bucket_count, sizeof(uint32_t));
+	uint64_t* slots = malloc(max(count, 1) * sizeof(uint64_t));    // bucket index of src + 1, 0 if free
+	if(keys == NULL || start == NULL || pilots == NULL || slots == NULL) handle_error("Error allocating memory");
+	memset(slots, 0, max(count, 1) * sizeof(uint64_t));
+	for(size_t i=0; i<header->bucket_count; i++) {
+		uint64_t h = ht_bucket(table, i)->hash;
+		if(h != 0 && (ctrl == NULL || !(ctrl[i] & HT_CTRL_EMPTY))) start[snapshot_bucket(h, bucket_count) + 1]++;
+	}
+	size_t max_keys = 0;
+	for(size_t b=0; b<bucket_count; b++) {
+		max_keys = max(max_keys, start[b + 1]);
+		start[b + 1] += start[b];
+	}
+	size_t* next = malloc((bucket_count + 1) * sizeof(size_t));
+	if(next == NULL) handle_error("Error allocating memory");
+	memcpy(next, start, (bucket_count + 1) * sizeof(size_t));
+	for(size_t i=0; i<header->bucket_count; i++) {
+		uint64_t h = ht_bucket(table, i)->hash;
+		if(h == 0 || (ctrl != NULL && (ctrl[i] & HT_CTRL_EMPTY))) continue;
+		struct snapshot_key* key = &keys[next[snapshot_bucket(h, bucket_count)]++];
+		key->hash = h;
+		key->idx = i;
+	}
+
+	// buckets with the most keys first, while most slots are free (counting sort again, reusing 'next')
+	size_t* by_size = calloc(max_keys + 2, sizeof(size_t));
+	size_t* order = malloc(bucket_count * sizeof(size_t));
+	if(by_size == NULL || order == NULL) handle_error("Error allocating memory");
+	for(size_t b=0; b<bucket_count; b++) by_size[max_keys - (start[b + 1] - start[b]) + 1]++;
+	for(size_t s=0; s<=max_keys; s++) by_size[s + 1] += by_size[s];
+	for(size_t b=0; b<bucket_count; b++) order[by_size[max_keys - (start[b + 1] - start[b])]++] = b;
+
+	char* error = NULL;
+	size_t placed[max(max_keys, 1)];
+	for(size_t o=0; o<bucket_count && error == NULL; o++) {
+		size_t b = order[o], n = start[b + 1] - start[b];
+		struct snapshot_key* bucket = keys + start[b];
+		if(n == 0) break;
+		for(size_t i=0; i<n && error == NULL; i++) {
+			for(size_t j=0; j<i; j++) if(bucket[i].hash == bucket[j].hash) error = "two keys have the same hash";
+		}
+		for(uint64_t pilot=0; error == NULL; pilot++) {
+			if(pilot > UINT32_MAX) {
+				error = "no pilot places all keys of a bucket";
+				break;
+			}
+			size_t i = 0;
+			for(; i<n; i++) {
+				placed[i] = snapshot_slot(bucket[i].hash, pilot, count);
+				if(slots[placed[i]] != 0) break;
+				slots[placed[i]] = bucket[i].idx + 1;
+			}
+			if(i == n) {
+				pilots[b] = pilot;
+				break;
+			}
+			// undo, and try the next pilot
+			while(i-- > 0) slots[placed[i]] = 0;
+		}
+	}
+	free(order);
+	free(by_size);
+	free(next);
+	free(start);
+	free(keys);
+	if(error != NULL) {
+		fprintf(stderr, "Error writing snapshot %s: %s\n", file, error);
+		free(pilots);
+		free(slots);
+		return false;
+	}
+
+	struct snapshot_header snap = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, 
+			(flags & (HT_WYHASH | HT_MULTIMAP | HT_BLOB_VALUES)) | (copy_flags & HT_COPY_NESTED ? HT_MULTIMAP : 0), 
+			0, count, bucket_count, slot_size, variable ? 0 : value_size};
+	snap.pilots_ptr = sizeof(snap);
+	snap.slots_ptr = (snap.pilots_ptr + bucket_count * sizeof(uint32_t) + 7) / 8 * 8;
+	// readers map the old snapshot, so it must not be truncated
+	char tmp_file[strlen(file) + 5];
+	sprintf(tmp_file, "%s.tmp", file);
+	FILE* f = fopen(tmp_file, "w");
+	if(f == NULL) handle_error("Error opening snapshot for writing");
+	snapshot_fwrite(f, &snap, sizeof(snap));
+	snapshot_fwrite(f, pilots, bucket_count * sizeof(uint32_t));
+	uint64_t padding = 0;
+	snapshot_fwrite(f, &padding, snap.slots_ptr - snap.pilots_ptr - bucket_count * sizeof(uint32_t));
+	free(pilots);
+
+	// the keys follow the slots, in slot order
+	uint64_t* entries = malloc(max(count, 1) * sizeof(uint64_t));
+	if(entries == NULL) handle_error("Error allocating memory");
+	size_t pos = snap.slots_ptr + count * slot_size;
+	if(fseek(f, pos, SEEK_SET) != 0) handle_error("Error writing snapshot");
+	for(size_t s=0; s<count; s++) {
+		int64_t idx = slots[s] - 1;
+		entries[s] = pos | (ht_bucket(table, idx)->hash << SNAPSHOT_POS_BITS);
+		snapshot_fwrite_bytes(f, ht_key(table, idx), ht_key_len(table, idx));
+		if(variable) snapshot_fwrite_value(f, table, idx, (copy_flags & HT_COPY_NESTED) && !(flags & HT_MULTIMAP));
+		pos = ftell(f);
+		if(pos >= 1ULL << SNAPSHOT_POS_BITS) handle_error("Snapshot too big");
+	}
+	snap.size = pos;
+
+	if(fseek(f, snap.slots_ptr, SEEK_SET) != 0) handle_error("Error writing snapshot");
+	char slot[slot_size];
+	memset(slot, 0, slot_size);
+	for(size_t s=0; s<count; s++) {
+		memcpy(slot, &entries[s], sizeof(uint64_t));
+		if(!variable) memcpy(slot + sizeof(uint64_t), ht_value_rel(table, ht_bucket(table, slots[s] - 1)), value_size);
+		snapshot_fwrite(f, slot, slot_size);
+	}
+	free(entries);
+	rewind(f);
+	snapshot_fwrite(f, &snap, sizeof(snap));
+	if(fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0) handle_error("Error writing snapshot");
+	if(rename(tmp_file, file) != 0) handle_error("Error renaming snapshot");
+	free(slots);
+	return true;
+}
+
+/** Open a snapshot file read-only (see snapshot_write(...)). Flags are MEM_POPULATE, ... or 0, see mem_open_flags(...).
+ * Returns NULL if the file does not exist, or is not a snapshot of this version */
+struct snapshot* snapshot_open(char* file, int flags) {
+	int fd;
+	if((fd = open(file, O_RDONLY)) == -1) return NULL;
+	struct stat fileInfo = {0};
+	if (fstat(fd, &fileInfo) == -1) handle_error("Error getting the file size");
+	size_t file_size = fileInfo.st_size < 0 ? 0 : (size_t)fileInfo.st_size;
+	struct snapshot_header header;
+	if (file_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header)
+			|| header.magic != SNAPSHOT_MAGIC || header.version != SNAPSHOT_VERSION || header.size > file_size
+			|| header.pilots_ptr + header.bucket_count * sizeof(uint32_t) > header.size 
+			|| header.slots_ptr + header.count * header.slot_size > header.size) {
+		fprintf(stderr, "Error opening %s: not a diskmap snapshot of version %d\n", file, SNAPSHOT_VERSION);
+		close(fd);
+		return NULL;
+	}
+	struct snapshot* snap = malloc(sizeof(struct snapshot));
+	if(snap == NULL) handle_error("Error allocating memory");
+	snap->fd = fd;
+	snap->header = mem_map(fd, header.size, PROT_READ, flags);
+	snap->pilots = (uint32_t*)((char*)snap->header + header.pilots_ptr);
+	snap->slots = (char*)snap->header + header.slots_ptr;
+	if(header.size >= HT_ADVISE_MIN) madvise(snap->header, header.size, MADV_RANDOM);
+	return snap;
+}
+
+void snapshot_close(struct snapshot* snap) {
+	if(munmap(snap->header, snap->header->size) == -1) handle_error("Error unmapping file");
+	close(snap->fd);
+	free(snap);
+}
+
+/** Number of keys of a snapshot. Their indices are 0 ... count-1 */
+size_t snapshot_count(struct snapshot* snap) {
+	return snap->header->count;
+}
+
+/** Get the key of entry idx, and write its length to len (unless NULL) */
+char* snapshot_key(struct snapshot* snap, int64_t idx, size_t* len) {
+	char* ptr = (char*)snap->header + (snapshot_entry(snap, idx) & ((1ULL << SNAPSHOT_POS_BITS) - 1));
+	uint32_t key_len;
+	memcpy(&key_len, ptr, sizeof(uint32_t));
+	if(len != NULL) *len = key_len;
+	return ptr + sizeof(uint32_t);
+}
+
+/** Search the entry of a binary key of len bytes, return -1 if not existing. 
+ * Reads one pilot, one slot, and the key; keys that do not exist are mostly rejected by the bits of their hash in the slot */
+int64_t snapshot_lookup_bytes(struct snapshot* snap, const void* key, size_t len) {
+	struct snapshot_header* header = snap->header;
+	if(header->count == 0) return -1;
+	uint64_t h = hash_flags(header->flags, key, len);
+	size_t idx = snapshot_slot(h, snap->pilots[snapshot_bucket(h, header->bucket_count)], header->count);
+	if((snapshot_entry(snap, idx) >> SNAPSHOT_POS_BITS) != (h & ((1ULL << (64 - SNAPSHOT_POS_BITS)) - 1))) return -1;
+	size_t key_len;
+	char* stored = snapshot_key(snap, idx, &key_len);
+	return key_len == len && memcmp(stored, key, len) == 0 ? (int64_t)idx : -1;
+}
+
+/** Search the entry of a string key, return -1 if not existing */
+int64_t snapshot_lookup(struct snapshot* snap, char* key) {
+	return snapshot_lookup_bytes(snap, key, strlen(key));
+}
+
+/** Get the value of entry idx, and write its length to len (unless NULL). For multi-maps, len is the number of values; read them with snapshot_iter(...) */
+void* snapshot_value(struct snapshot* snap, int64_t idx, size_t* len) {
+	struct snapshot_header* header = snap->header;
+	if(!(header->flags & (HT_BLOB_VALUES | HT_MULTIMAP))) {
+		if(len != NULL) *len = header->value_size;
+		return snap->slots + idx * header->slot_size + sizeof(uint64_t);
+	}
+	size_t key_len;
+	char* value = snapshot_key(snap, idx, &key_len) + key_len + 1;
+	uint32_t value_len;
+	memcpy(&value_len, value, sizeof(uint32_t));
+	if(len != NULL) *len = value_len;
+	return value + sizeof(uint32_t);
+}
+
+/** Cursor over the values of a key of a multi-map snapshot, see SNAPSHOT_FOREACH(...) */
+struct snapshot_iter {
+	char* next;
+	size_t left;
+	char* val;                          // current value, valid after snapshot_iter_next(...) returned true
+	size_t len;
+};
+
+/** Start iterating over the values of entry idx of a multi-map snapshot */
+struct snapshot_iter snapshot_iter(struct snapshot* snap, int64_t idx) {
+	size_t count;
+	struct snapshot_iter it;
+	it.next = snapshot_value(snap, idx, &count);
+	it.left = count;
+	return it;
+}
+
+/** Advance to the next value (it->val, of it->len bytes). Returns false at the end */
+bool snapshot_iter_next(struct snapshot_iter* it) {
+	if(it->left == 0) return false;
+	uint32_t len;
+	memcpy(&len, it->next, sizeof(uint32_t));
+	it->val = it->next + sizeof(uint32_t);
+	it->len = len;
+	it->next = it->val + len + 1;
+	it->left--;
+	return true;
+}
+
+/** Iterate over all values (IT.val) of entry IDX of a multi-map snapshot */
+#define SNAPSHOT_FOREACH(SNAP, IDX, IT)  for(struct snapshot_iter IT = snapshot_iter((SNAP), (IDX)); snapshot_iter_next(&IT); )
+
 
 //********************************************************************************
 // main
@@ -496,11 +3669,11 @@ int main(int argc, char *argv[])
 	multimap_insert_key_val(table, "key2", "key2val0");
 
 	printf("reading values\n");
-	HTFOREACH(table) {
-		printf("key %s\n", HTFOREACH_KEY(table));
-		struct hash_table tab = multimap_get(mem, ht_value(table, i));
-		HTFOREACH(&tab) {
-			printf("\t val %s\n", HTFOREACH_KEY(&tab));
+	HTITER(table, key_it) {
+		printf("key %s\n", ht_key(table, key_it.idx));
+		struct hash_table values = multimap_get(mem, ht_value(table, key_it.idx));
+		HTITER(&values, val_it) {
+			printf("\t val %s\n", ht_key(&values, val_it.idx));
 		}
 	}
 
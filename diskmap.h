@@ -0,0 +1,136 @@
+/*
+Diskmap - a hash map backed by a memory mapped file on disk
+Copyright (C) 2018  Thomas Rebele
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Types, flags, and functions of diskmap.c that diskmap.hpp uses. diskmap.c includes this file, so the C++ interface
+// always sees the layouts and signatures that diskmap.c was compiled with
+
+#ifndef DISKMAP_H
+#define DISKMAP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Store "pointers" to memory, as indices, starting from the header */
+typedef uint64_t MEMPTR;
+
+/** Flags for ht_init_flags(...) */
+#define HT_INLINE_KEYS 1                // store short keys in the bucket instead of the string heap
+#define HT_SWISS 2                      // find keys by probing groups of control bytes (swiss table), instead of robin hood hashing
+#define HT_SHRINK 4                     // make bucket array smaller when many keys have been removed
+#define HT_INTERN 8                     // share key strings with all HT_INTERN tables of the file, compare keys by position
+#define HT_MULTIMAP 16                  // multi-map that stores small sets of values without a nested table, see multimap_init(...)
+#define HT_WYHASH 32                    // hash keys with hash_wy(...) instead of hash(...) (FNV-1a)
+#define HT_BLOB_VALUES 64               // values of any length, stored outside of the bucket, see ht_set_blob(...)
+#define HT_HUGEPAGES 128                // ask for transparent huge pages for the bucket array, see ht_advise(...)
+
+/** Size of the key area of a bucket for HT_INLINE_KEYS. Keys up to HT_INLINE_KEY_SIZE-2 bytes are stored inline, 
+ * followed by '\0'. The last byte contains the length of an inline key, or HT_KEY_SPILLED */
+#define HT_INLINE_KEY_SIZE 24
+#define HT_KEY_SPILLED 0xff
+
+/** Handle for hash table. Resides in main memory. */
+struct hash_table { // note: this struct only contains runtime configuration
+	void* mem;                          // hande for memory-mapped file
+	uint64_t header_ptr;                // ptr to hashmap (into mapped area)
+};
+
+/** Header for hash table. Resides in memory mapped file. Never moves. */
+struct hash_table_header {
+	size_t bucket_count;      // number of slots in hash table, always a power of two
+	size_t bucket_size;       // size of one slot in bytes
+	size_t filled;            // how many slots are occupied
+	size_t max_dist;          // how many slots is an entry from its ideal position?
+	uint64_t buckets_ptr;     // ptr to bucket array (into mapped area)
+	uint64_t flags;           // HT_INLINE_KEYS, ...
+	size_t key_size;          // size of the key area of a bucket, which starts at hash_bucket.keyptr
+	uint64_t ctrl_ptr;        // ptr to control bytes of HT_SWISS tables (one per bucket), 0 otherwise
+	size_t tombstones;        // number of removed buckets of HT_SWISS tables, whose control byte is HT_CTRL_DELETED
+	double max_load;          // maximum fraction of occupied buckets, 0 for the default (HT_MAX_LOAD, or 7/8 for HT_SWISS)
+};
+
+/** A bucket for storing a key and its hash (to speed up comparisons).
+ * With HT_INLINE_KEYS, the key area is HT_INLINE_KEY_SIZE bytes, and keyptr is only valid for spilled keys */
+struct hash_bucket {
+	uint64_t hash; // hashcode of the key, 0 indicates empty bucket
+	uint64_t keyptr; // index relative to underlying mem
+};
+
+/** Cursor over the non-empty buckets of a hash table, see HTITER(...).
+ * It keeps pointers into the mapping, so the file must not change while iterating */
+struct ht_iter {
+	struct hash_table* table;
+	int64_t idx;                // current bucket, valid after ht_iter_next(...) returned true
+	char* buckets;
+	uint8_t* ctrl;              // control bytes of HT_SWISS tables, otherwise NULL
+	size_t bucket_count, bucket_size;
+	size_t base;                // first bucket of the next 64 buckets to check
+	size_t word;                // first bucket of the 64 buckets described by 'bits'
+	uint64_t bits;              // non-empty buckets starting at 'word', that were not visited yet
+};
+
+/** Cursor over the values of a key of a multi-map, see MULTIMAP_FOREACH(...) */
+struct multimap_iter {
+	struct hash_table* table;
+	uint64_t set;                       // value of the key's bucket
+	size_t i;                           // number of values visited so far
+	struct hash_table nested_table;     // for sets stored in a nested table
+	struct ht_iter nested;
+	char* val;                          // current value, valid after multimap_iter_next(...) returned true
+};
+
+struct mem;
+
+struct mem* mem_create(char *file, size_t initial_size);
+struct mem* mem_open(char *file, size_t initial_size);
+void mem_close(struct mem* mem);
+void mem_commit(struct mem *mem);
+bool mem_set_root(struct mem *mem, char *name, MEMPTR ptr);
+MEMPTR mem_get_root(struct mem *mem, char *name);
+void mem_write_begin(struct mem *mem);
+void mem_write_end(struct mem *mem);
+
+struct hash_table ht_init_flags(void* mem, size_t value_size, uint64_t flags);
+struct hash_table ht_open(void* mem, uint64_t header_ptr);
+struct hash_table_header* ht_header(struct hash_table* table);
+struct hash_bucket* ht_bucket(struct hash_table* table, size_t idx);
+void* ht_value(struct hash_table* table, int64_t bucket_idx);
+char* ht_key(struct hash_table* table, int64_t bucket_idx);
+size_t ht_key_len(struct hash_table* table, int64_t bucket_idx);
+int64_t ht_lookup_bytes(struct hash_table* table, const void* key, size_t len);
+int64_t ht_insert_bytes(struct hash_table* table, const void* key, size_t len);
+bool ht_remove_bytes(struct hash_table* table, const void* key, size_t len);
+void ht_reserve(struct hash_table* table, size_t count);
+
+struct hash_table multimap_init(struct mem* mem, uint64_t flags);
+void multimap_insert_key_val(struct hash_table* table, char* key, char* val);
+size_t multimap_count(struct hash_table* table, int64_t bucket_idx);
+bool multimap_remove_key(struct hash_table* table, char* key);
+bool multimap_remove_key_val(struct hash_table* table, char* key, char* val);
+struct multimap_iter multimap_iter(struct hash_table* table, int64_t bucket_idx);
+bool multimap_iter_next(struct multimap_iter* it);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
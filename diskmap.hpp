@@ -0,0 +1,439 @@
+/*
+Diskmap - a hash map backed by a memory mapped file on disk
+Copyright (C) 2018  Thomas Rebele
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Typed C++ interface to diskmap, header only: diskmap::file, diskmap::table<Key, Value>, and diskmap::multimap<Key, Value>.
+// The tables are the ones of diskmap.c, whose types and functions are declared in diskmap.h, so C and C++ programs can share files.
+// Compile diskmap.c as C, without its main:
+//
+//     gcc -O2 -c -Dmain=diskmap_main diskmap.c && g++ -std=c++17 -O2 program.cpp diskmap.o -lpthread -lm
+
+#ifndef DISKMAP_HPP
+#define DISKMAP_HPP
+
+#include "diskmap.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace diskmap {
+
+/** Flags of table<Key, Value, Flags> and multimap<Key, Value, Flags>, see HT_INLINE_KEYS, ... in diskmap.h */
+constexpr uint64_t inline_keys = HT_INLINE_KEYS;
+constexpr uint64_t swiss = HT_SWISS;
+constexpr uint64_t shrink = HT_SHRINK;
+constexpr uint64_t intern = HT_INTERN;
+constexpr uint64_t wyhash = HT_WYHASH;
+constexpr uint64_t hugepages = HT_HUGEPAGES;
+
+namespace detail {
+/** Size of the key area of a bucket, as computed by ht_init_capacity(...) */
+constexpr size_t key_size(uint64_t flags) {
+	return (flags & inline_keys) && !(flags & intern) ? HT_INLINE_KEY_SIZE : sizeof(uint64_t);
+}
+
+/** Space of a value in a bucket: rounded up to 8 bytes, so that the hashes of all buckets stay aligned */
+constexpr size_t value_space(size_t size) {
+	return (size + sizeof(uint64_t) - 1) / sizeof(uint64_t) * sizeof(uint64_t);
+}
+
+/** Keys and values that are strings (std::string, std::string_view, char*). They are passed as std::string_view */
+template<typename T>
+constexpr bool is_string = std::is_convertible_v<const T&, std::string_view>;
+
+/** Key types: strings are stored with their length, other keys as their bytes (see ht_insert_bytes(...)) */
+template<typename Key, bool = is_string<Key>>
+struct key_traits {
+	static_assert(std::is_trivially_copyable_v<Key>, "binary keys are stored as their bytes, so they must be trivially copyable");
+	using type = Key;
+	static const void* data(const Key& key) { return &key; }
+	static size_t size(const Key&) { return sizeof(Key); }
+	static Key read(struct hash_table* table, int64_t idx) {
+		Key key;
+		std::memcpy(&key, ht_key(table, idx), sizeof(Key));
+		return key;
+	}
+};
+
+template<typename Key>
+struct key_traits<Key, true> {
+	using type = std::string_view;
+	static const void* data(std::string_view key) { return key.data(); }
+	static size_t size(std::string_view key) { return key.size(); }
+	static std::string_view read(struct hash_table* table, int64_t idx) {
+		return std::string_view(ht_key(table, idx), ht_key_len(table, idx));
+	}
+};
+
+/** Check that an existing table has the bucket layout of the C++ type that opens it */
+inline void check_layout(struct hash_table* table, size_t bucket_size, uint64_t flags) {
+	struct hash_table_header* header = ht_header(table);
+	uint64_t layout = inline_keys | intern | HT_MULTIMAP | HT_BLOB_VALUES;
+	if(header->bucket_size != bucket_size || header->key_size != key_size(flags) || (header->flags & layout) != (flags & layout)) {
+		throw std::invalid_argument("diskmap: the table has a different bucket layout");
+	}
+}
+
+/** Walks over the non-empty buckets of a table with a bucket size known at compile time.
+ * Like HTITER(...), the file must not change while iterating */
+template<size_t BucketSize>
+struct bucket_cursor {
+	struct hash_table* table = nullptr;
+	const char* buckets = nullptr;
+	size_t idx = 0, count = 0;
+
+	bucket_cursor() = default;
+	explicit bucket_cursor(struct hash_table* table) : table(table) {
+		struct hash_table_header* header = ht_header(table);
+		count = header->bucket_count;
+		buckets = reinterpret_cast<const char*>(ht_bucket(table, 0));
+		idx = -1;
+		advance();
+	}
+	uint64_t hash(size_t i) const { return reinterpret_cast<const hash_bucket*>(buckets + i * BucketSize)->hash; }
+	void advance() {
+		while(++idx < count && hash(idx) == 0) {}
+		if(idx >= count) table = nullptr;
+	}
+	bool operator==(const bucket_cursor& other) const { return table == other.table && (table == nullptr || idx == other.idx); }
+};
+} // namespace detail
+
+//******************************************************************************
+// files
+//******************************************************************************
+
+/** Owns the handle of a memory mapped file (struct mem), and closes it when destroyed. Can be moved, but not copied */
+class file {
+public:
+	/** Create a new file, see mem_create(...) */
+	static file create(const std::string& path, size_t initial_size = 4096) {
+		return file(mem_create(const_cast<char*>(path.c_str()), initial_size));
+	}
+
+	/** Open an existing file, or create a new one, see mem_open(...). Throws if it was not written by diskmap */
+	static file open(const std::string& path, size_t initial_size = 4096) {
+		struct mem* mem = mem_open(const_cast<char*>(path.c_str()), initial_size);
+		if(mem == nullptr) throw std::runtime_error("diskmap: not a diskmap file, or an incompatible version: " + path);
+		return file(mem);
+	}
+
+	file(file&& other) noexcept : mem_(std::exchange(other.mem_, nullptr)) {}
+	file& operator=(file&& other) noexcept {
+		if(this != &other) {
+			close();
+			mem_ = std::exchange(other.mem_, nullptr);
+		}
+		return *this;
+	}
+	file(const file&) = delete;
+	file& operator=(const file&) = delete;
+	~file() { close(); }
+
+	/** Write all changes and unmap the file, see mem_close(...). Tables of the file must not be used afterwards */
+	void close() {
+		if(mem_ != nullptr) mem_close(mem_);
+		mem_ = nullptr;
+	}
+
+	/** Make all changes durable, see mem_commit(...) */
+	void commit() { mem_commit(mem_); }
+
+	/** Store the position of a table under a name, see mem_set_root(...) */
+	bool set_root(const std::string& name, MEMPTR ptr) { return mem_set_root(mem_, const_cast<char*>(name.c_str()), ptr); }
+
+	/** Position stored with set_root(...), or 0 */
+	MEMPTR root(const std::string& name) const { return mem_get_root(mem_, const_cast<char*>(name.c_str())); }
+
+	struct mem* get() const { return mem_; }
+	explicit operator bool() const { return mem_ != nullptr; }
+
+private:
+	explicit file(struct mem* mem) : mem_(mem) {}
+	struct mem* mem_;
+};
+
+//******************************************************************************
+// hash maps
+//******************************************************************************
+
+/** Hash map from Key (a string, or a trivially copyable type stored as its bytes) to a trivially copyable Value,
+ * which is stored in the bucket (rounded up to 8 bytes). The bucket size and the position of the value are compile-time constants,
+ * so reading and writing a value is a copy of sizeof(Value) bytes, and iterating scans the buckets with a constant stride.
+ * Probing, moving buckets, and resizing are those of diskmap.c, so insert, erase, and reserve use the bucket size of the header.
+ * Flags are those of ht_init_flags(...) (inline_keys, swiss, ...), they are part of the type, as they change the bucket layout.
+ * The handle refers to its file, which must stay open. Positions and pointers are invalidated by inserts and removals, as in C */
+template<typename Key, typename Value, uint64_t Flags = 0>
+class table {
+	static_assert(std::is_trivially_copyable_v<Value> && std::is_default_constructible_v<Value>,
+			"values are stored in the buckets, so they must be trivially copyable");
+	static_assert((Flags & (HT_MULTIMAP | HT_BLOB_VALUES)) == 0, "use diskmap::multimap for multi-maps");
+	using keys = detail::key_traits<Key>;
+
+public:
+	using key_type = typename keys::type;
+	static constexpr size_t value_offset = sizeof(uint64_t) + detail::key_size(Flags);
+	static constexpr size_t bucket_size = value_offset + detail::value_space(sizeof(Value));
+
+	/** Create a new, empty table in a file */
+	static table create(file& f) { return table(ht_init_flags(f.get(), detail::value_space(sizeof(Value)), Flags)); }
+
+	/** Open a table created with the same Key, Value, and Flags, e.g. at f.root(name). Throws if its bucket layout differs */
+	static table open(file& f, MEMPTR header_ptr) {
+		struct hash_table tab = ht_open(f.get(), header_ptr);
+		detail::check_layout(&tab, bucket_size, Flags);
+		return table(tab);
+	}
+
+	/** Position of the table in the file, to be stored with file::set_root(...) */
+	MEMPTR header_ptr() const { return table_.header_ptr; }
+	size_t size() const { return ht_header(&table_)->filled; }
+	bool empty() const { return size() == 0; }
+
+	/** Make the bucket array big enough for n entries, see ht_reserve(...) */
+	void reserve(size_t n) { ht_reserve(&table_, n); }
+
+	/** Insert a key and its value, unless the key exists. Returns true if it was inserted */
+	bool insert(key_type key, const Value& value) {
+		struct mem* mem = static_cast<struct mem*>(table_.mem);
+		mem_write_begin(mem);
+		size_t filled = size();
+		int64_t idx = ht_insert_bytes(&table_, keys::data(key), keys::size(key));
+		bool inserted = size() != filled;
+		if(inserted) store(idx, value);
+		mem_write_end(mem);
+		return inserted;
+	}
+
+	/** Insert a key, or replace the value of an existing key */
+	void insert_or_assign(key_type key, const Value& value) {
+		struct mem* mem = static_cast<struct mem*>(table_.mem);
+		mem_write_begin(mem);
+		store(ht_insert_bytes(&table_, keys::data(key), keys::size(key)), value);
+		mem_write_end(mem);
+	}
+
+	/** Value of a key, if it exists */
+	std::optional<Value> find(key_type key) const {
+		int64_t idx = ht_lookup_bytes(&table_, keys::data(key), keys::size(key));
+		if(idx < 0) return std::nullopt;
+		return load(idx);
+	}
+
+	bool contains(key_type key) const { return ht_lookup_bytes(&table_, keys::data(key), keys::size(key)) >= 0; }
+
+	/** Remove a key, see ht_remove_idx(...). Returns false if it did not exist */
+	bool erase(key_type key) { return ht_remove_bytes(&table_, keys::data(key), keys::size(key)); }
+
+	/** Entry of a bucket, copied out of the file. String keys point into the file */
+	struct entry {
+		key_type key;
+		Value value;
+	};
+
+	/** Forward iterator over all entries, in bucket order. The file must not change while iterating */
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = entry;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = entry;
+
+		iterator() = default;
+		entry operator*() const {
+			Value value;
+			std::memcpy(&value, cursor_.buckets + cursor_.idx * bucket_size + value_offset, sizeof(Value));
+			return entry{keys::read(cursor_.table, cursor_.idx), value};
+		}
+		iterator& operator++() { cursor_.advance(); return *this; }
+		iterator operator++(int) { iterator old = *this; cursor_.advance(); return old; }
+		bool operator==(const iterator& other) const { return cursor_ == other.cursor_; }
+		bool operator!=(const iterator& other) const { return !(cursor_ == other.cursor_); }
+
+	private:
+		friend class table;
+		explicit iterator(struct hash_table* table) : cursor_(table) {}
+		detail::bucket_cursor<bucket_size> cursor_;
+	};
+
+	iterator begin() const { return iterator(&table_); }
+	iterator end() const { return iterator(); }
+
+	/** The C handle, for the functions of diskmap.c */
+	struct hash_table* c_table() const { return &table_; }
+
+private:
+	explicit table(struct hash_table tab) : table_(tab) {}
+
+	Value load(int64_t idx) const {
+		Value value;
+		std::memcpy(&value, reinterpret_cast<char*>(ht_bucket(&table_, 0)) + idx * bucket_size + value_offset, sizeof(Value));
+		return value;
+	}
+
+	void store(int64_t idx, const Value& value) {
+		// ht_value(...) marks the bucket as dirty
+		std::memcpy(ht_value(&table_, idx), &value, sizeof(Value));
+	}
+
+	// the C functions take non-const handles, also for lookups
+	mutable struct hash_table table_;
+};
+
+//******************************************************************************
+// multi-maps
+//******************************************************************************
+
+/** Multi-map from string keys to sets of strings, a multi-map of multimap_init(...).
+ * The values of the C multi-maps are strings, so Key and Value must be string types */
+template<typename Key, typename Value, uint64_t Flags = 0>
+class multimap {
+	static_assert(detail::is_string<Key> && detail::is_string<Value>, "keys and values of multi-maps are strings, see multimap_insert_key_val(...)");
+	static_assert((Flags & (HT_MULTIMAP | HT_BLOB_VALUES)) == 0, "multi-maps set their flags themselves");
+	static constexpr uint64_t flags = Flags | HT_MULTIMAP;
+
+public:
+	using key_type = std::string_view;
+	static constexpr size_t bucket_size = sizeof(uint64_t) + detail::key_size(flags) + sizeof(MEMPTR);
+
+	static multimap create(file& f) { return multimap(multimap_init(f.get(), Flags)); }
+
+	/** Open a multi-map created with the same Flags. Throws if its bucket layout differs */
+	static multimap open(file& f, MEMPTR header_ptr) {
+		struct hash_table tab = ht_open(f.get(), header_ptr);
+		detail::check_layout(&tab, bucket_size, flags);
+		return multimap(tab);
+	}
+
+	MEMPTR header_ptr() const { return table_.header_ptr; }
+
+	/** Number of keys */
+	size_t size() const { return ht_header(&table_)->filled; }
+	bool empty() const { return size() == 0; }
+
+	/** Add a value to the set of a key */
+	void insert(key_type key, std::string_view val) {
+		std::string k(key), v(val);
+		multimap_insert_key_val(&table_, k.data(), v.data());
+	}
+
+	/** Number of values of a key, 0 if it does not exist */
+	size_t count(key_type key) const {
+		int64_t idx = ht_lookup_bytes(&table_, key.data(), key.size());
+		return idx < 0 ? 0 : multimap_count(&table_, idx);
+	}
+
+	bool contains(key_type key) const { return ht_lookup_bytes(&table_, key.data(), key.size()) >= 0; }
+
+	/** Remove a key with all its values. Returns false if it did not exist */
+	bool erase(key_type key) {
+		std::string k(key);
+		return multimap_remove_key(&table_, k.data());
+	}
+
+	/** Remove one value of a key. Returns false if the pair did not exist */
+	bool erase(key_type key, std::string_view val) {
+		std::string k(key), v(val);
+		return multimap_remove_key_val(&table_, k.data(), v.data());
+	}
+
+	/** Values of one key, see MULTIMAP_FOREACH(...). Use it directly in a range-based for loop, as it cannot be moved */
+	class value_range {
+	public:
+		class iterator {
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = std::string_view;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = std::string_view;
+
+			std::string_view operator*() const { return it_->val; }
+			iterator& operator++() {
+				if(!multimap_iter_next(it_)) it_ = nullptr;
+				return *this;
+			}
+			bool operator==(const iterator& other) const { return it_ == other.it_; }
+			bool operator!=(const iterator& other) const { return it_ != other.it_; }
+
+		private:
+			friend class value_range;
+			explicit iterator(struct multimap_iter* it) : it_(it) {}
+			struct multimap_iter* it_;
+		};
+
+		value_range(const value_range&) = delete;
+		value_range& operator=(const value_range&) = delete;
+
+		// the C cursor refers to itself once it is started, so it stays here, and iterators only point to it
+		iterator begin() { return found_ ? ++iterator(&it_) : end(); }
+		iterator end() { return iterator(nullptr); }
+
+	private:
+		friend class multimap;
+		value_range(struct hash_table* table, int64_t idx) : found_(idx >= 0) {
+			if(found_) it_ = multimap_iter(table, idx);
+		}
+		bool found_;
+		struct multimap_iter it_;
+	};
+
+	value_range values(key_type key) const { return value_range(&table_, ht_lookup_bytes(&table_, key.data(), key.size())); }
+
+	/** Forward iterator over all keys, in bucket order. The file must not change while iterating */
+	class iterator {
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::string_view;
+		using difference_type = std::ptrdiff_t;
+		using pointer = void;
+		using reference = std::string_view;
+
+		iterator() = default;
+		std::string_view operator*() const { return detail::key_traits<Key>::read(cursor_.table, cursor_.idx); }
+		iterator& operator++() { cursor_.advance(); return *this; }
+		iterator operator++(int) { iterator old = *this; cursor_.advance(); return old; }
+		bool operator==(const iterator& other) const { return cursor_ == other.cursor_; }
+		bool operator!=(const iterator& other) const { return !(cursor_ == other.cursor_); }
+
+	private:
+		friend class multimap;
+		explicit iterator(struct hash_table* table) : cursor_(table) {}
+		detail::bucket_cursor<bucket_size> cursor_;
+	};
+
+	iterator begin() const { return iterator(&table_); }
+	iterator end() const { return iterator(); }
+
+	struct hash_table* c_table() const { return &table_; }
+
+private:
+	explicit multimap(struct hash_table tab) : table_(tab) {}
+	mutable struct hash_table table_;
+};
+
+} // namespace diskmap
+
+#endif
@@ -0,0 +1,274 @@
+/*
+Diskmap - a hash map backed by a memory mapped file on disk
+Copyright (C) 2018  Thomas Rebele
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Benchmarks of the hash table operations, for all combinations of engine, key length, value size, and load factor.
+// Reports ns/op, latency percentiles, page faults, and memory usage, and writes them as CSV
+
+#define DEBUG false
+#define main deactivated_main
+#include "diskmap.c"
+#undef main
+
+#include <sys/resource.h>
+
+/** Configuration of one benchmark run */
+struct bench_config {
+	char* engine;                       // "robin" or "swiss"
+	uint64_t flags;
+	size_t key_len;
+	size_t value_size;
+	double max_load;
+	size_t n;                           // number of keys
+};
+
+/** Measurements of one operation, see bench_start(...) and bench_finish(...) */
+struct bench_op {
+	char* name;
+	size_t ops;
+	uint32_t* latencies;                // ns of each operation, or NULL for operations that are only measured as a whole
+	uint64_t start_ns, total_ns;
+	struct rusage start_usage;
+	long minor_faults, major_faults;
+};
+
+static size_t bench_ram;
+static FILE* bench_csv;
+static char* bench_file = "/tmp/diskmap_bench";
+
+static inline uint64_t bench_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/** Resident set size in KB, read from /proc/self/statm (0 if not available) */
+size_t bench_rss_kb() {
+	size_t size = 0, resident = 0;
+	FILE* f = fopen("/proc/self/statm", "r");
+	if(f == NULL) return 0;
+	if(fscanf(f, "%zu %zu", &size, &resident) != 2) resident = 0;
+	fclose(f);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/** Key number i of length len. Keys i and j differ for i != j < 10^len */
+static inline void bench_key(char* key, size_t i, size_t len) {
+	// the digits at the end, so that keys do not share a prefix with a distinct first character
+	memset(key, 'k', len);
+	for(size_t p = len; p-- > 0 && i > 0; i /= 10) key[p] = '0' + i % 10;
+	key[len] = '\0';
+}
+
+struct bench_op bench_start(char* name, size_t ops, bool latencies) {
+	struct bench_op op = {name, ops, NULL, 0, 0};
+	if(latencies) {
+		op.latencies = malloc(max(ops, 1) * sizeof(uint32_t));
+		if(op.latencies == NULL) handle_error("Error allocating memory");
+	}
+	getrusage(RUSAGE_SELF, &op.start_usage);
+	op.start_ns = bench_now();
+	return op;
+}
+
+static int bench_compare(const void* a, const void* b) {
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t bench_percentile(struct bench_op* op, double p) {
+	if(op->latencies == NULL || op->ops == 0) return 0;
+	return op->latencies[min((size_t)(p * op->ops), op->ops - 1)];
+}
+
+/** Stop measuring, and write a line to stdout and to the CSV file */
+void bench_finish(struct bench_config* config, struct bench_op* op, struct mem* mem) {
+	op->total_ns = bench_now() - op->start_ns;
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	op->minor_faults = usage.ru_minflt - op->start_usage.ru_minflt;
+	op->major_faults = usage.ru_majflt - op->start_usage.ru_majflt;
+	if(op->latencies != NULL) qsort(op->latencies, op->ops, sizeof(uint32_t), bench_compare);
+
+	double ns_per_op = op->ops == 0 ? 0 : (double)op->total_ns / op->ops;
+	size_t file_bytes = mem->header->size;
+	printf("%-6s key %4zu value %3zu load %.2f n %9zu %-10s %9.1f ns/op  p50 %7u p99 %7u p999 %8u  faults %ld/%ld  rss %zu KB\n",
+			config->engine, config->key_len, config->value_size, config->max_load, config->n, op->name, ns_per_op,
+			bench_percentile(op, 0.5), bench_percentile(op, 0.99), bench_percentile(op, 0.999),
+			op->minor_faults, op->major_faults, bench_rss_kb());
+	if(bench_csv != NULL) {
+		fprintf(bench_csv, "%s,%zu,%zu,%.2f,%zu,%s,%zu,%.1f,%u,%u,%u,%ld,%ld,%zu,%zu,%zu,%.4f\n",
+				config->engine, config->key_len, config->value_size, config->max_load, config->n, op->name, op->ops, ns_per_op,
+				bench_percentile(op, 0.5), bench_percentile(op, 0.99), bench_percentile(op, 0.999),
+				op->minor_faults, op->major_faults, bench_rss_kb(), (size_t)usage.ru_maxrss, file_bytes, (double)file_bytes / bench_ram);
+		fflush(bench_csv);
+	}
+	free(op->latencies);
+	op->latencies = NULL;
+}
+
+/** Time one operation of a loop, and store its latency */
+#define BENCH_TIMED(OP, I, CODE) do { uint64_t t0 = bench_now(); CODE; (OP).latencies[I] = min(bench_now() - t0, UINT32_MAX); } while(0)
+
+/** Run all operations for one configuration, on a new file */
+void bench_run(struct bench_config* config) {
+	unlink(bench_file);
+	struct mem* mem = mem_create(bench_file, 4096);
+	mem_set_durability(mem, MEM_DURABILITY_NONE, 0);
+	struct hash_table tab = ht_init_flags(mem, config->value_size, config->flags);
+	struct hash_table* table = &tab;
+	ht_set_max_load(table, config->max_load);
+	size_t n = config->n, len = config->key_len;
+	char key[len + 1], value[config->value_size];
+
+	// lookups in random order, so that they do not benefit from the insertion order
+	size_t* order = malloc(n * sizeof(size_t));
+	if(order == NULL) handle_error("Error allocating memory");
+	for(size_t i=0; i<n; i++) order[i] = i;
+	srand(42);
+	for(size_t i=n; i-- > 1; ) {
+		size_t j = ((size_t)rand() * RAND_MAX + rand()) % (i + 1);
+		size_t tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	struct bench_op op = bench_start("insert", n, true);
+	for(size_t i=0; i<n; i++) {
+		bench_key(key, i, len);
+		memset(value, i, config->value_size);
+		BENCH_TIMED(op, i, memcpy(ht_value(table, ht_insert_str(table, key)), value, config->value_size));
+	}
+	bench_finish(config, &op, mem);
+
+	size_t found = 0;
+	op = bench_start("hit", n, true);
+	for(size_t i=0; i<n; i++) {
+		bench_key(key, order[i], len);
+		BENCH_TIMED(op, i, found += ht_lookup(table, key) >= 0);
+	}
+	bench_finish(config, &op, mem);
+
+	op = bench_start("miss", n, true);
+	for(size_t i=0; i<n; i++) {
+		bench_key(key, n + order[i], len);
+		BENCH_TIMED(op, i, found += ht_lookup(table, key) >= 0);
+	}
+	bench_finish(config, &op, mem);
+	if(found != n) fprintf(stderr, "benchmark found %zu of %zu keys\n", found, n);
+
+	int64_t batch_idx[HT_BATCH];
+	char keys[HT_BATCH][len + 1];
+	char* batch[HT_BATCH];
+	op = bench_start("hit_batch", n, false);
+	for(size_t i=0; i<n; i+=HT_BATCH) {
+		size_t count = min(HT_BATCH, n - i);
+		for(size_t j=0; j<count; j++) {
+			bench_key(keys[j], order[i + j], len);
+			batch[j] = keys[j];
+		}
+		ht_lookup_batch(table, batch, count, batch_idx);
+	}
+	bench_finish(config, &op, mem);
+
+	char snapshot_file[strlen(bench_file) + 6];
+	sprintf(snapshot_file, "%s.snap", bench_file);
+	op = bench_start("snap_write", n, false);
+	snapshot_write(table, snapshot_file, 0);
+	bench_finish(config, &op, mem);
+
+	// the pages of the table are already mapped, so map the whole snapshot at once, too
+	struct snapshot* snap = snapshot_open(snapshot_file, MEM_POPULATE);
+	found = 0;
+	op = bench_start("snap_hit", n, true);
+	for(size_t i=0; i<n; i++) {
+		bench_key(key, order[i], len);
+		BENCH_TIMED(op, i, found += snapshot_lookup(snap, key) >= 0);
+	}
+	bench_finish(config, &op, mem);
+	if(found != n) fprintf(stderr, "benchmark found %zu of %zu keys in the snapshot\n", found, n);
+	snapshot_close(snap);
+	unlink(snapshot_file);
+
+	uint64_t sum = 0;
+	op = bench_start("iterate", n, false);
+	ht_advise(table, MADV_SEQUENTIAL);
+	HTITER(table, it) sum += ht_bucket(table, it.idx)->hash;
+	ht_advise(table, MADV_RANDOM);
+	bench_finish(config, &op, mem);
+
+	op = bench_start("resize", HTHEADER(table)->filled, false);
+	ht_reserve(table, 2 * ht_max_filled(table, HTHEADER(table)->bucket_count));
+	bench_finish(config, &op, mem);
+
+	// four values per key
+	struct hash_table multimap = multimap_init(mem, config->flags);
+	size_t pairs = n;
+	op = bench_start("multimap", pairs, true);
+	for(size_t i=0; i<pairs; i++) {
+		bench_key(key, i / 4, len);
+		char val[32];
+		sprintf(val, "value%zu", i % 4);
+		BENCH_TIMED(op, i, multimap_insert_key_val(&multimap, key, val));
+	}
+	bench_finish(config, &op, mem);
+
+	if(sum == 0) fprintf(stderr, "benchmark iterated over no hashes\n");
+	free(order);
+	mem_close(mem);
+	unlink(bench_file);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t n = 1000000;
+	char* csv_file = "diskmap_bench.csv";
+	int opt;
+	while((opt = getopt(argc, argv, "n:o:f:")) != -1) {
+		if(opt == 'n') n = strtoull(optarg, NULL, 10);
+		else if(opt == 'o') csv_file = optarg;
+		else if(opt == 'f') bench_file = optarg;
+		else {
+			printf("usage: %s [-n keys] [-o csv file] [-f diskmap file]\n", argv[0]);
+			return -1;
+		}
+	}
+	bench_ram = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	bench_csv = fopen(csv_file, "w");
+	if(bench_csv == NULL) handle_error("Error opening csv file");
+	fprintf(bench_csv, "engine,key_len,value_size,max_load,n,op,ops,ns_per_op,p50_ns,p99_ns,p999_ns,"
+			"minor_faults,major_faults,rss_kb,max_rss_kb,file_bytes,file_ram_ratio\n");
+
+	char* engines[] = {"robin", "swiss"};
+	uint64_t engine_flags[] = {0, HT_SWISS};
+	size_t key_lens[] = {8, 32, 128};
+	size_t value_sizes[] = {8, 64};
+	double loads[] = {0.5, 0.85};
+	for(int e=0; e<2; e++) {
+		for(int k=0; k<3; k++) {
+			for(int v=0; v<2; v++) {
+				for(int l=0; l<2; l++) {
+					struct bench_config config = {engines[e], engine_flags[e], key_lens[k], value_sizes[v], loads[l], n};
+					bench_run(&config);
+				}
+			}
+		}
+	}
+	fclose(bench_csv);
+	printf("results written to %s\n", csv_file);
+	return 0;
+}
@@ -0,0 +1,44 @@
+/*
+Diskmap - a hash map backed by a memory mapped file on disk
+Copyright (C) 2018  Thomas Rebele
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Rewrites a diskmap file into a new, compact one, see mem_compact(...)
+
+#define main deactivated_main
+#include "diskmap.c"
+#undef main
+
+int main(int argc, char *argv[])
+{
+	if(argc < 3) {
+		printf("usage: %s <src file> <dst file> [root ...]\n", argv[0]);
+		printf("every root of the source file must be a hash table; the roots given as arguments are multi-maps\n");
+		printf("created with multimap_insert_key_val(...) on a table without HT_MULTIMAP, whose nested tables are copied too\n");
+		printf("only data reachable from the roots (see mem_set_root(...)) is copied, tables without a root are dropped\n");
+		return -1;
+	}
+	if(strcmp(argv[1], argv[2]) == 0) {
+		fprintf(stderr, "the destination must be another file\n");
+		return -1;
+	}
+	if(!mem_compact(argv[1], argv[2], argv + 3, argc - 3)) return 1;
+
+	struct stat src_info, dst_info;
+	if(stat(argv[1], &src_info) == -1 || stat(argv[2], &dst_info) == -1) handle_error("Error getting the file size");
+	printf("compacted %s (%ld bytes) into %s (%ld bytes)\n", argv[1], (long)src_info.st_size, argv[2], (long)dst_info.st_size);
+	return 0;
+}
@@ -16,6 +16,7 @@ You should have received a copy of the GNU Affero General Public License
 along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -24,6 +25,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <signal.h>
 #include <stdlib.h>
 #include <time.h>
+#include <sys/wait.h>
 
 #define main deactivated_main
 #include "diskmap.c"
@@ -40,6 +42,38 @@ bool ht_check(struct hash_table* table) {
 	assert(HTHEADER(table)->filled == filled);
 }
 
+/** Walk over all blocks of mem, and check flags, sizes, and free lists. Returns number of free blocks */
+size_t mem_check(struct mem* mem) {
+	size_t free_blocks = 0, binned = 0;
+	bool prev_inuse = true;
+	BLOCK_POS pos = (sizeof(struct mem_header) + sizeof(struct mem_block) + MEM_ALIGN - 1) / MEM_ALIGN * MEM_ALIGN - sizeof(struct mem_block);
+	while(pos < mem->header->top) {
+		size_t size = BLOCK(pos)->size & ~MEM_FLAGS;
+		assert(size >= MEM_MIN_BLOCK && size % MEM_ALIGN == 0);
+		assert(((BLOCK(pos)->size & MEM_PREV_INUSE) != 0) == prev_inuse);
+		bool inuse = BLOCK(pos)->size & MEM_INUSE;
+		if(!inuse) {
+			// no two free blocks next to each other, and boundary tag matches
+			assert(prev_inuse);
+			assert(*(uint64_t*)MEMPTR(pos + size - sizeof(uint64_t)) == size);
+			free_blocks++;
+		}
+		prev_inuse = inuse;
+		pos += size;
+	}
+	assert(pos == mem->header->top);
+	assert(prev_inuse);
+	for(int bin=0; bin<MEM_BIN_COUNT; bin++) {
+		assert((mem->header->bins[bin] != 0) == ((mem->header->bin_map[bin/64] >> (bin%64)) & 1));
+		for(BLOCK_POS free = mem->header->bins[bin]; free != 0; free = FREE_BLOCK(free)->next) {
+			assert(mem_bin(FREE_BLOCK(free)->size & ~MEM_FLAGS) == bin);
+			binned++;
+		}
+	}
+	assert(binned == free_blocks);
+	return free_blocks;
+}
+
 const char *bit_rep[16] = {
     [ 0] = "0000", [ 1] = "0001", [ 2] = "0010", [ 3] = "0011",
     [ 4] = "0100", [ 5] = "0101", [ 6] = "0110", [ 7] = "0111",
@@ -51,8 +85,16 @@ void print_byte(uint8_t byte) {
     printf("%s%s", bit_rep[byte >> 4], bit_rep[byte & 0x0F]);
 }
 
-#define MAKEKEY(i)  char key[100]; strcpy(key, "key"); sprintf(&key[3], "%d", i);
-#define MAKEVAL(i)  char val[100]; sprintf(val, "%s", key); strcpy(&val[strlen(key)], "val"); sprintf(&val[strlen(key)+3], "%d", i);
+/** Operations per second since start, measured with a monotonic clock (see diskmap_bench.c for real measurements) */
+double ops_per_second(size_t ops, struct timespec* start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+	return elapsed > 0 ? ops / elapsed : 0;
+}
+
+#define MAKEKEY(i)  char key[100]; strcpy(key, "key"); sprintf(&key[3], "%lld", (long long)(i));
+#define MAKEVAL(i)  char val[100]; sprintf(val, "%s", key); strcpy(&val[strlen(key)], "val"); sprintf(&val[strlen(key)+3], "%lld", (long long)(i));
 
 /** Insert n strings into hashmap, and check whether there are n strings in the hashmap */
 int test1() {
@@ -60,14 +102,15 @@ int test1() {
 	struct hash_table tab = ht_init(mem, 0);
 	struct hash_table* table = &tab;
 
-	time_t start = time(NULL);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	int n = 5000000;
 	for(int i=0; i<n; i++) {
 		MAKEKEY(i);
 		if(i%100000 == 0) {
 			printf("test1 calling insert for '%s'", key);
-			printf(" #inserts / s: %.2f\n", i/((double)(time(NULL) - start)));
+			printf(" #inserts / s: %.2f\n", ops_per_second(i, &start));
 		}
 		if(i%1000000 == 0) {
 			ht_print_stat(table);
@@ -80,7 +123,7 @@ int test1() {
 	// check
 	for(int i=0; i<n; i++) {
 		MAKEKEY(i);
-		int pos = ht_lookup(table, key);
+		int64_t pos = ht_lookup(table, key);
 		if(pos < 0) {
 			ht_print(table);
 			printf("key not found: '%s'\n", key);
@@ -101,7 +144,8 @@ int test2() {
 	struct hash_table tab = ht_init(mem, sizeof(MEMPTR));
 	struct hash_table* table = &tab;
 
-	time_t start = time(NULL);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
 	int n = 3000, count = 0;
 	for(int i=1; i<=n; i++) {
@@ -115,7 +159,7 @@ int test2() {
 
 			if(count%100000 == 0) {
 				printf("test1 calling insert for '%s' value '%s'", key, val);
-				printf(" #inserts / s: %.2f\n", count/((double)(time(NULL) - start)));
+				printf(" #inserts / s: %.2f\n", ops_per_second(count, &start));
 			}
 		}
 	}
@@ -128,7 +172,7 @@ int test2() {
 		int64_t bucket_idx = ht_lookup(table, key);
 		uint64_t *htval = ht_value(table, bucket_idx);
 		struct hash_table tab = multimap_get(mem, htval);
-		int filled = HTHEADER(&tab)->filled;
+		size_t filled = HTHEADER(&tab)->filled;
 		if(filled != i) {
 			printf("some entry missing for key %s\n", key);
 			ht_print(&tab);
@@ -143,6 +187,483 @@ int test2() {
 	mem_abandon(mem);
 }
 
+/** Insert n strings into a hash map, close the file, and check whether a reopened file still contains them */
+int test3() {
+	unlink("/tmp/diskmap_test_reopen");
+	struct mem* mem = mem_open("/tmp/diskmap_test_reopen", 4000);
+	struct hash_table tab = ht_init(mem, 0);
+	struct hash_table* table = &tab;
+	assert(mem_set_root(mem, "test3", table->header_ptr));
+
+	int n = 100000;
+	for(int i=0; i<n; i++) {
+		MAKEKEY(i);
+		ht_insert_str(table, key);
+	}
+	mem_close(mem);
+
+	// reopen, and continue inserting into the same table
+	mem = mem_open("/tmp/diskmap_test_reopen", 4000);
+	assert(mem != NULL);
+	assert(mem_get_root(mem, "test3") != 0);
+	assert(mem_get_root(mem, "missing") == 0);
+	tab = ht_open(mem, mem_get_root(mem, "test3"));
+	assert(HTHEADER(table)->filled == n);
+	for(int i=n; i<2*n; i++) {
+		MAKEKEY(i);
+		ht_insert_str(table, key);
+	}
+	for(int i=0; i<2*n; i++) {
+		MAKEKEY(i);
+		assert(ht_lookup(table, key) >= 0);
+	}
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test3 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Allocate and free blocks of random sizes, and check that contents are not overwritten, 
+ * that free blocks are merged, and that the allocator state survives reopening the file */
+int test4() {
+	unlink("/tmp/diskmap_test_alloc");
+	struct mem* mem = mem_open("/tmp/diskmap_test_alloc", 4000);
+	srand(4);
+
+	int n = 2000;
+	MEMPTR ptrs[n];
+	size_t sizes[n];
+	for(int i=0; i<n; i++) ptrs[i] = 0;
+	for(int round=0; round<100000; round++) {
+		int i = rand() % n;
+		if(ptrs[i] != 0) {
+			unsigned char* content = MEMPTR(ptrs[i]);
+			for(size_t j=0; j<sizes[i]; j++) assert(content[j] == (unsigned char)i);
+			mem_free(mem, ptrs[i]);
+			ptrs[i] = 0;
+		}
+		else {
+			// mostly small blocks, sometimes big ones
+			sizes[i] = rand() % 10 == 0 ? rand() % 100000 : rand() % 40;
+			ptrs[i] = mem_alloc(mem, sizes[i]);
+			assert(ptrs[i] % MEM_ALIGN == 0);
+			memset(MEMPTR(ptrs[i]), i, sizes[i]);
+		}
+		if(round % 10000 == 0) mem_check(mem);
+	}
+	mem_check(mem);
+	mem_close(mem);
+
+	mem = mem_open("/tmp/diskmap_test_alloc", 4000);
+	assert(mem != NULL);
+	mem_check(mem);
+	for(int i=0; i<n; i++) {
+		if(ptrs[i] == 0) continue;
+		unsigned char* content = MEMPTR(ptrs[i]);
+		for(size_t j=0; j<sizes[i]; j++) assert(content[j] == (unsigned char)i);
+		mem_free(mem, ptrs[i]);
+	}
+	// everything was merged into the unused space at the end
+	assert(mem_check(mem) == 0);
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test4 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Store short and long strings, and check that short strings are stored next to each other */
+int test5() {
+	struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+	char big[5000];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+
+	MEMPTR prev = mem_insert_str(mem, "key");
+	int n = 100000, chunks = 0;
+	for(int i=0; i<n; i++) {
+		MAKEKEY(i);
+		MEMPTR ptr = mem_insert_str(mem, key);
+		assert(strcmp(MEMPTR(ptr), key) == 0);
+		assert(mem_str_len(mem, ptr) == strlen(key));
+		// only a length in front, unless a new chunk was started
+		if(ptr != prev + mem_str_len(mem, prev) + 1 + sizeof(uint32_t)) chunks++;
+		prev = ptr;
+
+		if(i % 10000 == 0) {
+			MEMPTR big_ptr = mem_insert_str(mem, big);
+			assert(mem_str_len(mem, big_ptr) == strlen(big));
+			assert(strcmp(MEMPTR(big_ptr), big) == 0);
+		}
+	}
+	assert(chunks < 10);
+	mem_abandon(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test5 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Insert n keys with values of different sizes, and check that values survive swaps and resizes */
+int test6() {
+	size_t value_sizes[] = {0, 8, 16, 24};
+	int n = 200000;
+	for(int v=0; v<4; v++) {
+		size_t value_size = value_sizes[v];
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = ht_init(mem, value_size);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_insert_str(table, key);
+			memset(ht_value(table, pos), i, value_size);
+		}
+		// inserting existing keys does not change anything
+		for(int i=0; i<n; i+=100) {
+			MAKEKEY(i);
+			assert(ht_insert_str(table, key) == ht_lookup(table, key));
+		}
+		assert(HTHEADER(table)->filled == n);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert(pos >= 0);
+			unsigned char* val = ht_value(table, pos);
+			for(size_t j=0; j<value_size; j++) assert(val[j] == (unsigned char)i);
+		}
+		mem_abandon(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test6 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Insert short and long keys into a table with inline keys, and check that only long keys use the string heap */
+int test7() {
+	struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+	struct hash_table tab = ht_init_flags(mem, sizeof(uint64_t), HT_INLINE_KEYS);
+	struct hash_table* table = &tab;
+	assert(HTHEADER(table)->bucket_size == sizeof(uint64_t) + HT_INLINE_KEY_SIZE + sizeof(uint64_t));
+
+	int n = 100000;
+	for(int i=0; i<n; i++) {
+		MAKEKEY(i);
+		*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+	}
+	// short keys are not written to the string heap
+	assert(mem->header->str_pos == 0);
+
+	// keys with lengths around the inline limit
+	char long_key[100];
+	for(int len=1; len<40; len++) {
+		memset(long_key, 'a' + len % 26, len);
+		long_key[len] = '\0';
+		*(uint64_t*)ht_value(table, ht_insert_str(table, long_key)) = n + len;
+	}
+	assert(mem->header->str_pos != 0);
+
+	for(int i=0; i<n; i++) {
+		MAKEKEY(i);
+		int64_t pos = ht_lookup(table, key);
+		assert(pos >= 0);
+		assert(*(uint64_t*)ht_value(table, pos) == i);
+		assert(strcmp(ht_key(table, pos), key) == 0);
+	}
+	for(int len=1; len<40; len++) {
+		memset(long_key, 'a' + len % 26, len);
+		long_key[len] = '\0';
+		int64_t pos = ht_lookup(table, long_key);
+		assert(pos >= 0);
+		assert(*(uint64_t*)ht_value(table, pos) == n + len);
+		assert(strcmp(ht_key(table, pos), long_key) == 0);
+	}
+	size_t filled = 0;
+	HTFOREACH(table) {
+		assert(ht_lookup(table, HTFOREACH_KEY(table)) == i);
+		filled++;
+	}
+	assert(filled == n + 39);
+	mem_abandon(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test7 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Insert n keys with values into swiss tables (with and without inline keys), and a multi-map based on a swiss table */
+int test8() {
+	int n = 200000;
+	uint64_t flags[] = {HT_SWISS, HT_SWISS | HT_INLINE_KEYS};
+	for(int f=0; f<2; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		assert(HTHEADER(table)->filled == n);
+		ht_check(table);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert(pos >= 0);
+			assert(*(uint64_t*)ht_value(table, pos) == i);
+			assert(ht_insert_str(table, key) == pos);
+		}
+		for(int i=n; i<2*n; i++) {
+			MAKEKEY(i);
+			assert(ht_lookup(table, key) < 0);
+		}
+		mem_abandon(mem);
+	}
+
+	int keys = 300;
+	struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+	struct hash_table tab = ht_init_flags(mem, sizeof(MEMPTR), HT_SWISS);
+	struct hash_table* table = &tab;
+	for(int i=1; i<=keys; i++) {
+		MAKEKEY(i);
+		for(int j=0; j<i; j++) {
+			MAKEVAL(j);
+			multimap_insert_key_val(table, key, val);
+		}
+	}
+	for(int i=1; i<=keys; i++) {
+		MAKEKEY(i);
+		struct hash_table values = multimap_get(mem, ht_value(table, ht_lookup(table, key)));
+		assert(HTHEADER(&values)->flags & HT_SWISS);
+		assert(HTHEADER(&values)->filled == i);
+	}
+	mem_abandon(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test8 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Look up existing and missing keys in batches, and compare with single lookups */
+int test9() {
+	int n = 100000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS};
+	char* keys[1000];
+	int64_t idx[1000];
+	for(int k=0; k<1000; k++) keys[k] = malloc(100);
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = ht_init_flags(mem, 0, flags[f]);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n; i+=2) {
+			MAKEKEY(i);
+			ht_insert_str(table, key);
+		}
+		// all keys, the odd ones are missing; batch size is not a multiple of HT_BATCH
+		for(int start=0; start<n; start+=1000) {
+			size_t count = min(1000, n - start - 5);
+			for(int k=0; k<count; k++) sprintf(keys[k], "key%d", start + k);
+			ht_lookup_batch(table, keys, count, idx);
+			for(int k=0; k<count; k++) {
+				assert(idx[k] == ht_lookup(table, keys[k]));
+				assert((idx[k] >= 0) == ((start + k) % 2 == 0));
+			}
+		}
+		mem_abandon(mem);
+	}
+	for(int k=0; k<1000; k++) free(keys[k]);
+
+	printf("********************************************************************************\n");
+	printf("*** test9 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Build tables from n pairs with ht_builder, where some keys are added twice, and check their content */
+int test10() {
+	int n = 300000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS};
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct ht_builder builder = ht_builder_init(mem, sizeof(uint64_t), flags[f], f == 0 ? n : 0);
+		size_t duplicate_bytes = 0;
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			uint64_t value = i;
+			ht_builder_add(&builder, key, &value);
+			// the first pair for a key wins
+			if(i % 10 == 0) {
+				value = 0;
+				ht_builder_add(&builder, key, &value);
+				duplicate_bytes += sizeof(uint32_t) + strlen(key) + 1;
+			}
+		}
+		struct hash_table tab = ht_builder_finish(&builder);
+		struct hash_table* table = &tab;
+		assert(HTHEADER(table)->filled == n);
+		// the keys of the dropped pairs are given back, inline keys were never written
+		assert(mem->header->str_garbage == (flags[f] & HT_INLINE_KEYS ? 0 : duplicate_bytes));
+		ht_check(table);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert(pos >= 0);
+			assert(*(uint64_t*)ht_value(table, pos) == i);
+		}
+		// the table can be used as usual
+		for(int i=n; i<2*n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		for(int i=0; i<2*n; i++) {
+			MAKEKEY(i);
+			assert(*(uint64_t*)ht_value(table, ht_lookup(table, key)) == i);
+		}
+		mem_abandon(mem);
+	}
+
+	// small tables, including keys that wrap around at the end of the bucket array
+	for(int size=0; size<50; size++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct ht_builder builder = ht_builder_init(mem, 0, 0, 0);
+		for(int i=0; i<size; i++) {
+			MAKEKEY(i);
+			ht_builder_add(&builder, key, NULL);
+			ht_builder_add(&builder, key, NULL);
+		}
+		struct hash_table tab = ht_builder_finish(&builder);
+		struct hash_table* table = &tab;
+		assert(HTHEADER(table)->filled == size);
+		for(int i=0; i<size; i++) {
+			MAKEKEY(i);
+			assert(ht_lookup(table, key) >= 0);
+		}
+		mem_abandon(mem);
+	}
+
+	// 10 pairs need 16 buckets; three of them have the last bucket as home
+	struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+	struct ht_builder builder = ht_builder_init(mem, 0, 0, 0);
+	char keys[10][100];
+	for(int i=0, found=0; found<10; i++) {
+		MAKEKEY(i);
+		if((hash(key) & 15) == 15 || found >= 3) strcpy(keys[found++], key);
+	}
+	for(int k=0; k<10; k++) ht_builder_add(&builder, keys[k], NULL);
+	struct hash_table tab = ht_builder_finish(&builder);
+	struct hash_table* table = &tab;
+	assert(HTHEADER(table)->bucket_count == 16);
+	assert(HTHEADER(table)->filled == 10);
+	for(int k=0; k<10; k++) assert(ht_lookup(table, keys[k]) >= 0);
+	mem_abandon(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test10 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Remove keys from hash tables and multi-maps, and check that the remaining keys can still be found */
+int test11() {
+	int n = 100000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS, HT_SHRINK, HT_SWISS | HT_SHRINK};
+	for(int f=0; f<5; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		// remove all keys except every 16th, and some keys twice
+		for(int i=0; i<n; i++) {
+			if(i % 16 == 0) continue;
+			MAKEKEY(i);
+			assert(ht_remove(table, key));
+			if(i % 7 == 0) assert(!ht_remove(table, key));
+		}
+		assert(HTHEADER(table)->filled == n / 16);
+		ht_check(table);
+		mem_check(mem);
+		// with HT_SHRINK, there are at most 4 times as many buckets as necessary
+		if(flags[f] & HT_SHRINK) assert(HTHEADER(table)->bucket_count <= 8 * n / 16);
+		else assert(HTHEADER(table)->bucket_count > 8 * n / 16);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert((pos >= 0) == (i % 16 == 0));
+			if(pos >= 0) assert(*(uint64_t*)ht_value(table, pos) == i);
+		}
+
+		// insert and remove keys repeatedly, so swiss tables need to get rid of deleted buckets
+		for(int round=0; round<20; round++) {
+			for(int i=n; i<n+n/4; i++) {
+				MAKEKEY(i);
+				*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+			}
+			for(int i=n; i<n+n/4; i++) {
+				MAKEKEY(i);
+				assert(ht_remove(table, key));
+			}
+		}
+		assert(HTHEADER(table)->filled == n / 16);
+		ht_check(table);
+		mem_abandon(mem);
+	}
+
+	// the last string of the arena is reused
+	struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+	struct hash_table tab = ht_init(mem, 0);
+	struct hash_table* table = &tab;
+	ht_insert_str(table, "first");
+	MEMPTR str_pos = mem->header->str_pos;
+	ht_insert_str(table, "second");
+	ht_remove(table, "second");
+	assert(mem->header->str_pos == str_pos && mem->header->str_garbage == 0);
+	ht_insert_str(table, "third");
+	ht_remove(table, "first");
+	assert(mem->header->str_garbage == strlen("first") + 1 + sizeof(uint32_t));
+	mem_abandon(mem);
+
+	// multi-maps
+	mem = mem_create("/tmp/diskmap_test", 4000);
+	tab = ht_init(mem, sizeof(MEMPTR));
+	int keys = 100;
+	for(int i=0; i<keys; i++) {
+		MAKEKEY(i);
+		for(int j=0; j<=i; j++) {
+			MAKEVAL(j);
+			multimap_insert_key_val(table, key, val);
+		}
+	}
+	// removing the only value removes the key
+	multimap_insert_key_val(table, "single", "value");
+	assert(multimap_remove_key_val(table, "single", "value"));
+	assert(ht_lookup(table, "single") < 0);
+	for(int i=0; i<keys; i++) {
+		MAKEKEY(i);
+		if(i % 2 == 0) assert(multimap_remove_key(table, key));
+		else {
+			MAKEVAL(0);
+			assert(multimap_remove_key_val(table, key, val));
+			assert(!multimap_remove_key_val(table, key, val));
+		}
+	}
+	for(int i=0; i<keys; i++) {
+		MAKEKEY(i);
+		int64_t pos = ht_lookup(table, key);
+		assert((pos >= 0) == (i % 2 == 1));
+		if(pos >= 0) {
+			struct hash_table values = multimap_get(mem, ht_value(table, pos));
+			assert(HTHEADER(&values)->filled == i);
+		}
+	}
+	mem_check(mem);
+	mem_abandon(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test11 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
 int key_buckets() {
 //	// print last bits of hash for some keys
 //	for(int i=0; i<1000; i++) {
@@ -155,9 +676,1328 @@ int key_buckets() {
 //	}
 }
 
+/** A reader process looks up keys, while the writer process keeps inserting and resizing */
+int test12() {
+	int n = 200000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS};
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n/2; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		mem_set_root(mem, "table", table->header_ptr);
+		mem_sync(mem);
+
+		pid_t pid = fork();
+		assert(pid >= 0);
+		if(pid == 0) {
+			struct mem* reader = mem_open_reader("/tmp/diskmap_test");
+			struct hash_table shared = ht_open(reader, mem_get_root(reader, "table"));
+			for(int round=0; round<5; round++) {
+				for(int i=0; i<n/2; i++) {
+					MAKEKEY(i);
+					uint64_t value;
+					if(!ht_lookup_shared(&shared, key, &value) || value != i) _exit(1);
+				}
+				if(ht_lookup_shared(&shared, "not a key", NULL)) _exit(1);
+			}
+			mem_close(reader);
+			_exit(0);
+		}
+
+		for(int i=n/2; i<2*n; i++) {
+			MAKEKEY(i);
+			mem_write_begin(mem);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+			mem_write_end(mem);
+		}
+		int status;
+		assert(waitpid(pid, &status, 0) == pid);
+		assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+		ht_check(table);
+		mem_close(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test12 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Thread of test13, inserting every n-th key into a sharded hash map */
+struct test13_job {
+	struct sharded_map* map;
+	int from, n, step;
+};
+
+void* test13_insert(void* arg) {
+	struct test13_job* job = arg;
+	for(int i=job->from; i<job->n; i+=job->step) {
+		MAKEKEY(i);
+		uint64_t value = i;
+		sharded_insert_str(job->map, key, &value);
+	}
+	return NULL;
+}
+
+/** Insert into sharded maps from several threads, iterate over all shards, and reopen them */
+int test13() {
+	int n = 200000, shards = 16, threads = 8;
+	char file[64];
+	for(int i=0; i<shards; i++) {
+		sprintf(file, "/tmp/diskmap_shard.%d", i);
+		unlink(file);
+	}
+
+	// hash map, threads insert concurrently through the locks
+	struct sharded_map* map = sharded_open("/tmp/diskmap_shard", shards, sizeof(uint64_t), HT_INLINE_KEYS);
+	assert(map != NULL);
+	pthread_t ids[threads];
+	struct test13_job jobs[threads];
+	for(int t=0; t<threads; t++) {
+		jobs[t] = (struct test13_job){map, t, n, threads};
+		assert(pthread_create(&ids[t], NULL, test13_insert, &jobs[t]) == 0);
+	}
+	for(int t=0; t<threads; t++) pthread_join(ids[t], NULL);
+	size_t count = 0;
+	SHARDEDFOREACH(map, it) {
+		char* key = ht_key(it.table, it.idx);
+		assert(sharded_shard(map, key)->table.header_ptr == it.table->header_ptr);
+		count++;
+	}
+	assert(count == n);
+	for(int s=0; s<shards; s++) {
+		struct hash_table* table = &map->shards[s].table;
+		assert(HTHEADER(table)->filled > 0);
+	}
+	sharded_close(map);
+
+	map = sharded_open("/tmp/diskmap_shard", shards, sizeof(uint64_t), HT_INLINE_KEYS);
+	for(int i=0; i<n; i++) {
+		MAKEKEY(i);
+		uint64_t value;
+		assert(sharded_lookup(map, key, &value));
+		assert(value == i);
+	}
+	assert(!sharded_lookup(map, "not a key", NULL));
+	sharded_close(map);
+
+	// multi-map, every shard is filled by one thread
+	for(int i=0; i<shards; i++) {
+		sprintf(file, "/tmp/diskmap_shard.%d", i);
+		unlink(file);
+	}
+	map = sharded_open("/tmp/diskmap_shard", shards, sizeof(MEMPTR), 0);
+	int keys = n / 4;
+	char** key_list = malloc(n * sizeof(char*));
+	char** val_list = malloc(n * sizeof(char*));
+	for(int i=0; i<n; i++) {
+		key_list[i] = malloc(32);
+		val_list[i] = malloc(32);
+		sprintf(key_list[i], "key%d", i % keys);
+		sprintf(val_list[i], "val%d", i);
+	}
+	sharded_multimap_insert_parallel(map, key_list, val_list, n, threads);
+	sharded_multimap_insert_key_val(map, "key0", "val0");
+	count = 0;
+	size_t val_count = 0;
+	SHARDEDFOREACH(map, it) {
+		struct hash_table values = multimap_get(it.table->mem, ht_value(it.table, it.idx));
+		struct hash_table* table = &values;
+		assert(HTHEADER(table)->filled == n / keys);
+		val_count += HTHEADER(table)->filled;
+		count++;
+	}
+	assert(count == keys);
+	assert(val_count == n);
+	for(int i=0; i<n; i++) {
+		struct map_shard* shard = sharded_shard(map, key_list[i]);
+		int64_t pos = ht_lookup(&shard->table, key_list[i]);
+		assert(pos >= 0);
+		struct hash_table values = multimap_get(shard->mem, ht_value(&shard->table, pos));
+		assert(ht_lookup(&values, val_list[i]) >= 0);
+		free(key_list[i]);
+		free(val_list[i]);
+	}
+	free(key_list);
+	free(val_list);
+	sharded_close(map);
+
+	printf("********************************************************************************\n");
+	printf("*** test13 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Check that every byte that differs from the copy 'old' (of old_size bytes) is in a dirty range of mem */
+void check_dirty(struct mem* mem, char* old, size_t old_size) {
+	char* now = (char*)mem->header;
+	static char zeros[MEM_DIRTY_RANGE];
+	for(size_t pos=MEM_DIRTY_RANGE; pos<mem->header->size; pos+=MEM_DIRTY_RANGE) {
+		if(mem_is_dirty(mem, pos)) continue;
+		size_t len = min(MEM_DIRTY_RANGE, mem->header->size - pos);
+		size_t len_old = pos < old_size ? min(len, old_size - pos) : 0;
+		assert(memcmp(now + pos, old + pos, len_old) == 0);
+		assert(memcmp(now + pos + len_old, zeros, len - len_old) == 0);
+	}
+}
+
+/** Track changed ranges, and flush only them */
+int test14() {
+	int n = 100000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS | HT_SHRINK};
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		struct hash_table multi = ht_init_flags(mem, sizeof(MEMPTR), flags[f]);
+		mem_set_root(mem, "table", table->header_ptr);
+		mem_set_root(mem, "multi", multi.header_ptr);
+		mem_commit(mem);
+		assert(mem_dirty_size(mem) == 0);
+
+		// few changes, few dirty ranges
+		for(int i=0; i<10; i++) {
+			MAKEKEY(i * 1000);
+			*(uint64_t*)ht_value(table, ht_lookup(table, key)) = i;
+		}
+		assert(mem_dirty_size(mem) > 0 && mem_dirty_size(mem) <= 10 * MEM_DIRTY_RANGE);
+
+		// every changed byte is in a dirty range: inserting with resizes, removing, multi-maps
+		for(int round=0; round<3; round++) {
+			mem_commit(mem);
+			size_t old_size = mem->header->size;
+			char* old = malloc(old_size);
+			memcpy(old, mem->header, old_size);
+			for(int i=0; i<n; i++) {
+				MAKEKEY(i);
+				if(round == 0) *(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+				if(round == 1 && i % 3 == 0) ht_remove(table, key);
+				MAKEVAL(i);
+				if(i % 100 == round) multimap_insert_key_val(&multi, key, val);
+			}
+			for(int i=0; i<n && round == 2; i++) {
+				MAKEKEY(n + i);
+				*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+			}
+			for(int i=0; i<n; i+=200) {
+				MAKEKEY(i);
+				MAKEVAL(i);
+				if(round == 2) multimap_remove_key_val(&multi, key, val);
+			}
+			check_dirty(mem, old, old_size);
+			free(old);
+		}
+
+		// periodic flushing, every change starts writing immediately
+		mem_set_durability(mem, MEM_DURABILITY_PERIODIC, 0);
+		ht_insert_str(table, "periodic");
+		assert(mem_dirty_size(mem) == 0);
+
+		// no flush on close, but the data still reaches the file
+		mem_set_durability(mem, MEM_DURABILITY_NONE, 0);
+		ht_insert_str(table, "none");
+		assert(mem_dirty_size(mem) > 0);
+		mem_close(mem);
+		mem = mem_open("/tmp/diskmap_test", 4000);
+		tab = ht_open(mem, mem_get_root(mem, "table"));
+		assert(ht_lookup(table, "periodic") >= 0);
+		assert(ht_lookup(table, "none") >= 0);
+		for(int i=1; i<n; i+=3) {
+			MAKEKEY(i);
+			assert(*(uint64_t*)ht_value(table, ht_lookup(table, key)) == i);
+		}
+		mem_close(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test14 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Iterate with cursors, compare with HTFOREACH, and nest loops */
+int test15() {
+	int n = 100000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS};
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		HTITER(table, it) assert(false);
+		for(int count=0; count<n; count = count * 2 + 1) {
+			for(int i=0; i<n; i++) {
+				MAKEKEY(i);
+				if(i < count) *(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+				else if(i % 2 == 0) ht_remove(table, key);
+			}
+			// visits the same buckets as HTFOREACH, in the same order
+			struct ht_iter expected = ht_iter(table);
+			size_t visited = 0;
+			HTFOREACH(table) {
+				assert(ht_iter_next(&expected));
+				assert(expected.idx == i);
+				visited++;
+			}
+			assert(!ht_iter_next(&expected));
+			assert(visited == HTHEADER(table)->filled);
+		}
+
+		// nested loops over a small table visit all pairs
+		struct hash_table small = ht_init_flags(mem, 0, flags[f]);
+		for(int i=0; i<50; i++) {
+			MAKEKEY(i);
+			ht_insert_str(&small, key);
+		}
+		size_t pairs = 0;
+		HTITER(&small, a) {
+			HTITER(&small, b) {
+				if(strcmp(ht_key(&small, a.idx), ht_key(&small, b.idx)) < 0) pairs++;
+			}
+		}
+		assert(pairs == 50 * 49 / 2);
+		mem_abandon(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test15 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Multi-maps whose values repeat, with and without interned strings */
+int test16() {
+	int n = 20000, values = 50, per_key = 10;
+	uint64_t flags[] = {0, HT_INTERN, HT_INTERN | HT_SWISS, HT_INTERN | HT_INLINE_KEYS};
+	size_t used[4];
+	for(int f=0; f<4; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = ht_init_flags(mem, sizeof(MEMPTR), flags[f]);
+		struct hash_table* table = &tab;
+		char val[100];
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			for(int j=0; j<per_key; j++) {
+				sprintf(val, "a value that is shared by many keys %d", (i + j) % values);
+				multimap_insert_key_val(table, key, val);
+			}
+		}
+		mem_set_root(mem, "table", table->header_ptr);
+		used[f] = mem->header->top;
+
+		// all tables of the file share the strings
+		struct hash_table other = ht_init_flags(mem, 0, flags[f]);
+		ht_insert_str(&other, "key0");
+		for(int i=0; i<n; i+=1000) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert(pos >= 0);
+			struct hash_table vals = multimap_get(mem, ht_value(table, pos));
+			assert(HTHEADER(&vals)->filled == per_key);
+			for(int j=0; j<per_key; j++) {
+				sprintf(val, "a value that is shared by many keys %d", (i + j) % values);
+				int64_t val_pos = ht_lookup(&vals, val);
+				assert(val_pos >= 0);
+				if(f > 0) assert(ht_bucket(&vals, val_pos)->keyptr == ht_intern_lookup(mem, val, hash(val)));
+			}
+			assert(ht_lookup(&vals, "a value that is shared by many keys 1000") < 0);
+		}
+		if(f > 0) {
+			assert(ht_bucket(&other, ht_lookup(&other, "key0"))->keyptr == ht_bucket(table, ht_lookup(table, "key0"))->keyptr);
+		}
+		assert(ht_lookup(table, "never inserted") < 0);
+
+		// removing keys does not free interned strings
+		for(int i=0; i<n; i+=2) {
+			MAKEKEY(i);
+			assert(multimap_remove_key(table, key));
+		}
+		// the interned strings are found again after reopening
+		mem_close(mem);
+		mem = mem_open("/tmp/diskmap_test", 4000);
+		tab = ht_open(mem, mem_get_root(mem, "table"));
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			assert((pos >= 0) == (i % 2 == 1));
+			if(pos >= 0) {
+				for(int j=0; j<per_key; j++) {
+					sprintf(val, "a value that is shared by many keys %d", (i + j) % values);
+					multimap_insert_key_val(table, key, val);
+				}
+				struct hash_table vals = multimap_get(mem, ht_value(table, ht_lookup(table, key)));
+				assert(HTHEADER(&vals)->filled == per_key);
+			}
+		}
+		mem_close(mem);
+	}
+	// every value was stored n * per_key times without interning, but only once with it
+	assert(used[1] < used[0] * 3 / 4);
+
+	printf("********************************************************************************\n");
+	printf("*** test16 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Multi-maps with small value sets stored without nested tables */
+int test17() {
+	int n = 20000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INTERN, HT_INLINE_KEYS};
+	for(int f=0; f<4; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = multimap_init(mem, flags[f]);
+		struct hash_table* table = &tab;
+		// key i has i % 20 + 1 values: single values, arrays, and nested tables
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			for(int j=0; j<=i % 20; j++) {
+				char val[100];
+				sprintf(val, "val%d", j);
+				multimap_insert_key_val(table, key, val);
+				multimap_insert_key_val(table, key, val);
+			}
+		}
+		// a value that resides in the memory mapped file
+		multimap_insert_key_val(table, "key0", ht_key(table, ht_lookup(table, "key1")));
+		assert(multimap_count(table, ht_lookup(table, "key0")) == 2);
+		assert(multimap_remove_key_val(table, "key0", "key1"));
+
+		for(int round=0; round<2; round++) {
+			for(int i=0; i<n; i++) {
+				MAKEKEY(i);
+				int64_t pos = ht_lookup(table, key);
+				assert(pos >= 0);
+				size_t expected = max(i % 20 + 1 - round, 1);
+				assert(multimap_count(table, pos) == expected);
+				uint32_t seen = 0;
+				MULTIMAP_FOREACH(table, pos, it) {
+					int j = atoi(it.val + 3);
+					assert(j > 0 || round == 0);
+					assert(!(seen & (1 << j)));
+					seen |= 1 << j;
+				}
+				assert(__builtin_popcount(seen) == expected);
+			}
+			// remove the first value of each key, the key disappears with its last value
+			for(int i=0; i<n && round == 0; i++) {
+				MAKEKEY(i);
+				assert(multimap_remove_key_val(table, key, "val0"));
+				assert(!multimap_remove_key_val(table, key, "val0"));
+				if(i % 20 == 0) {
+					assert(ht_lookup(table, key) < 0);
+					// keep the key for the next round
+					multimap_insert_key_val(table, key, "val1");
+				}
+			}
+		}
+		for(int i=0; i<n; i+=3) {
+			MAKEKEY(i);
+			assert(multimap_remove_key(table, key));
+			assert(ht_lookup(table, key) < 0);
+		}
+		mem_check(mem);
+		mem_abandon(mem);
+	}
+
+	// promoting a small set to a nested table keeps the value strings in place
+	for(int f=0; f<2; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = multimap_init(mem, flags[f]);
+		struct hash_table* table = &tab;
+		char* key = "key";
+		for(int j=0; j<MULTIMAP_SMALL; j++) {
+			MAKEVAL(j);
+			multimap_insert_key_val(table, key, val);
+		}
+		struct multimap_array* array = (struct multimap_array*)HTMEMPTR(*(uint64_t*)ht_value(table, ht_lookup(table, "key")) & ~MULTIMAP_TAGS);
+		MEMPTR first = array->vals[0];
+		uint64_t str_pos = mem->header->str_pos, str_garbage = mem->header->str_garbage;
+		multimap_insert_key_val(table, "key", "another");
+		struct hash_table values = multimap_get(mem, ht_value(table, ht_lookup(table, "key")));
+		assert(HTHEADER(&values)->filled == MULTIMAP_SMALL + 1);
+		assert(ht_bucket(&values, ht_lookup(&values, HTMEMPTR(first)))->keyptr == first);
+		assert(mem->header->str_garbage == str_garbage && mem->header->str_pos == str_pos + strlen("another") + 1 + sizeof(uint32_t));
+		mem_check(mem);
+		mem_abandon(mem);
+	}
+
+	// most keys with few values: fewer bytes than with a nested table per key
+	size_t used[2];
+	for(int small=0; small<2; small++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = small ? multimap_init(mem, 0) : ht_init(mem, sizeof(MEMPTR));
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			for(int j=0; j<=i % 4; j++) {
+				MAKEVAL(j);
+				multimap_insert_key_val(&tab, key, val);
+			}
+		}
+		used[small] = mem->header->top;
+		mem_abandon(mem);
+	}
+	assert(used[1] < used[0] * 3 / 4);
+
+	printf("********************************************************************************\n");
+	printf("*** test17 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Append many values to a key at once */
+int test18() {
+	int n = 5000;
+	for(int f=0; f<4; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = f == 0 ? ht_init(mem, sizeof(MEMPTR)) : multimap_init(mem, f == 2 ? HT_SWISS : f == 3 ? HT_INTERN : 0);
+		struct hash_table* table = &tab;
+		char* vals[100];
+		for(int j=0; j<100; j++) vals[j] = malloc(32);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			// i % 30 values, each one twice; appended again for every third key
+			int k = i % 30;
+			for(int j=0; j<k; j++) sprintf(vals[j], "val%d", j / 2);
+			multimap_insert_key_vals(table, key, vals, k);
+			if(i % 3 == 0) {
+				for(int j=0; j<k; j++) sprintf(vals[j], "val%d", j);
+				multimap_insert_key_vals(table, key, vals, k);
+			}
+		}
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			int k = i % 30;
+			int expected = i % 3 == 0 ? k : (k + 1) / 2;
+			int64_t pos = ht_lookup(table, key);
+			assert((pos >= 0) == (k > 0));
+			if(k == 0) continue;
+			assert(multimap_count(table, pos) == expected);
+			uint64_t seen = 0;
+			MULTIMAP_FOREACH(table, pos, it) {
+				int j = atoi(it.val + 3);
+				assert(j < expected && !(seen & (1ULL << j)));
+				seen |= 1ULL << j;
+			}
+		}
+		// a nested table is allocated once with its final size
+		for(int j=0; j<100; j++) sprintf(vals[j], "val%d", j);
+		multimap_insert_key_vals(table, "big", vals, 100);
+		struct hash_table values = multimap_get(mem, ht_value(table, ht_lookup(table, "big")));
+		assert(HTHEADER(&values)->filled == 100);
+		assert(ht_max_filled(&values, HTHEADER(&values)->bucket_count / 2) < 100);
+#ifdef DISKMAP_STATS
+		// a new key with a small set: its insert is the only lookup (interned values are looked up as well)
+		if(f == 1 || f == 2) {
+			mem_reset_stats(mem);
+			multimap_insert_key_vals(table, "small", vals, MULTIMAP_SMALL);
+			assert(mem_get_stats(mem).lookups == 1);
+		}
+#endif
+		for(int j=0; j<100; j++) free(vals[j]);
+		mem_check(mem);
+		mem_abandon(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test18 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Tables created for an expected number of entries, and with other load factors */
+int test19() {
+	int n = 200000;
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS};
+	for(int f=0; f<3; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = ht_init_capacity(mem, sizeof(uint64_t), flags[f], n);
+		struct hash_table* table = &tab;
+		size_t bucket_count = HTHEADER(table)->bucket_count;
+		MEMPTR buckets_ptr = HTHEADER(table)->buckets_ptr;
+		assert(ht_max_filled(table, bucket_count) >= n && ht_max_filled(table, bucket_count / 2) < n);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		// no resize happened
+		assert(HTHEADER(table)->bucket_count == bucket_count);
+		assert(HTHEADER(table)->buckets_ptr == buckets_ptr);
+
+		// a lower load factor makes the table bigger, a reservation too
+		ht_set_max_load(table, 0.5);
+		assert(HTHEADER(table)->filled <= HTHEADER(table)->bucket_count / 2);
+		ht_reserve(table, 4 * n);
+		bucket_count = HTHEADER(table)->bucket_count;
+		assert(ht_max_filled(table, bucket_count) >= 4 * n);
+		ht_reserve(table, n);
+		assert(HTHEADER(table)->bucket_count == bucket_count);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			assert(*(uint64_t*)ht_value(table, ht_lookup(table, key)) == i);
+		}
+
+		// a high load factor keeps the table small
+		struct hash_table dense = ht_init_flags(mem, 0, flags[f]);
+		ht_set_max_load(&dense, 0.97);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			ht_insert_str(&dense, key);
+		}
+		ht_check(&dense);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			assert(ht_lookup(&dense, key) >= 0);
+		}
+		assert(HTHEADER(&dense)->filled > HTHEADER(&dense)->bucket_count * 0.6);
+
+		// load factors outside of (0, 1] are rejected
+		double invalid[] = {-0.5, 1.5, NAN};
+		for(int i=0; i<3; i++) {
+			fflush(stdout);
+			pid_t pid = fork();
+			assert(pid >= 0);
+			if(pid == 0) {
+				ht_set_max_load(&dense, invalid[i]);
+				_exit(0);
+			}
+			int status;
+			assert(waitpid(pid, &status, 0) == pid);
+			assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+		}
+		assert(HTHEADER(&dense)->max_load == 0.97);
+		mem_abandon(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test19 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Tables using wyhash, and inserting with precomputed hashes */
+int test20() {
+	int n = 100000;
+	// test vector of wyhash
+	assert(hash_wy_bytes("", 0) == 0x93228a4de0eec5a2ULL);
+	assert(hash_wy("abc") != hash_wy("abd") && hash_wy("abc") != hash("abc"));
+
+	uint64_t flags[] = {HT_WYHASH, HT_WYHASH | HT_SWISS, HT_WYHASH | HT_INLINE_KEYS, HT_WYHASH | HT_INTERN, HT_WYHASH | HT_MULTIMAP};
+	for(int f=0; f<5; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = flags[f] & HT_MULTIMAP ? multimap_init(mem, flags[f]) : ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		char long_key[300];
+		memset(long_key, 'x', sizeof(long_key) - 20);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			char* k = key;
+			if(i % 10 == 0) {
+				sprintf(long_key + sizeof(long_key) - 20, "%d", i);
+				k = long_key;
+			}
+			uint64_t h = ht_hash(table, k);
+			assert(h == hash_wy(k));
+			int64_t pos;
+			if(flags[f] & HT_MULTIMAP) {
+				multimap_insert_key_val(table, k, key);
+				pos = ht_lookup(table, k);
+			}
+			else {
+				pos = ht_insert_hashed(table, k, h);
+				*(uint64_t*)ht_value(table, pos) = i;
+			}
+			assert(ht_lookup_hashed(table, k, h) == pos);
+			assert(ht_insert_str(table, k) == pos);
+		}
+		mem_set_root(mem, "table", table->header_ptr);
+		mem_close(mem);
+
+		// the hash function is stored in the table header
+		mem = mem_open("/tmp/diskmap_test", 4000);
+		tab = ht_open(mem, mem_get_root(mem, "table"));
+		assert(HTHEADER(table)->filled == n);
+		for(int i=0; i<n; i++) {
+			MAKEKEY(i);
+			char* k = key;
+			if(i % 10 == 0) {
+				sprintf(long_key + sizeof(long_key) - 20, "%d", i);
+				k = long_key;
+			}
+			int64_t pos = ht_lookup(table, k);
+			assert(pos >= 0);
+			if(flags[f] & HT_MULTIMAP) {
+				MULTIMAP_FOREACH(table, pos, it) assert(strcmp(it.val, key) == 0);
+			}
+			else assert(*(uint64_t*)ht_value(table, pos) == i);
+		}
+		assert(ht_lookup(table, "not a key") < 0);
+		mem_close(mem);
+	}
+
+	// sharded maps pass the hash to the shard
+	struct sharded_map* map = sharded_open("/tmp/diskmap_shard_wy", 4, sizeof(uint64_t), HT_WYHASH);
+	for(uint64_t i=0; i<1000; i++) {
+		MAKEKEY(i);
+		sharded_insert_str(map, key, &i);
+	}
+	for(uint64_t i=0; i<1000; i++) {
+		MAKEKEY(i);
+		uint64_t value;
+		assert(sharded_lookup(map, key, &value) && value == i);
+	}
+	sharded_close(map);
+	for(int i=0; i<4; i++) {
+		char file[64];
+		sprintf(file, "/tmp/diskmap_shard_wy.%d", i);
+		unlink(file);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test20 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Binary keys with '\0' inside, and values of any length (HT_BLOB_VALUES) */
+int test21() {
+	int n = 50000;
+	assert(hash_bytes("abc", 3) == hash("abc") && hash_bytes("", 0) == hash(""));
+
+	uint64_t flags[] = {0, HT_INLINE_KEYS, HT_SWISS, HT_INTERN, HT_WYHASH | HT_INLINE_KEYS};
+	for(int f=0; f<5; f++) {
+		struct mem* mem = mem_create("/tmp/diskmap_test", 4000);
+		struct hash_table tab = ht_init_flags(mem, sizeof(uint64_t), flags[f] | HT_BLOB_VALUES);
+		struct hash_table* table = &tab;
+		for(uint64_t i=0; i<n; i++) {
+			// keys of 8 or 40 bytes, mostly 0 bytes; the value repeats the key (i % 100) times
+			uint64_t key[5] = {i, 0, 0, 0, 0};
+			size_t len = i % 2 == 0 ? 8 : sizeof(key);
+			int64_t pos = ht_insert_bytes(table, key, len);
+			assert(ht_lookup_bytes(table, key, len) == pos);
+			// a prefix of the key is another key
+			assert(len == 8 || ht_lookup_bytes(table, key, 8) != pos);
+			char value[100 * sizeof(key)];
+			for(int j=0; j<i%100; j++) memcpy(value + j * len, key, len);
+			ht_set_blob(table, pos, value, (i % 100) * len);
+		}
+		// strings are keys of their length
+		int64_t pos = ht_insert_str(table, "key");
+		assert(ht_lookup_bytes(table, "key", 3) == pos && ht_key_len(table, pos) == 3);
+		assert(ht_get_blob(table, pos, NULL) == NULL);
+		mem_set_root(mem, "table", table->header_ptr);
+		mem_close(mem);
+
+		mem = mem_open("/tmp/diskmap_test", 4000);
+		tab = ht_open(mem, mem_get_root(mem, "table"));
+		assert(HTHEADER(table)->filled == n + 1);
+		for(uint64_t i=0; i<n; i++) {
+			uint64_t key[5] = {i, 0, 0, 0, 0};
+			size_t len = i % 2 == 0 ? 8 : sizeof(key);
+			int64_t pos = ht_lookup_bytes(table, key, len);
+			assert(pos >= 0 && ht_key_len(table, pos) == len && memcmp(ht_key(table, pos), key, len) == 0);
+			size_t blob_len;
+			char* blob = ht_get_blob(table, pos, &blob_len);
+			assert(blob_len == (i % 100) * len);
+			for(int j=0; j<i%100; j++) assert(memcmp(blob + j * len, key, len) == 0);
+		}
+		// replace and remove values
+		for(uint64_t i=0; i<n; i+=2) {
+			uint64_t key[5] = {i, 0, 0, 0, 0};
+			int64_t pos = ht_lookup_bytes(table, key, 8);
+			if(i % 4 == 0) ht_set_blob(table, pos, "new value", 10);
+			else assert(ht_remove_bytes(table, key, 8));
+		}
+		for(uint64_t i=0; i<n; i+=2) {
+			uint64_t key[5] = {i, 0, 0, 0, 0};
+			int64_t pos = ht_lookup_bytes(table, key, 8);
+			if(i % 4 == 0) assert(strcmp(ht_get_blob(table, pos, NULL), "new value") == 0);
+			else assert(pos < 0);
+		}
+		uint64_t key[5] = {1, 0, 0, 0, 0};
+		assert(ht_lookup_shared_bytes(table, key, sizeof(key), NULL) && !ht_lookup_shared_bytes(table, key, 8, NULL));
+		ht_free(table);
+		mem_close(mem);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test21 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Access pattern hints, and opening files with warm-up */
+int test22() {
+	int n = 200000;
+	unlink("/tmp/diskmap_test_advise");
+	struct mem* mem = mem_open("/tmp/diskmap_test_advise", 4000);
+	struct hash_table tab = ht_init_flags(mem, sizeof(uint64_t), HT_HUGEPAGES);
+	struct hash_table* table = &tab;
+	struct hash_table swiss = ht_init_flags(mem, sizeof(uint64_t), HT_SWISS | HT_HUGEPAGES);
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		*(uint64_t*)ht_value(&swiss, ht_insert_str(&swiss, key)) = i;
+	}
+	assert(HTHEADER(table)->bucket_count * HTHEADER(table)->bucket_size >= HT_ADVISE_MIN);
+	size_t count = 0, nested = 0;
+	HTITER(table, it) count++;
+	HTFOREACH(&swiss) count++;
+	assert(count == 2 * n);
+	// hints for ranges at the end of the mapping, or beyond it
+	mem_advise(mem, mem->header->size - 10, 100, MADV_WILLNEED);
+	mem_advise(mem, mem->header->size + 4096, 100, MADV_WILLNEED);
+	mem_set_root(mem, "table", table->header_ptr);
+	mem_set_root(mem, "swiss", swiss.header_ptr);
+	mem_close(mem);
+
+	// after opening with MEM_POPULATE, the whole file is in memory
+	mem = mem_open_flags("/tmp/diskmap_test_advise", 4000, MEM_POPULATE | MEM_WILLNEED);
+	size_t page = sysconf(_SC_PAGESIZE), pages = (mem->mapped_size + page - 1) / page;
+	unsigned char* resident = malloc(pages);
+	assert(mincore(mem->header, mem->mapped_size, resident) == 0);
+	for(size_t i=0; i<pages; i++) assert(resident[i] & 1);
+	free(resident);
+	tab = ht_open(mem, mem_get_root(mem, "table"));
+	ht_advise(table, MADV_RANDOM);
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		assert(*(uint64_t*)ht_value(table, ht_lookup(table, key)) == i);
+	}
+	mem_close(mem);
+
+	mem = mem_open_reader_flags("/tmp/diskmap_test_advise", MEM_WILLNEED);
+	swiss = ht_open(mem, mem_get_root(mem, "swiss"));
+	ht_advise(&swiss, MADV_RANDOM);
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		uint64_t value;
+		assert(ht_lookup_shared(&swiss, key, &value) && value == i);
+	}
+	HTITER(&swiss, it) nested++;
+	assert(nested == n);
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test22 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** Compact a file with tables of all kinds, and check that the copies contain the same keys and values */
+int test23() {
+	int n = 20000;
+	unlink("/tmp/diskmap_test_compact");
+	struct mem* mem = mem_open("/tmp/diskmap_test_compact", 4000);
+	uint64_t flags[] = {0, HT_SWISS, HT_INLINE_KEYS | HT_SHRINK, HT_INTERN | HT_WYHASH, HT_BLOB_VALUES};
+	char* names[] = {"plain", "swiss", "inline", "intern", "blob"};
+	struct hash_table tables[5];
+	for(int f=0; f<5; f++) tables[f] = ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+	struct hash_table small = multimap_init(mem, 0);
+	struct hash_table nested = ht_init(mem, sizeof(MEMPTR));
+	struct hash_table* table = &nested;
+	for(uint64_t i=0; i<2*n; i++) {
+		MAKEKEY(i);
+		for(int f=0; f<5; f++) {
+			int64_t pos = ht_insert_str(&tables[f], key);
+			if(flags[f] & HT_BLOB_VALUES) ht_set_blob(&tables[f], pos, key, strlen(key));
+			else *(uint64_t*)ht_value(&tables[f], pos) = i;
+		}
+		// sets of 1, 3, and 20 values
+		if(i < n) {
+			for(int j=0; j<(i%3 == 0 ? 1 : i%3 == 1 ? 3 : 20); j++) {
+				char val[32];
+				sprintf(val, "val%d", j);
+				multimap_insert_key_val(&small, key, val);
+				multimap_insert_key_val(&nested, key, val);
+			}
+		}
+	}
+	// leave garbage behind
+	for(uint64_t i=n; i<2*n; i++) {
+		MAKEKEY(i);
+		for(int f=0; f<5; f++) assert(ht_remove(&tables[f], key));
+	}
+	for(int f=0; f<5; f++) mem_set_root(mem, names[f], tables[f].header_ptr);
+	mem_set_root(mem, "small", small.header_ptr);
+	mem_set_root(mem, "nested", nested.header_ptr);
+	mem_close(mem);
+
+	char* nested_roots[] = {"nested"};
+	assert(mem_compact("/tmp/diskmap_test_compact", "/tmp/diskmap_test_compacted", nested_roots, 1));
+	struct stat src_info, dst_info;
+	assert(stat("/tmp/diskmap_test_compact", &src_info) == 0 && stat("/tmp/diskmap_test_compacted", &dst_info) == 0);
+	assert(dst_info.st_size < src_info.st_size);
+
+	mem = mem_open("/tmp/diskmap_test_compacted", 4000);
+	assert(mem->header->str_garbage == 0);
+	for(int f=0; f<5; f++) {
+		struct hash_table tab = ht_open(mem, mem_get_root(mem, names[f]));
+		struct hash_table* table = &tab;
+		assert(HTHEADER(table)->filled == n && HTHEADER(table)->flags == flags[f]);
+		assert(HTHEADER(table)->tombstones == 0);
+		ht_check(table);
+		for(uint64_t i=0; i<2*n; i++) {
+			MAKEKEY(i);
+			int64_t pos = ht_lookup(table, key);
+			if(i >= n) assert(pos < 0);
+			else if(flags[f] & HT_BLOB_VALUES) assert(strcmp(ht_get_blob(table, pos, NULL), key) == 0);
+			else assert(*(uint64_t*)ht_value(table, pos) == i);
+		}
+		// keys are written in bucket order
+		if(flags[f] == 0) {
+			MEMPTR last = 0;
+			HTITER(table, it) {
+				assert(ht_bucket(table, it.idx)->keyptr > last);
+				last = ht_bucket(table, it.idx)->keyptr;
+			}
+		}
+		// the table still works
+		ht_insert_str(table, "new key");
+		assert(ht_lookup(table, "new key") >= 0);
+	}
+	small = ht_open(mem, mem_get_root(mem, "small"));
+	nested = ht_open(mem, mem_get_root(mem, "nested"));
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		size_t count = i%3 == 0 ? 1 : i%3 == 1 ? 3 : 20;
+		int64_t pos = ht_lookup(&small, key);
+		assert(multimap_count(&small, pos) == count);
+		size_t found = 0;
+		MULTIMAP_FOREACH(&small, pos, it) {
+			assert(strncmp(it.val, "val", 3) == 0 && atoi(it.val + 3) < count);
+			found++;
+		}
+		assert(found == count);
+		struct hash_table set = multimap_get(mem, ht_value(&nested, ht_lookup(&nested, key)));
+		assert(HTHEADER(&set)->filled == count);
+		for(int j=0; j<count; j++) {
+			char val[32];
+			sprintf(val, "val%d", j);
+			assert(ht_lookup(&set, val) >= 0);
+		}
+	}
+	mem_close(mem);
+
+	// roots must be hash tables
+	mem = mem_open("/tmp/diskmap_test_compact", 4000);
+	mem_set_root(mem, "not a table", mem_insert_str(mem, "some string"));
+	mem_close(mem);
+	assert(!mem_compact("/tmp/diskmap_test_compact", "/tmp/diskmap_test_compacted", NULL, 0));
+
+	// a file with data but without roots would be compacted into an empty file
+	mem = mem_create("/tmp/diskmap_test_compact", 4000);
+	struct hash_table rootless = ht_init(mem, sizeof(uint64_t));
+	ht_insert_str(&rootless, "unreachable");
+	mem_close(mem);
+	assert(!mem_compact("/tmp/diskmap_test_compact", "/tmp/diskmap_test_compacted", NULL, 0));
+
+	printf("********************************************************************************\n");
+	printf("*** test23 successful (n = %d, %ld -> %ld bytes)\n", n, (long)src_info.st_size, (long)dst_info.st_size);
+	printf("********************************************************************************\n");
+}
+
+/** statistics */
+int test24() {
+	int n = 50000;
+	unlink("/tmp/diskmap_test_stats");
+	struct mem* mem = mem_create("/tmp/diskmap_test_stats", 4000);
+	uint64_t flags[] = {0, HT_SWISS};
+	for(int f=0; f<2; f++) {
+		mem_reset_stats(mem);
+		struct hash_table tab = ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(uint64_t i=0; i<n; i++) {
+			MAKEKEY(i);
+			*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		}
+		struct mem_stats ms = mem_get_stats(mem);
+#ifdef DISKMAP_STATS
+		// inserts look up the key first
+		assert(ms.inserts == n && ms.lookups == n && ms.lookup_misses == n);
+		size_t probes = 0;
+		for(int i=0; i<MEM_STATS_PROBES; i++) probes += ms.insert_probes[i];
+		assert(probes == n);
+		assert(ms.resizes > 0 && ms.allocs > 0 && ms.grows > 0);
+		mem_reset_stats(mem);
+#endif
+		for(uint64_t i=0; i<2*n; i++) {
+			MAKEKEY(i);
+			assert((ht_lookup(table, key) >= 0) == (i < n));
+		}
+
+		struct ht_stats ts = ht_get_stats(table);
+		assert(ts.filled == n && ts.bucket_count == HTHEADER(table)->bucket_count);
+		assert(ts.load > 0 && ts.load < 1 && ts.tombstones == 0);
+		size_t sum = 0;
+		for(int i=0; i<MEM_STATS_PROBES; i++) sum += ts.dist[i];
+		assert(sum == n && ts.mean_dist <= ts.max_dist);
+		if(flags[f] == 0) assert(ts.max_dist <= HTHEADER(table)->max_dist);
+
+		ms = mem_get_stats(mem);
+		assert(ms.file_size == mem->header->size && ms.used_size <= ms.file_size);
+		// replaced bucket arrays end up in the bins, or are merged into the unused space
+		assert(ms.free_bytes < ms.used_size);
+#ifdef DISKMAP_STATS
+		assert(ms.inserts == 0 && ms.lookups == 2*n && ms.lookup_misses == n);
+#else
+		assert(ms.inserts == 0 && ms.lookups == 0 && ms.resizes == 0);
+#endif
+		printf("%s: load %.2f, mean probe length %.2f, max %zu, %zu free blocks (%zu bytes)\n", 
+				flags[f] ? "swiss" : "robin hood", ts.load, ts.mean_dist, ts.max_dist, ms.free_blocks, ms.free_bytes);
+	}
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test24 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** snapshots with a minimal perfect hash */
+int test25() {
+	int n = 100000;
+	unlink("/tmp/diskmap_test_snapshot");
+	struct mem* mem = mem_create("/tmp/diskmap_test_snapshot", 4000);
+	uint64_t flags[] = {0, HT_SWISS | HT_INLINE_KEYS, HT_WYHASH, HT_BLOB_VALUES, HT_MULTIMAP, 0};
+	uint64_t copy_flags[] = {0, 0, 0, 0, 0, HT_COPY_NESTED};
+	for(int f=0; f<6; f++) {
+		struct hash_table tab = ht_init_flags(mem, sizeof(uint64_t), flags[f]);
+		struct hash_table* table = &tab;
+		for(uint64_t i=0; i<n; i++) {
+			MAKEKEY(i);
+			if(flags[f] & HT_MULTIMAP || copy_flags[f]) {
+				for(int j=0; j<=i%3; j++) {
+					char val[32];
+					sprintf(val, "val%d", j);
+					multimap_insert_key_val(table, key, val);
+				}
+				continue;
+			}
+			// binary keys with '\0' inside
+			int64_t pos = flags[f] & HT_WYHASH ? ht_insert_bytes(table, &i, sizeof(i)) : ht_insert_str(table, key);
+			if(flags[f] & HT_BLOB_VALUES) ht_set_blob(table, pos, key, strlen(key));
+			else *(uint64_t*)ht_value(table, pos) = i;
+		}
+		assert(snapshot_write(table, "/tmp/diskmap_test_snapshot.snap", copy_flags[f]));
+
+		struct snapshot* snap = snapshot_open("/tmp/diskmap_test_snapshot.snap", f == 0 ? MEM_POPULATE : 0);
+		assert(snap != NULL && snapshot_count(snap) == n);
+		for(uint64_t i=0; i<2*n; i++) {
+			MAKEKEY(i);
+			int64_t idx = flags[f] & HT_WYHASH ? snapshot_lookup_bytes(snap, &i, sizeof(i)) : snapshot_lookup(snap, key);
+			if(i >= n) {
+				assert(idx < 0);
+				continue;
+			}
+			assert(idx >= 0 && idx < n);
+			size_t len;
+			void* value = snapshot_value(snap, idx, &len);
+			if(flags[f] & HT_BLOB_VALUES) assert(len == strlen(key) && memcmp(value, key, len) == 0);
+			else if(flags[f] & HT_MULTIMAP || copy_flags[f]) {
+				assert(len == i%3 + 1);
+				size_t found = 0;
+				SNAPSHOT_FOREACH(snap, idx, it) {
+					assert(strncmp(it.val, "val", 3) == 0 && atoi(it.val + 3) <= i%3 && it.len == strlen(it.val));
+					found++;
+				}
+				assert(found == len);
+			}
+			else assert(len == sizeof(uint64_t) && *(uint64_t*)value == i);
+		}
+		// every entry is found at its own index
+		for(int64_t idx=0; idx<n; idx++) {
+			size_t len;
+			char* key = snapshot_key(snap, idx, &len);
+			assert(snapshot_lookup_bytes(snap, key, len) == idx);
+		}
+		snapshot_close(snap);
+	}
+	mem_close(mem);
+
+	// a map alone, compared to its file
+	unlink("/tmp/diskmap_test_snapshot");
+	mem = mem_create("/tmp/diskmap_test_snapshot", 4000);
+	struct hash_table tab = ht_init(mem, sizeof(uint64_t));
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		*(uint64_t*)ht_value(&tab, ht_insert_str(&tab, key)) = i;
+	}
+	assert(snapshot_write(&tab, "/tmp/diskmap_test_snapshot.snap", 0));
+	size_t used = mem_get_stats(mem).used_size;
+	mem_close(mem);
+	struct snapshot* snap = snapshot_open("/tmp/diskmap_test_snapshot.snap", 0);
+	size_t size = snap->header->size;
+	assert(size < used);
+
+	// empty tables, and files that are not snapshots. The open snapshot is replaced, not overwritten
+	mem = mem_create("/tmp/diskmap_test_snapshot", 4000);
+	tab = ht_init(mem, sizeof(uint64_t));
+	assert(snapshot_write(&tab, "/tmp/diskmap_test_snapshot.snap", 0));
+	mem_close(mem);
+	assert(access("/tmp/diskmap_test_snapshot.snap.tmp", F_OK) != 0);
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		int64_t idx = snapshot_lookup(snap, key);
+		assert(idx >= 0 && *(uint64_t*)snapshot_value(snap, idx, NULL) == i);
+	}
+	snapshot_close(snap);
+	snap = snapshot_open("/tmp/diskmap_test_snapshot.snap", 0);
+	assert(snapshot_count(snap) == 0 && snapshot_lookup(snap, "key") < 0);
+	snapshot_close(snap);
+	assert(snapshot_open("/tmp/diskmap_test_snapshot", 0) == NULL);
+	assert(snapshot_open("/tmp/diskmap_test_does_not_exist", 0) == NULL);
+
+	printf("********************************************************************************\n");
+	printf("*** test25 successful (n = %d, %zu bytes in the file, %zu bytes in the snapshot)\n", n, used, size);
+	printf("********************************************************************************\n");
+}
+
+/** background flushing */
+int test26() {
+	int n = 200000;
+	unlink("/tmp/diskmap_test_background");
+	struct mem* mem = mem_create("/tmp/diskmap_test_background", 4000);
+	// the limit is kept until the thread starts
+	size_t limit = 1 << 20;
+	mem_set_dirty_limit(mem, limit);
+	mem_set_durability(mem, MEM_DURABILITY_BACKGROUND, 20);
+	struct hash_table tab = ht_init(mem, sizeof(uint64_t));
+	struct hash_table* table = &tab;
+	mem_set_root(mem, "table", table->header_ptr);
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		mem_write_begin(mem);
+		*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+		mem_write_end(mem);
+		// back-pressure
+		assert(mem_dirty_size(mem) <= limit);
+	}
+	double rate = ops_per_second(n, &start);
+
+	// the thread writes the changes without being asked
+	for(int i=0; i<100 && mem_dirty_size(mem) > 0; i++) usleep(10000);
+	assert(mem_dirty_size(mem) == 0);
+
+	// back to the default, which stops the thread, so changes stay dirty
+	mem_set_durability(mem, MEM_DURABILITY_COMMIT, 0);
+	assert(mem->flusher == NULL);
+	MAKEKEY(n);
+	ht_insert_str(table, key);
+	assert(mem_dirty_size(mem) > 0);
+
+	// a new thread writes them on mem_commit(...). With an interval of 0, it does not spin
+	mem_set_durability(mem, MEM_DURABILITY_BACKGROUND, 0);
+	mem_commit(mem);
+	assert(mem_dirty_size(mem) == 0);
+	clock_t cpu = clock();
+	usleep(200000);
+	assert(clock() - cpu < CLOCKS_PER_SEC / 100);
+	mem_close(mem);
+
+	mem = mem_open("/tmp/diskmap_test_background", 4000);
+	tab = ht_open(mem, mem_get_root(mem, "table"));
+	for(uint64_t i=0; i<=n; i++) {
+		MAKEKEY(i);
+		int64_t pos = ht_lookup(table, key);
+		assert(pos >= 0 && (i == n || *(uint64_t*)ht_value(table, pos) == i));
+	}
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test26 successful (n = %d, %.0f inserts per second)\n", n, rate);
+	printf("********************************************************************************\n");
+}
+
+/** segmented tables (extendible hashing) */
+int test27() {
+	int n = 300000;
+	unlink("/tmp/diskmap_test_segmented");
+	struct mem* mem = mem_create("/tmp/diskmap_test_segmented", 4000);
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint64_t flags[] = {0, HT_INLINE_KEYS | HT_WYHASH, HT_INTERN, HT_BLOB_VALUES};
+	char* names[] = {"plain", "inline", "intern", "blob"};
+	for(int f=0; f<4; f++) {
+		struct segmented_table map = segmented_init(mem, sizeof(uint64_t), flags[f]);
+		mem_set_root(mem, names[f], map.header_ptr);
+		struct hash_table segment;
+		size_t segments = 1;
+		for(uint64_t i=0; i<n; i++) {
+			MAKEKEY(i);
+			int64_t pos = segmented_insert_str(&map, key, &segment);
+			if(flags[f] & HT_BLOB_VALUES) ht_set_blob(&segment, pos, key, strlen(key));
+			else *(uint64_t*)ht_value(&segment, pos) = i;
+			// growing copies at most one segment
+			assert(segmented_header(&map)->segment_count <= segments + 1);
+			segments = segmented_header(&map)->segment_count;
+		}
+		assert(segmented_insert_str(&map, "key0", &segment) >= 0 && segmented_header(&map)->filled == n);
+		struct segmented_header* header = segmented_header(&map);
+		assert(header->segment_count > 1 && header->segment_count <= (1ULL << header->global_depth));
+
+		// segments are page aligned, not bigger than SEGMENTED_SEGMENT_SIZE, and have their own part of the hashes
+		size_t total = 0;
+		for(size_t i=0; i<(1ULL << header->global_depth); i++) {
+			uint64_t entry = segmented_dir(&map)[i];
+			struct hash_table seg = {mem, entry & ((1ULL << SEGMENTED_DEPTH_SHIFT) - 1)};
+			struct hash_table* table = &seg;
+			assert(HTHEADER(table)->buckets_ptr % page == 0);
+			assert(HTHEADER(table)->bucket_count * HTHEADER(table)->bucket_size <= SEGMENTED_SEGMENT_SIZE);
+			size_t depth = entry >> SEGMENTED_DEPTH_SHIFT;
+			assert(depth <= header->global_depth);
+			if(i >= (1ULL << depth)) assert(entry == segmented_dir(&map)[i & ((1ULL << depth) - 1)]);
+			else total += HTHEADER(table)->filled;
+			HTITER(table, it) assert(((ht_bucket(table, it.idx)->hash >> 32) & ((1ULL << depth) - 1)) == (i & ((1ULL << depth) - 1)));
+		}
+		assert(total == n);
+		size_t visited = 0;
+		SEGMENTED_ITER(&map, it) {
+			assert(ht_bucket(&it.segment, it.idx)->hash != 0);
+			visited++;
+		}
+		assert(visited == n);
+
+		for(uint64_t i=0; i<2*n; i++) {
+			MAKEKEY(i);
+			int64_t pos = segmented_lookup(&map, key, &segment);
+			if(i >= n) assert(pos < 0);
+			else if(flags[f] & HT_BLOB_VALUES) assert(strcmp(ht_get_blob(&segment, pos, NULL), key) == 0);
+			else assert(pos >= 0 && *(uint64_t*)ht_value(&segment, pos) == i && strcmp(ht_key(&segment, pos), key) == 0);
+		}
+		for(uint64_t i=0; i<n; i+=2) {
+			MAKEKEY(i);
+			assert(segmented_remove(&map, key));
+			assert(!segmented_remove(&map, key));
+		}
+		assert(segmented_header(&map)->filled == n / 2);
+	}
+	mem_close(mem);
+
+	mem = mem_open("/tmp/diskmap_test_segmented", 4000);
+	struct segmented_table map = segmented_open(mem, mem_get_root(mem, "plain"));
+	struct hash_table segment;
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		int64_t pos = segmented_lookup(&map, key, &segment);
+		assert((pos >= 0) == (i % 2 == 1) && (pos < 0 || *(uint64_t*)ht_value(&segment, pos) == i));
+	}
+	// binary keys, without values
+	struct segmented_table small = segmented_init(mem, 0, 0);
+	for(uint64_t i=0; i<n/10; i++) {
+		uint64_t key = i;
+		segmented_insert_bytes(&small, &key, sizeof(key), &segment);
+	}
+	for(uint64_t i=0; i<n/10; i++) {
+		uint64_t key = i;
+		assert(segmented_lookup_bytes(&small, &key, sizeof(key), &segment) >= 0);
+	}
+	mem_close(mem);
+
+	// aligned blocks are ordinary blocks
+	mem = mem_create("/tmp/diskmap_test_segmented", 4000);
+	for(int i=0; i<100; i++) {
+		MEMPTR a = mem_alloc(mem, 100 + i), b = mem_alloc_aligned(mem, 1000 * i + 8, page), c = mem_alloc(mem, 50);
+		assert(b % page == 0);
+		memset(MEMPTR(b), i, 1000 * i + 8);
+		if(i % 2) mem_free(mem, a);
+		mem_free(mem, b);
+		if(i % 3) mem_free(mem, c);
+	}
+	struct mem_stats stats = mem_get_stats(mem);
+	assert(stats.free_bytes < stats.used_size);
+	mem_close(mem);
+
+	printf("********************************************************************************\n");
+	printf("*** test27 successful (n = %d)\n", n);
+	printf("********************************************************************************\n");
+}
+
+/** positions above 4 GB, in a sparse file. With DISKMAP_STRESS=n (default 2^31+1), also insert n keys into one table */
+int test28() {
+	int n = 100000;
+	char* file = "/tmp/diskmap_test_large";
+	unlink(file);
+	// bigger than an int
+	size_t initial_size = (size_t)3 << 30;
+	struct mem* mem = mem_create(file, initial_size);
+	mem_set_durability(mem, MEM_DURABILITY_NONE, 0);
+	assert(mem->header->size >= initial_size);
+	// not touched, so the file stays sparse
+	MEMPTR gap = mem_alloc(mem, (size_t)5 << 30);
+	assert(gap < (1ULL << 32) && mem->header->size > gap + ((size_t)5 << 30));
+
+	struct hash_table tab = ht_init_capacity(mem, sizeof(uint64_t), 0, n);
+	struct hash_table* table = &tab;
+	mem_set_root(mem, "table", table->header_ptr);
+	assert(table->header_ptr > (1ULL << 32) && HTHEADER(table)->buckets_ptr > (1ULL << 32));
+	for(uint64_t i=0; i<n; i++) {
+		MAKEKEY(i);
+		*(uint64_t*)ht_value(table, ht_insert_str(table, key)) = i;
+	}
+	assert(ht_bucket(table, ht_lookup(table, "key0"))->keyptr > (1ULL << 32));
+	mem_close(mem);
+
+	mem = mem_open(file, 4000);
+	tab = ht_open(mem, mem_get_root(mem, "table"));
+	assert(HTHEADER(table)->filled == n);
+	for(uint64_t i=0; i<2*n; i++) {
+		MAKEKEY(i);
+		int64_t pos = ht_lookup(table, key);
+		assert(i >= n ? pos < 0 : pos >= 0 && *(uint64_t*)ht_value(table, pos) == i);
+	}
+	mem_close(mem);
+	unlink(file);
+
+	// 2^32 buckets, needs about 100 GB of disk space
+	char* stress = getenv("DISKMAP_STRESS");
+	size_t count = 0;
+	if(stress != NULL) {
+		count = strtoull(stress, NULL, 10);
+		if(count == 0) count = (1ULL << 31) + 1;
+		mem = mem_create(file, 4000);
+		mem_set_durability(mem, MEM_DURABILITY_NONE, 0);
+		tab = ht_init_capacity(mem, 0, HT_INLINE_KEYS, count);
+		for(uint64_t i=0; i<count; i++) ht_insert_bytes(table, &i, sizeof(i));
+		assert(HTHEADER(table)->filled == count);
+		for(uint64_t i=0; i<count + count/16; i+=15) assert((ht_lookup_bytes(table, &i, sizeof(i)) >= 0) == (i < count));
+		size_t visited = 0;
+		HTITER(table, it) visited++;
+		assert(visited == count);
+		mem_close(mem);
+		unlink(file);
+	}
+
+	printf("********************************************************************************\n");
+	printf("*** test28 successful (n = %d, stress n = %zu)\n", n, count);
+	printf("********************************************************************************\n");
+}
+
 int main(int argc, char *argv[]) {
 	test1();
 	test2();
+	test3();
+	test4();
+	test5();
+	test6();
+	test7();
+	test8();
+	test9();
+	test10();
+	test11();
+	test12();
+	test13();
+	test14();
+	test15();
+	test16();
+	test17();
+	test18();
+	test19();
+	test20();
+	test21();
+	test22();
+	test23();
+	test24();
+	test25();
+	test26();
+	test27();
+	test28();
 	printf("all tests done, exiting\n");
 	return 0;
 }
@@ -0,0 +1,161 @@
+/*
+Diskmap - a hash map backed by a memory mapped file on disk
+Copyright (C) 2018  Thomas Rebele
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU Affero General Public License as
+published by the Free Software Foundation, either version 3 of the
+License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Affero General Public License for more details.
+
+You should have received a copy of the GNU Affero General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Tests of the C++ interface (diskmap.hpp). Compile diskmap.c as C and link it:
+//     gcc -c -Dmain=diskmap_main diskmap.c && g++ -std=c++17 diskmap_test.cpp diskmap.o -lpthread -lm && ./a.out
+
+#include "diskmap.hpp"
+
+#include <assert.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <set>
+#include <string>
+
+/** value that is not a multiple of 8 bytes, its buckets have 4 bytes of padding */
+struct point {
+	int32_t x, y, z;
+};
+
+/** maps with string keys and binary keys, inline keys, and swiss tables; reopening them from the roots of a file */
+template<uint64_t Flags>
+void test_table(const char* name) {
+	size_t n = 200000;
+	std::string path = std::string("/tmp/diskmap_test_cpp_") + name;
+	unlink(path.c_str());
+	{
+		diskmap::file f = diskmap::file::create(path);
+		auto strings = diskmap::table<std::string, point, Flags>::create(f);
+		auto numbers = diskmap::table<uint64_t, uint64_t, Flags>::create(f);
+		f.set_root("strings", strings.header_ptr());
+		f.set_root("numbers", numbers.header_ptr());
+		// the bucket layout known at compile time is the one of the C table
+		assert(ht_header(strings.c_table())->bucket_size == strings.bucket_size);
+		assert(ht_header(numbers.c_table())->bucket_size == numbers.bucket_size);
+		assert(strings.bucket_size == 8 + diskmap::detail::key_size(Flags) + 16);
+
+		for(size_t i=0; i<n; i++) {
+			std::string key = "key" + std::to_string(i);
+			int32_t x = i;
+			assert(strings.insert(key, point{x, -x, 2 * x}));
+			assert(!strings.insert(key, point{0, 0, 0}));
+			numbers.insert_or_assign(i, i);
+			numbers.insert_or_assign(i, 3 * i);
+		}
+		assert(strings.size() == n && numbers.size() == n);
+		for(size_t i=0; i<n; i+=2) assert(strings.erase("key" + std::to_string(i)) && numbers.erase(i));
+		assert(!strings.erase("key0") && !strings.contains("key0"));
+		f.commit();
+	}
+
+	// moving the handle keeps the file open
+	diskmap::file first = diskmap::file::open(path);
+	diskmap::file f = std::move(first);
+	assert(!first && f);
+	auto strings = diskmap::table<std::string, point, Flags>::open(f, f.root("strings"));
+	auto numbers = diskmap::table<uint64_t, uint64_t, Flags>::open(f, f.root("numbers"));
+	assert(strings.size() == n / 2 && numbers.size() == n / 2);
+	for(size_t i=0; i<n; i++) {
+		int32_t x = i;
+		std::optional<point> p = strings.find("key" + std::to_string(i));
+		std::optional<uint64_t> v = numbers.find(i);
+		if(i % 2 == 0) assert(!p && !v);
+		else assert(p && p->x == x && p->y == -x && p->z == 2 * x && v && *v == 3 * i);
+	}
+
+	size_t count = 0;
+	int64_t sum = 0;
+	for(auto entry : strings) {
+		assert(entry.key == "key" + std::to_string(entry.value.x));
+		sum += entry.value.x;
+		count++;
+	}
+	assert(count == n / 2 && sum == (int64_t)(n / 2) * (int64_t)(n / 2));
+	count = 0;
+	for(auto entry : numbers) {
+		assert(entry.value == 3 * entry.key);
+		count++;
+	}
+	assert(count == n / 2);
+
+	// another value type does not fit the buckets
+	bool thrown = false;
+	try {
+		diskmap::table<std::string, uint64_t, Flags>::open(f, f.root("strings"));
+	}
+	catch(const std::invalid_argument&) {
+		thrown = true;
+	}
+	assert(thrown);
+	f.close();
+	unlink(path.c_str());
+
+	printf("********************************************************************************\n");
+	printf("*** table %s successful (n = %zu)\n", name, n);
+	printf("********************************************************************************\n");
+}
+
+/** multi-maps with one value, a small array of values, and a nested table of values per key */
+void test_multimap() {
+	size_t n = 20000;
+	const char* path = "/tmp/diskmap_test_cpp_multimap";
+	unlink(path);
+	diskmap::file f = diskmap::file::create(path);
+	auto map = diskmap::multimap<std::string, std::string>::create(f);
+	for(size_t i=0; i<n; i++) {
+		std::string key = "key" + std::to_string(i);
+		for(size_t j=0; j<i % 20; j++) map.insert(key, "val" + std::to_string(j));
+	}
+	for(size_t i=0; i<n; i++) {
+		std::string key = "key" + std::to_string(i);
+		assert(map.count(key) == i % 20);
+		std::set<std::string> vals;
+		for(std::string_view val : map.values(key)) vals.insert(std::string(val));
+		assert(vals.size() == i % 20);
+		for(size_t j=0; j<i % 20; j++) assert(vals.count("val" + std::to_string(j)));
+	}
+	size_t keys = 0;
+	for(std::string_view key : map) {
+		assert(key.substr(0, 3) == "key");
+		keys++;
+	}
+	assert(keys == map.size());
+
+	assert(map.erase("key1", "val0") && !map.erase("key1", "val0"));
+	assert(map.erase("key19") && map.count("key19") == 0 && !map.contains("key19"));
+	assert(map.values("key19").begin() == map.values("key19").end());
+
+	auto reopened = diskmap::multimap<std::string, std::string>::open(f, map.header_ptr());
+	assert(reopened.count("key18") == 18);
+	f.close();
+	unlink(path);
+
+	printf("********************************************************************************\n");
+	printf("*** multimap successful (n = %zu)\n", n);
+	printf("********************************************************************************\n");
+}
+
+int main() {
+	test_table<0>("robin");
+	test_table<diskmap::inline_keys>("inline");
+	test_table<diskmap::swiss | diskmap::wyhash>("swiss");
+	test_table<diskmap::intern | diskmap::shrink>("intern");
+	test_multimap();
+	printf("all tests done, exiting\n");
+	return 0;
+}